@@ -22,6 +22,9 @@
 #define MAX_SETTINGS 97
 #define PLUGIN_NAME "cpu_freq"
 
+#define TURBO_NO_TURBO_PATH "/sys/devices/system/cpu/intel_pstate/no_turbo"
+#define TURBO_BOOST_PATH "/sys/devices/system/cpu/cpufreq/boost"
+
 static freq_gen_interface_t *interface;
 
 static cpu_set_t *responsible_cpus;
@@ -37,6 +40,20 @@ struct settings
     UT_hash_handle hh;
 };
 static struct settings *frequency_information_hashmap;
+
+/**
+ * sysfs interface used to switch turbo.
+ * intel_pstate/no_turbo has inverted logic (1 means turbo off), cpufreq/boost does not.
+ */
+typedef enum {
+    TURBO_INTERFACE_NONE,
+    TURBO_INTERFACE_NO_TURBO,
+    TURBO_INTERFACE_BOOST
+} turbo_interface;
+static turbo_interface turbo_if = TURBO_INTERFACE_NONE;
+static int default_turbo = -1;
+static int current_turbo = -1;
+
 typedef enum { LOG_VERBOSE, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_INVALID } log_level;
 
 /**
@@ -147,6 +164,96 @@ int init_responsible_cpus()
     return 1;
 }
 
+/**
+ * Reads the turbo state from the sysfs file of the used turbo interface.
+ *
+ * @return 1 if turbo is enabled, 0 if disabled, <0 on failure
+ */
+static int read_turbo()
+{
+    const char *path =
+        turbo_if == TURBO_INTERFACE_NO_TURBO ? TURBO_NO_TURBO_PATH : TURBO_BOOST_PATH;
+    int value;
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return -errno;
+    }
+    if (fscanf(f, "%d", &value) != 1)
+    {
+        fclose(f);
+        return -EIO;
+    }
+    fclose(f);
+    if (turbo_if == TURBO_INTERFACE_NO_TURBO)
+    {
+        return value ? 0 : 1;
+    }
+    return value ? 1 : 0;
+}
+
+/**
+ * Writes the turbo state to the sysfs file of the used turbo interface.
+ *
+ * @param enable 1 to enable turbo, 0 to disable it
+ * @return 0 on success, <0 on failure
+ */
+static int write_turbo(int enable)
+{
+    const char *path =
+        turbo_if == TURBO_INTERFACE_NO_TURBO ? TURBO_NO_TURBO_PATH : TURBO_BOOST_PATH;
+    int value = turbo_if == TURBO_INTERFACE_NO_TURBO ? !enable : enable;
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        return -errno;
+    }
+    if (fprintf(f, "%d", value) < 0)
+    {
+        fclose(f);
+        return -EIO;
+    }
+    if (fclose(f) != 0)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Looks for a writable turbo interface and saves the turbo state found at init.
+ *
+ * intel_pstate/no_turbo is preferred over cpufreq/boost. If none is found TURBO can not be tuned.
+ */
+static void init_turbo()
+{
+    if (access(TURBO_NO_TURBO_PATH, W_OK) == 0)
+    {
+        turbo_if = TURBO_INTERFACE_NO_TURBO;
+    }
+    else if (access(TURBO_BOOST_PATH, W_OK) == 0)
+    {
+        turbo_if = TURBO_INTERFACE_BOOST;
+    }
+    else
+    {
+        llog(LOG_INFO, "No writable turbo interface found, TURBO will not be tuned");
+        return;
+    }
+
+    default_turbo = read_turbo();
+    if (default_turbo < 0)
+    {
+        llog(LOG_WARN, "Could not read turbo state: %s", strerror(-default_turbo));
+        turbo_if = TURBO_INTERFACE_NONE;
+        return;
+    }
+    current_turbo = default_turbo;
+    llog(LOG_DEBUG, "Using %s for turbo, default turbo state %d",
+        turbo_if == TURBO_INTERFACE_NO_TURBO ? TURBO_NO_TURBO_PATH : TURBO_BOOST_PATH,
+        default_turbo);
+}
+
 /**
  * Initialize the plugin
  *
@@ -293,6 +400,8 @@ int32_t init()
         llog(LOG_DEBUG, "Default Setting found  for %lli\n", default_freq);
     }
 
+    init_turbo();
+
     return 0;
 }
 
@@ -443,6 +552,65 @@ static int scorep_get_cpu_freq()
     return (int) freq;
 }
 
+/**
+ * Enables or disables turbo
+ *
+ * The last state set is cached, so the sysfs file is only written on real transitions.
+ * A value of -1 restores the turbo state found at init.
+ *
+ * @param[in] new_settings 1 to enable turbo, 0 to disable it, -1 for default
+ * @return 0 on success or <0 on failure
+ */
+static int scorep_set_turbo(int new_settings)
+{
+    if (turbo_if == TURBO_INTERFACE_NONE)
+    {
+        llog(LOG_DEBUG, "No turbo interface available, ignoring TURBO = %d", new_settings);
+        return -1;
+    }
+    if (new_settings == -1)
+    {
+        new_settings = default_turbo;
+    }
+    else if (new_settings != 0 && new_settings != 1)
+    {
+        llog(LOG_WARN, "Invalid value for turbo = %d received, has to be 0 or 1", new_settings);
+        return -1;
+    }
+    if (new_settings == current_turbo)
+    {
+        return 0;
+    }
+
+    int rt = write_turbo(new_settings);
+    if (rt < 0)
+    {
+        llog(LOG_WARN, "Could not set turbo to %d: %s", new_settings, strerror(-rt));
+        current_turbo = -1;
+        return rt;
+    }
+    llog(LOG_DEBUG, "set turbo from %d to %d", current_turbo, new_settings);
+    current_turbo = new_settings;
+    return 0;
+}
+
+/** gets the cached turbo state
+ *
+ *  @return 1 if turbo is enabled, 0 if disabled, -1 if unknown
+ */
+static int scorep_get_turbo()
+{
+    if (turbo_if != TURBO_INTERFACE_NONE && current_turbo == -1)
+    {
+        current_turbo = read_turbo();
+        if (current_turbo < 0)
+        {
+            current_turbo = -1;
+        }
+    }
+    return current_turbo;
+}
+
 /**
  * Gets the cpu affinity of the CPU Thread and adds it to the responsible cpus list
  * If the init_device fails for the requested CPU thread, this CPU will not be tuned.
@@ -525,6 +693,10 @@ void delete_location(RRL_LocationType location_type, uint32_t location_id)
 void fini()
 {
     llog(LOG_INFO, "CPU_FREQU tuning plugin: finalising");
+    if (turbo_if != TURBO_INTERFACE_NONE)
+    {
+        scorep_set_turbo(default_turbo);
+    }
     struct settings *s = NULL, *temp = NULL;
     HASH_ITER(hh, frequency_information_hashmap, s, temp)
     {
@@ -552,6 +724,12 @@ static rrl_tuning_action_info return_values[] = {
         .enter_region_set_config = &scorep_set_cpu_freq, /**< function to call on enter event*/
         .exit_region_set_config = &scorep_set_cpu_freq   /**< function to call on exit event*/
     },
+    {
+        .name = "TURBO",
+        .current_config = &scorep_get_turbo,
+        .enter_region_set_config = &scorep_set_turbo,
+        .exit_region_set_config = &scorep_set_turbo
+    },
     {.name = NULL,
         .current_config = NULL,
         .enter_region_set_config = NULL,
@@ -0,0 +1,612 @@
+/**
+ * @file mempolicy_plugin.c
+ *
+ * @brief Tuning Plugin for the NUMA memory policy and transparent huge pages
+ *
+ * set_mempolicy() only changes the policy of the calling thread. The requested policy is
+ * therefore kept globally and each thread keeps a shadow copy of the policy it applied. The
+ * thread that changes the policy sends a signal to all other registered threads, whose handler
+ * applies the requested policy, and waits until they did. A thread also applies the requested
+ * policy when it is created (create_location) and whenever it calls into the plugin while its
+ * shadow copy is outdated, which covers threads the signal did not reach.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <scorep/rrl_tuning_plugins.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PLUGIN_NAME "MEMPOLICY_TP"
+
+/**
+ * Encoding of the MEMPOLICY tuning action:
+ *
+ *  * -1: policy found at init
+ *  * 0: MPOL_DEFAULT
+ *  * 1: MPOL_LOCAL
+ *  * 2: MPOL_INTERLEAVE over all allowed nodes
+ *  * MEMPOLICY_PREFERRED_BASE + n: MPOL_PREFERRED node n
+ */
+#define MEMPOLICY_INIT -1
+#define MEMPOLICY_DEFAULT 0
+#define MEMPOLICY_LOCAL 1
+#define MEMPOLICY_INTERLEAVE 2
+#define MEMPOLICY_PREFERRED_BASE 1000
+
+/* signal offset from SIGRTMIN used to notify other threads, if
+ * SCOREP_TUNING_MEMPOLICY_PLUGIN_SIGNAL is not set */
+#define DEFAULT_SIGNAL_OFFSET 7
+/* how long a policy change waits for the other threads to apply it */
+#define SIGNAL_TIMEOUT_NS 100000000L
+
+#define MAX_NODES 1024
+#define NODEMASK_WORDS (MAX_NODES / (8 * sizeof(unsigned long)))
+
+static unsigned long allowed_nodes[NODEMASK_WORDS];
+
+static int default_mode;
+static unsigned long default_nodes[NODEMASK_WORDS];
+
+/* requested policy, shared by all threads */
+static atomic_int requested_mempolicy = ATOMIC_VAR_INIT(MEMPOLICY_INIT);
+/* policy applied by the calling thread, -2 if nothing was applied yet */
+static __thread int applied_mempolicy = -2;
+
+/* thread IDs of the registered threads, protected by threads_mutex */
+static pid_t *tids;
+static int num_tids;
+static int tids_capacity;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* signal that makes a thread apply the requested policy, 0 if threads are not signalled */
+static int notify_signal;
+/* threads that applied the policy after the last notification */
+static atomic_int notify_acks = ATOMIC_VAR_INIT(0);
+
+static int default_thp = -1;
+static int current_thp = -1;
+
+typedef enum { LOG_VERBOSE, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_INVALID } log_level;
+
+/**
+ * log function.
+ *
+ * Prints messages depending on the entry in SCOREP_TUNING_MEMPOLICY_PLUGIN_VERBOSE.
+ *
+ * Currently implemented log levels are:
+ *
+ *	* LOG_VERBOSE
+ *	* LOG_WARN
+ *	* LOG_INFO
+ *	* LOG_DEBUG
+ *
+ * @param[in] msg_level level of message
+ * @param[in] message_fmt printf like message
+ * @param[in] ... printf like parameters for the message
+ */
+void llog(log_level msg_level, const char *message_fmt, ...)
+{
+    static char *level_str = NULL;
+    static log_level level = LOG_INVALID;
+    if (level == LOG_INVALID)
+    {
+        level_str = getenv("SCOREP_TUNING_MEMPOLICY_PLUGIN_VERBOSE");
+        if (level_str == NULL)
+        {
+            level = LOG_WARN;
+        }
+        else if (strcmp(level_str, "DEBUG") == 0)
+        {
+            level = LOG_DEBUG;
+        }
+        else if (strcmp(level_str, "INFO") == 0)
+        {
+            level = LOG_INFO;
+        }
+        else if (strcmp(level_str, "WARN") == 0)
+        {
+            level = LOG_WARN;
+        }
+        else if (strcmp(level_str, "VERBOSE") == 0)
+        {
+            level = LOG_VERBOSE;
+        }
+        else
+        {
+            level = LOG_WARN;
+        }
+    }
+    if (msg_level <= level)
+    {
+        char *output_fmt = (char *) malloc(strlen(message_fmt) + strlen(PLUGIN_NAME) + 5);
+        strcpy(output_fmt, "[");
+        strcpy(output_fmt + 1, PLUGIN_NAME);
+        strcpy(output_fmt + 1 + strlen(PLUGIN_NAME), "]");
+        strcpy(output_fmt + 2 + strlen(PLUGIN_NAME), message_fmt);
+        strcpy(output_fmt + 2 + strlen(PLUGIN_NAME) + strlen(message_fmt), "\n");
+        va_list args;
+        va_start(args, message_fmt);
+        vprintf(output_fmt, args);
+        va_end(args);
+    }
+}
+
+static long sys_set_mempolicy(int mode, const unsigned long *nodemask, unsigned long maxnode)
+{
+    return syscall(SYS_set_mempolicy, mode, nodemask, maxnode);
+}
+
+static long sys_get_mempolicy(int *mode,
+    unsigned long *nodemask,
+    unsigned long maxnode,
+    void *addr,
+    unsigned long flags)
+{
+    return syscall(SYS_get_mempolicy, mode, nodemask, maxnode, addr, flags);
+}
+
+/**
+ * Checks whether a policy value is valid.
+ */
+static int valid_mempolicy(int policy)
+{
+    if (policy >= MEMPOLICY_INIT && policy <= MEMPOLICY_INTERLEAVE)
+    {
+        return 1;
+    }
+    if (policy >= MEMPOLICY_PREFERRED_BASE && policy < MEMPOLICY_PREFERRED_BASE + MAX_NODES)
+    {
+        int node = policy - MEMPOLICY_PREFERRED_BASE;
+        return (allowed_nodes[node / (8 * sizeof(unsigned long))] >>
+                   (node % (8 * sizeof(unsigned long)))) &
+               1;
+    }
+    return 0;
+}
+
+/**
+ * Applies a policy to the calling thread.
+ *
+ * @return 0 on success, -errno on failure
+ */
+static int apply_mempolicy(int policy)
+{
+    unsigned long nodes[NODEMASK_WORDS];
+    long rt;
+
+    switch (policy)
+    {
+        case MEMPOLICY_INIT:
+            rt = sys_set_mempolicy(default_mode, default_nodes, MAX_NODES + 1);
+            break;
+        case MEMPOLICY_DEFAULT:
+            rt = sys_set_mempolicy(MPOL_DEFAULT, NULL, 0);
+            break;
+        case MEMPOLICY_LOCAL:
+            rt = sys_set_mempolicy(MPOL_LOCAL, NULL, 0);
+            break;
+        case MEMPOLICY_INTERLEAVE:
+            rt = sys_set_mempolicy(MPOL_INTERLEAVE, allowed_nodes, MAX_NODES + 1);
+            break;
+        default:
+        {
+            int node = policy - MEMPOLICY_PREFERRED_BASE;
+            memset(nodes, 0, sizeof(nodes));
+            nodes[node / (8 * sizeof(unsigned long))] =
+                1UL << (node % (8 * sizeof(unsigned long)));
+            rt = sys_set_mempolicy(MPOL_PREFERRED, nodes, MAX_NODES + 1);
+            break;
+        }
+    }
+    if (rt != 0)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Applies the requested policy to the calling thread, if the thread did not apply it yet.
+ * Repeats if the request changed meanwhile, as the signal handler may have applied a newer
+ * policy between the system call and the update of the shadow copy.
+ *
+ * @return 0 on success, <0 on failure
+ */
+static int sync_mempolicy()
+{
+    int policy;
+    while ((policy = atomic_load_explicit(&requested_mempolicy, memory_order_relaxed)) !=
+           applied_mempolicy)
+    {
+        int rt = apply_mempolicy(policy);
+        if (rt < 0)
+        {
+            llog(LOG_WARN, "Could not set memory policy %d for thread %ld: %s", policy,
+                (long) syscall(SYS_gettid), strerror(-rt));
+            return rt;
+        }
+        llog(LOG_DEBUG, "set memory policy of thread %ld from %d to %d",
+            (long) syscall(SYS_gettid), applied_mempolicy, policy);
+        applied_mempolicy = policy;
+    }
+    return 0;
+}
+
+/**
+ * Signal handler of notify_signal. Applies the requested policy to the interrupted thread. Only
+ * uses async-signal-safe calls and keeps errno.
+ */
+static void notify_handler(int sig)
+{
+    (void) sig;
+    int saved_errno = errno;
+    int policy = atomic_load_explicit(&requested_mempolicy, memory_order_relaxed);
+    /* applied even if the shadow copy matches, it may be stale if the thread was interrupted in
+     * sync_mempolicy */
+    if (apply_mempolicy(policy) == 0)
+    {
+        applied_mempolicy = policy;
+    }
+    atomic_fetch_add_explicit(&notify_acks, 1, memory_order_release);
+    errno = saved_errno;
+}
+
+/**
+ * Installs notify_handler for the signal selected by SCOREP_TUNING_MEMPOLICY_PLUGIN_SIGNAL,
+ * unless the application handles that signal already.
+ */
+static void init_notify_signal()
+{
+    int sig = SIGRTMIN + DEFAULT_SIGNAL_OFFSET;
+    const char *env = getenv("SCOREP_TUNING_MEMPOLICY_PLUGIN_SIGNAL");
+    if (env != NULL && env[0] != '\0')
+    {
+        sig = atoi(env);
+        if (sig == 0)
+        {
+            llog(LOG_INFO, "Not signalling threads, they apply the policy when they call into "
+                           "the plugin");
+            return;
+        }
+        if (sig < SIGRTMIN || sig > SIGRTMAX)
+        {
+            llog(LOG_WARN, "Invalid signal %d, has to be in [%d, %d]", sig, SIGRTMIN, SIGRTMAX);
+            return;
+        }
+    }
+    struct sigaction old_action;
+    if (sigaction(sig, NULL, &old_action) != 0 || old_action.sa_handler != SIG_DFL)
+    {
+        llog(LOG_WARN, "Signal %d is in use, threads apply the policy when they call into the "
+                       "plugin",
+            sig);
+        return;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = notify_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(sig, &action, NULL) != 0)
+    {
+        llog(LOG_WARN, "Could not install handler for signal %d: %s", sig, strerror(errno));
+        return;
+    }
+    notify_signal = sig;
+    llog(LOG_DEBUG, "notifying threads with signal %d", sig);
+}
+
+/**
+ * Registers the thread ID of the calling thread.
+ */
+static void register_thread()
+{
+    pid_t tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&threads_mutex);
+    for (int i = 0; i < num_tids; i++)
+    {
+        if (tids[i] == tid)
+        {
+            pthread_mutex_unlock(&threads_mutex);
+            return;
+        }
+    }
+    if (num_tids == tids_capacity)
+    {
+        int new_capacity = tids_capacity == 0 ? 16 : tids_capacity * 2;
+        pid_t *new_tids = realloc(tids, new_capacity * sizeof(pid_t));
+        if (new_tids == NULL)
+        {
+            llog(LOG_WARN, "memory failure %s", strerror(errno));
+            pthread_mutex_unlock(&threads_mutex);
+            return;
+        }
+        tids = new_tids;
+        tids_capacity = new_capacity;
+    }
+    tids[num_tids++] = tid;
+    pthread_mutex_unlock(&threads_mutex);
+    llog(LOG_DEBUG, "registered thread %d", (int) tid);
+}
+
+/**
+ * Signals all registered threads but the calling one to apply the requested policy, and waits
+ * up to SIGNAL_TIMEOUT_NS until they did. Threads that block the signal apply the policy when
+ * they call into the plugin. Changes are serialized by threads_mutex.
+ */
+static void notify_threads()
+{
+    if (notify_signal == 0)
+    {
+        return;
+    }
+    pid_t pid = getpid();
+    pid_t self = syscall(SYS_gettid);
+    int sent = 0;
+
+    pthread_mutex_lock(&threads_mutex);
+    atomic_store_explicit(&notify_acks, 0, memory_order_relaxed);
+    for (int i = 0; i < num_tids; i++)
+    {
+        if (tids[i] == self)
+        {
+            continue;
+        }
+        if (syscall(SYS_tgkill, pid, tids[i], notify_signal) == 0)
+        {
+            sent++;
+        }
+        else
+        {
+            llog(LOG_DEBUG, "Could not signal thread %d: %s", (int) tids[i], strerror(errno));
+        }
+    }
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (atomic_load_explicit(&notify_acks, memory_order_acquire) < sent)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) >
+            SIGNAL_TIMEOUT_NS)
+        {
+            llog(LOG_INFO, "%d of %d threads did not apply the memory policy in time", sent -
+                atomic_load(&notify_acks), sent);
+            break;
+        }
+        sched_yield();
+    }
+    pthread_mutex_unlock(&threads_mutex);
+}
+
+/**
+ * Initialize the plugin
+ *
+ * Saves the memory policy and THP setting found at init, and the nodes the process may
+ * allocate on.
+ *
+ * @return 0 at success, -1 at failure
+ */
+int32_t init()
+{
+    llog(LOG_DEBUG, "GIT revision: %s", GIT_REV);
+    llog(LOG_VERBOSE, "MEMPOLICY tuning plugin: initializing");
+
+    if (sys_get_mempolicy(NULL, allowed_nodes, MAX_NODES + 1, NULL, MPOL_F_MEMS_ALLOWED) != 0)
+    {
+        llog(LOG_WARN, "get_mempolicy failed: %s", strerror(errno));
+        return -1;
+    }
+    if (sys_get_mempolicy(&default_mode, default_nodes, MAX_NODES + 1, NULL, 0) != 0)
+    {
+        llog(LOG_WARN, "get_mempolicy failed: %s", strerror(errno));
+        return -1;
+    }
+    llog(LOG_DEBUG, "default memory policy mode %d", default_mode);
+    applied_mempolicy = MEMPOLICY_INIT;
+    init_notify_signal();
+    register_thread();
+
+    default_thp = prctl(PR_GET_THP_DISABLE, 0, 0, 0, 0);
+    if (default_thp < 0)
+    {
+        llog(LOG_INFO, "PR_GET_THP_DISABLE not supported: %s, THP will not be tuned",
+            strerror(errno));
+        default_thp = -1;
+    }
+    else
+    {
+        /* THP is enabled if the disable flag is not set */
+        default_thp = !default_thp;
+        current_thp = default_thp;
+        llog(LOG_DEBUG, "default THP state %d", default_thp);
+    }
+
+    return 0;
+}
+
+/**
+ * Registers the new CPU thread and applies the requested memory policy to it
+ */
+void create_location(RRL_LocationType location_type, uint32_t location_id)
+{
+    llog(LOG_DEBUG, "create_location for location %u with typ %u ", location_id, location_type);
+    if (location_type == RRL_LOCATION_TYPE_CPU_THREAD)
+    {
+        register_thread();
+        sync_mempolicy();
+    }
+}
+
+/**
+ * Unregisters a CPU thread that ends, so it is no longer signalled.
+ */
+void delete_location(RRL_LocationType location_type, uint32_t location_id)
+{
+    llog(LOG_DEBUG, "delete_location for location %u with typ %u ", location_id, location_type);
+    if (location_type == RRL_LOCATION_TYPE_CPU_THREAD)
+    {
+        pid_t tid = syscall(SYS_gettid);
+        pthread_mutex_lock(&threads_mutex);
+        for (int i = 0; i < num_tids; i++)
+        {
+            if (tids[i] == tid)
+            {
+                tids[i] = tids[--num_tids];
+                llog(LOG_DEBUG, "unregistered thread %d", (int) tid);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&threads_mutex);
+    }
+}
+
+/**
+ * Set the THP state
+ *
+ * The setting is process wide. It is cached, so prctl() is only called on changes.
+ *
+ * @param[in] new_settings 1 to enable THP, 0 to disable it, -1 for the state found at init
+ * @return 0 on success or <0 on failure
+ */
+static int scorep_set_thp(int new_settings)
+{
+    if (default_thp == -1)
+    {
+        return -1;
+    }
+    if (new_settings == -1)
+    {
+        new_settings = default_thp;
+    }
+    else if (new_settings != 0 && new_settings != 1)
+    {
+        llog(LOG_WARN, "Invalid value for THP = %d received, has to be 0 or 1", new_settings);
+        return -1;
+    }
+    if (new_settings == current_thp)
+    {
+        return 0;
+    }
+    if (prctl(PR_SET_THP_DISABLE, !new_settings, 0, 0, 0) != 0)
+    {
+        llog(LOG_WARN, "Could not set THP to %d: %s", new_settings, strerror(errno));
+        return -errno;
+    }
+    llog(LOG_DEBUG, "set THP from %d to %d", current_thp, new_settings);
+    current_thp = new_settings;
+    return 0;
+}
+
+static int scorep_get_thp()
+{
+    return current_thp;
+}
+
+/**
+ * finalising the plugin
+ *
+ * restores the memory policy found at init on all registered threads and the THP state.
+ */
+void fini()
+{
+    llog(LOG_INFO, "MEMPOLICY tuning plugin: finalising");
+    atomic_store(&requested_mempolicy, MEMPOLICY_INIT);
+    sync_mempolicy();
+    notify_threads();
+    scorep_set_thp(-1);
+}
+
+/**
+ * Set the memory policy
+ *
+ * Applies the policy to the calling thread and signals the other registered threads to apply
+ * it, if the policy changed.
+ *
+ * @param[in] new_settings encoded memory policy, see MEMPOLICY_* above
+ * @return 0 on success or <0 on failure
+ */
+static int scorep_set_mempolicy(int new_settings)
+{
+    if (!valid_mempolicy(new_settings))
+    {
+        llog(LOG_WARN, "Invalid memory policy %d received", new_settings);
+        return -1;
+    }
+    int old_settings = atomic_exchange_explicit(
+        &requested_mempolicy, new_settings, memory_order_relaxed);
+    int rt = sync_mempolicy();
+    if (old_settings != new_settings)
+    {
+        notify_threads();
+    }
+    return rt;
+}
+
+static int scorep_get_mempolicy()
+{
+    sync_mempolicy();
+    return applied_mempolicy;
+}
+
+/**
+ * ScoreP array for plugin definitions
+ */
+static rrl_tuning_action_info return_values[] = {
+    {
+        .name = "MEMPOLICY",
+        .current_config = &scorep_get_mempolicy,
+        .enter_region_set_config = &scorep_set_mempolicy,
+        .exit_region_set_config = &scorep_set_mempolicy,
+    },
+    {
+        .name = "THP",
+        .current_config = &scorep_get_thp,
+        .enter_region_set_config = &scorep_set_thp,
+        .exit_region_set_config = &scorep_set_thp,
+    },
+    {
+        .name = NULL,
+        .current_config = NULL,
+        .enter_region_set_config = NULL,
+        .exit_region_set_config = NULL,
+    }};
+
+/**
+ * ScoreP function to get plugin definitions
+ *
+ * @param return return_values.
+ */
+rrl_tuning_action_info *get_tuning_info()
+{
+    return return_values;
+}
+
+/**
+ * Macro to setup the plugin
+ */
+RRL_TUNING_PLUGIN_ENTRY(mempolicy_plugin)
+{
+    /* Initialize info data (with zero) */
+    rrl_tuning_plugin_info info;
+    memset(&info, 0, sizeof(rrl_tuning_plugin_info));
+
+    /* Set up */
+    info.plugin_version = RRL_TUNING_PLUGIN_VERSION;
+    info.initialize = init;
+    info.get_tuning_info = get_tuning_info;
+    info.finalize = fini;
+    info.create_location = create_location;
+    info.delete_location = delete_location;
+    return info;
+}
@@ -0,0 +1,271 @@
+/*
+ * mpi_histogram,
+ *
+ * Message size histograms for the MPI_T tuning plugin.
+ * Copyright (C) 2015 TU Dresden, ZIH
+ *
+ * @brief Counts the message sizes of the calls libmpit_histogram.so intercepts, per calling
+ * thread and region tag.
+ *
+ */
+
+#include "mpi_histogram.h"
+#include "mpit_log.h"
+
+#include <atomic>
+#include <dlfcn.h>
+#include <errno.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+
+namespace mpi_histogram
+{
+
+static const char *call_names[NUM_CALLS] = { "MPI_Send", "MPI_Isend", "MPI_Recv", "MPI_Irecv",
+    "MPI_Bcast", "MPI_Reduce", "MPI_Allreduce", "MPI_Allgather", "MPI_Alltoall" };
+
+/**
+ * Histograms of one region tag. Only the owning thread writes the counters, with relaxed loads
+ * and stores, so other threads can read them while it records.
+ */
+struct region_histograms
+{
+    std::atomic<uint64_t> calls[NUM_CALLS][NUM_BUCKETS];
+
+    region_histograms()
+    {
+        for (int c = 0; c < NUM_CALLS; c++)
+        {
+            for (int b = 0; b < NUM_BUCKETS; b++)
+            {
+                calls[c][b].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+/**
+ * Histograms of one thread. The owning thread locks mutex only to add a region, other threads
+ * lock it to read regions.
+ */
+struct thread_histograms
+{
+    std::unordered_map<int, region_histograms> regions;
+    std::mutex mutex;
+    /** histograms of the region recorded last, which is usually the next one */
+    int last_region = 0;
+    region_histograms *last = nullptr;
+};
+
+typedef void (*set_recorder_fn)(mpit_histogram_recorder recorder);
+
+static std::atomic<bool> enabled(false);
+/** set once a call was recorded */
+static std::atomic<bool> seen(false);
+static set_recorder_fn set_recorder = nullptr;
+static int (*region_of_thread)() = nullptr;
+static std::vector<thread_histograms *> threads;
+static std::mutex threads_mutex;
+static thread_local thread_histograms *this_thread = nullptr;
+
+static thread_histograms *get_thread()
+{
+    thread_histograms *thread = this_thread;
+    if (thread == nullptr)
+    {
+        thread = new thread_histograms();
+        this_thread = thread;
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        threads.push_back(thread);
+    }
+    return thread;
+}
+
+static int get_bucket(uint64_t bytes)
+{
+    int bucket = (bytes == 0) ? 0 : 64 - __builtin_clzll(bytes);
+    return (bucket < NUM_BUCKETS) ? bucket : NUM_BUCKETS - 1;
+}
+
+/**
+ * Counts one message of count elements of datatype in the current region of the thread. Called
+ * by the wrappers of libmpit_histogram.so.
+ */
+static void record(int c, int count, MPI_Datatype datatype)
+{
+    if (!enabled.load(std::memory_order_relaxed) || c < 0 || c >= NUM_CALLS)
+    {
+        return;
+    }
+    if (!seen.load(std::memory_order_relaxed))
+    {
+        seen.store(true, std::memory_order_relaxed);
+    }
+    int size = 0;
+    if (PMPI_Type_size(datatype, &size) != MPI_SUCCESS)
+    {
+        return;
+    }
+    thread_histograms *thread = get_thread();
+    int region = region_of_thread();
+    if (thread->last == nullptr || thread->last_region != region)
+    {
+        std::lock_guard<std::mutex> lock(thread->mutex);
+        thread->last_region = region;
+        thread->last = &thread->regions[region];
+    }
+    std::atomic<uint64_t> &counter =
+        thread->last->calls[c][get_bucket((uint64_t) count * (uint64_t) size)];
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+bool init(int (*current_region)())
+{
+    const char *env = getenv("SCOREP_TUNING_MPIT_PLUGIN_HISTOGRAM");
+    if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0)
+    {
+        return false;
+    }
+    set_recorder = (set_recorder_fn) dlsym(RTLD_DEFAULT, "mpit_histogram_set_recorder");
+    if (set_recorder == nullptr)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: SCOREP_TUNING_MPIT_PLUGIN_HISTOGRAM is set, but "
+                       "libmpit_histogram.so is not loaded, e.g. with LD_PRELOAD. No histograms "
+                       "are recorded.\n");
+        return false;
+    }
+    region_of_thread = current_region;
+    enabled.store(true);
+    set_recorder(record);
+    return true;
+}
+
+bool is_enabled()
+{
+    return enabled.load(std::memory_order_relaxed);
+}
+
+const char *get_call_name(call c)
+{
+    return call_names[c];
+}
+
+call find_call(const std::string &name)
+{
+    for (int c = 0; c < NUM_CALLS; c++)
+    {
+        if (name == call_names[c])
+        {
+            return (call) c;
+        }
+    }
+    return NUM_CALLS;
+}
+
+uint64_t get_bucket_min(int bucket)
+{
+    return (bucket == 0) ? 0 : 1ull << (bucket - 1);
+}
+
+void get_process_histogram(int region, call c, uint64_t *histogram)
+{
+    memset(histogram, 0, NUM_BUCKETS * sizeof(uint64_t));
+    std::lock_guard<std::mutex> threads_lock(threads_mutex);
+    for (thread_histograms *thread : threads)
+    {
+        std::lock_guard<std::mutex> lock(thread->mutex);
+        auto it = thread->regions.find(region);
+        if (it == thread->regions.end())
+        {
+            continue;
+        }
+        for (int b = 0; b < NUM_BUCKETS; b++)
+        {
+            histogram[b] += it->second.calls[c][b].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void fini(const std::string &file_name)
+{
+    if (!enabled.exchange(false))
+    {
+        return;
+    }
+    set_recorder(nullptr);
+    if (!seen.load())
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: no MPI call was intercepted for the histograms, "
+                       "libmpit_histogram.so has to be found before the MPI library\n");
+        return;
+    }
+
+    typedef uint64_t histogram[NUM_BUCKETS];
+    struct region_sum
+    {
+        histogram calls[NUM_CALLS] = {};
+    };
+    std::unordered_map<int, region_sum> regions;
+    for (thread_histograms *thread : threads)
+    {
+        for (const auto &region : thread->regions)
+        {
+            region_sum &sum = regions[region.first];
+            for (int c = 0; c < NUM_CALLS; c++)
+            {
+                for (int b = 0; b < NUM_BUCKETS; b++)
+                {
+                    sum.calls[c][b] += region.second.calls[c][b].load();
+                }
+            }
+        }
+        delete thread;
+    }
+    threads.clear();
+    this_thread = nullptr;
+    if (regions.empty())
+    {
+        return;
+    }
+
+    FILE *file = fopen(file_name.c_str(), "w");
+    if (file == NULL)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: can not write %s: %s\n", file_name.c_str(),
+            strerror(errno));
+        return;
+    }
+    fprintf(file, "region,call,bytes_min,bytes_max,count\n");
+    for (const auto &region : regions)
+    {
+        for (int c = 0; c < NUM_CALLS; c++)
+        {
+            for (int b = 0; b < NUM_BUCKETS; b++)
+            {
+                if (region.second.calls[c][b] == 0)
+                {
+                    continue;
+                }
+                if (b == NUM_BUCKETS - 1)
+                {
+                    fprintf(file, "%d,%s,%llu,,%llu\n", region.first, call_names[c],
+                        (unsigned long long) get_bucket_min(b),
+                        (unsigned long long) region.second.calls[c][b]);
+                }
+                else
+                {
+                    fprintf(file, "%d,%s,%llu,%llu,%llu\n", region.first, call_names[c],
+                        (unsigned long long) get_bucket_min(b),
+                        (unsigned long long) get_bucket_min(b + 1) - 1,
+                        (unsigned long long) region.second.calls[c][b]);
+                }
+            }
+        }
+    }
+    fclose(file);
+}
+
+} // namespace mpi_histogram
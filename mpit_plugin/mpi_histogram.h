@@ -0,0 +1,100 @@
+/*
+ * mpi_histogram,
+ *
+ * Message size histograms for the MPI_T tuning plugin.
+ * Copyright (C) 2015 TU Dresden, ZIH
+ *
+ * @brief The histograms are kept by the plugin. The MPI calls are intercepted by the separate
+ * library libmpit_histogram.so, which passes every call to the recorder the plugin registers with
+ * mpit_histogram_set_recorder().
+ *
+ */
+
+#ifndef MPI_HISTOGRAM_H_
+#define MPI_HISTOGRAM_H_
+
+#include <mpi.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace mpi_histogram
+{
+
+/** MPI calls with a histogram */
+enum call
+{
+    CALL_SEND,
+    CALL_ISEND,
+    CALL_RECV,
+    CALL_IRECV,
+    CALL_BCAST,
+    CALL_REDUCE,
+    CALL_ALLREDUCE,
+    CALL_ALLGATHER,
+    CALL_ALLTOALL,
+    NUM_CALLS
+};
+
+/**
+ * Bucket 0 counts messages of 0 bytes, bucket b > 0 messages of [2^(b-1), 2^b) bytes. The last
+ * bucket also counts all larger messages.
+ */
+static const int NUM_BUCKETS = 40;
+
+/**
+ * Enables the recording if SCOREP_TUNING_MPIT_PLUGIN_HISTOGRAM is set and libmpit_histogram.so
+ * is loaded.
+ *
+ * @param current_region returns the region tag of the calling thread
+ * @return true if enabled
+ */
+bool init(int (*current_region)());
+
+/**
+ * Stops the recording. Writes the histograms of all threads to file_name and frees them. Warns
+ * if no call was recorded at all, as the wrappers were then not used.
+ */
+void fini(const std::string &file_name);
+
+bool is_enabled();
+
+/**
+ * @return the name of the MPI function, e.g. "MPI_Reduce"
+ */
+const char *get_call_name(call c);
+
+/**
+ * @return the call named name, NUM_CALLS if there is none
+ */
+call find_call(const std::string &name);
+
+/**
+ * @return the smallest message size of bucket
+ */
+uint64_t get_bucket_min(int bucket);
+
+/**
+ * Sums the histograms of a call in a region over all threads of the process.
+ *
+ * @param[out] histogram NUM_BUCKETS counts
+ */
+void get_process_histogram(int region, call c, uint64_t *histogram);
+
+} // namespace mpi_histogram
+
+extern "C" {
+
+/**
+ * Records one call of count elements of datatype, c is a mpi_histogram::call.
+ */
+typedef void (*mpit_histogram_recorder)(int c, int count, MPI_Datatype datatype);
+
+/**
+ * Defined by libmpit_histogram.so. Sets the function its wrappers pass the calls to, NULL to
+ * stop passing them.
+ */
+void mpit_histogram_set_recorder(mpit_histogram_recorder recorder);
+}
+
+#endif /* MPI_HISTOGRAM_H_ */
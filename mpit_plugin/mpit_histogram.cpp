@@ -0,0 +1,137 @@
+/*
+ * mpit_histogram,
+ *
+ * MPI wrappers for the message size histograms of the MPI_T tuning plugin.
+ * Copyright (C) 2015 TU Dresden, ZIH
+ *
+ * @brief Builds libmpit_histogram.so. Wraps the MPI calls whose protocols and algorithms depend
+ * on the message size, passes them to the recorder of the plugin, and calls the next definition
+ * found with dlsym(RTLD_NEXT, ...), so other MPI wrappers, like the ones of Score-P, still see
+ * the calls. The wrappers are only used if the library comes before the MPI library, e.g. with
+ * LD_PRELOAD.
+ *
+ */
+
+/* the library does not link MPI, so it must not reference the C++ bindings */
+#define OMPI_SKIP_MPICXX 1
+#define MPICH_SKIP_MPICXX 1
+
+#include "mpi_histogram.h"
+
+#include <atomic>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static std::atomic<mpit_histogram_recorder> recorder(nullptr);
+
+/**
+ * @return the next definition of the MPI function name, aborts if there is none
+ */
+static void *get_next(const char *name)
+{
+    void *next = dlsym(RTLD_NEXT, name);
+    if (next == NULL)
+    {
+        fprintf(stderr, "libmpit_histogram: can not find %s: %s\n", name, dlerror());
+        abort();
+    }
+    return next;
+}
+
+static void record(mpi_histogram::call c, int count, MPI_Datatype datatype)
+{
+    mpit_histogram_recorder current = recorder.load(std::memory_order_acquire);
+    if (current != nullptr)
+    {
+        current(c, count, datatype);
+    }
+}
+
+extern "C" {
+
+void mpit_histogram_set_recorder(mpit_histogram_recorder new_recorder)
+{
+    recorder.store(new_recorder, std::memory_order_release);
+}
+
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm)
+{
+    typedef int (*fn)(const void *, int, MPI_Datatype, int, int, MPI_Comm);
+    static fn next = (fn) get_next("MPI_Send");
+    record(mpi_histogram::CALL_SEND, count, datatype);
+    return next(buf, count, datatype, dest, tag, comm);
+}
+
+int MPI_Isend(const void *buf, int count, MPI_Datatype datatype, int dest, int tag,
+    MPI_Comm comm, MPI_Request *request)
+{
+    typedef int (*fn)(const void *, int, MPI_Datatype, int, int, MPI_Comm, MPI_Request *);
+    static fn next = (fn) get_next("MPI_Isend");
+    record(mpi_histogram::CALL_ISEND, count, datatype);
+    return next(buf, count, datatype, dest, tag, comm, request);
+}
+
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm,
+    MPI_Status *status)
+{
+    typedef int (*fn)(void *, int, MPI_Datatype, int, int, MPI_Comm, MPI_Status *);
+    static fn next = (fn) get_next("MPI_Recv");
+    record(mpi_histogram::CALL_RECV, count, datatype);
+    return next(buf, count, datatype, source, tag, comm, status);
+}
+
+int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm,
+    MPI_Request *request)
+{
+    typedef int (*fn)(void *, int, MPI_Datatype, int, int, MPI_Comm, MPI_Request *);
+    static fn next = (fn) get_next("MPI_Irecv");
+    record(mpi_histogram::CALL_IRECV, count, datatype);
+    return next(buf, count, datatype, source, tag, comm, request);
+}
+
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype, int root, MPI_Comm comm)
+{
+    typedef int (*fn)(void *, int, MPI_Datatype, int, MPI_Comm);
+    static fn next = (fn) get_next("MPI_Bcast");
+    record(mpi_histogram::CALL_BCAST, count, datatype);
+    return next(buffer, count, datatype, root, comm);
+}
+
+int MPI_Reduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op,
+    int root, MPI_Comm comm)
+{
+    typedef int (*fn)(const void *, void *, int, MPI_Datatype, MPI_Op, int, MPI_Comm);
+    static fn next = (fn) get_next("MPI_Reduce");
+    record(mpi_histogram::CALL_REDUCE, count, datatype);
+    return next(sendbuf, recvbuf, count, datatype, op, root, comm);
+}
+
+int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype,
+    MPI_Op op, MPI_Comm comm)
+{
+    typedef int (*fn)(const void *, void *, int, MPI_Datatype, MPI_Op, MPI_Comm);
+    static fn next = (fn) get_next("MPI_Allreduce");
+    record(mpi_histogram::CALL_ALLREDUCE, count, datatype);
+    return next(sendbuf, recvbuf, count, datatype, op, comm);
+}
+
+/* the size per process; the send arguments are ignored for MPI_IN_PLACE */
+int MPI_Allgather(const void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf,
+    int recvcount, MPI_Datatype recvtype, MPI_Comm comm)
+{
+    typedef int (*fn)(const void *, int, MPI_Datatype, void *, int, MPI_Datatype, MPI_Comm);
+    static fn next = (fn) get_next("MPI_Allgather");
+    record(mpi_histogram::CALL_ALLGATHER, recvcount, recvtype);
+    return next(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+}
+
+int MPI_Alltoall(const void *sendbuf, int sendcount, MPI_Datatype sendtype, void *recvbuf,
+    int recvcount, MPI_Datatype recvtype, MPI_Comm comm)
+{
+    typedef int (*fn)(const void *, int, MPI_Datatype, void *, int, MPI_Datatype, MPI_Comm);
+    static fn next = (fn) get_next("MPI_Alltoall");
+    record(mpi_histogram::CALL_ALLTOALL, recvcount, recvtype);
+    return next(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+}
+}
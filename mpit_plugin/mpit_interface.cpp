@@ -13,10 +13,18 @@
 
 #include "mpit_interface.h"
 
+#include <algorithm>
+#include <climits>
+#include <errno.h>
 #include <iostream>
+#include <limits>
+#include <stdint.h>
 
 namespace mpit_interface
 {
+/** identifies mpit_values and event_recorder instances in per-thread caches */
+static std::atomic<unsigned long long> next_instance_id(1);
+
 /**
  * translate an MPI-T scope int to a string
  *
@@ -180,310 +188,1790 @@ std::string get_mpit_datatype(MPI_Datatype datatype)
 }
 
 /**
- * Read the value from a given CVar, and save it into val.
+ * translate an MPI-T PVar class to a string
  *
- * @param cvar_index cvar to read
- * @param[out] val return value
+ * @param var_class class value to translate
  *
- * Throws an mpit_error if an MPI-T returns an error code.
+ * @return class as a string
  */
-void mpit_values::get_mpit_bind_no_object_int_values(int cvar_index, int *value)
+std::string get_mpit_pvar_class(int var_class)
 {
-    int err;
-    int count;
-    void *no_object_handel = NULL;
-    MPI_T_cvar_handle handle;
+    switch (var_class)
+    {
+    case MPI_T_PVAR_CLASS_STATE:
+        return "MPI_T_PVAR_CLASS_STATE";
+    case MPI_T_PVAR_CLASS_LEVEL:
+        return "MPI_T_PVAR_CLASS_LEVEL";
+    case MPI_T_PVAR_CLASS_SIZE:
+        return "MPI_T_PVAR_CLASS_SIZE";
+    case MPI_T_PVAR_CLASS_PERCENTAGE:
+        return "MPI_T_PVAR_CLASS_PERCENTAGE";
+    case MPI_T_PVAR_CLASS_HIGHWATERMARK:
+        return "MPI_T_PVAR_CLASS_HIGHWATERMARK";
+    case MPI_T_PVAR_CLASS_LOWWATERMARK:
+        return "MPI_T_PVAR_CLASS_LOWWATERMARK";
+    case MPI_T_PVAR_CLASS_COUNTER:
+        return "MPI_T_PVAR_CLASS_COUNTER";
+    case MPI_T_PVAR_CLASS_AGGREGATE:
+        return "MPI_T_PVAR_CLASS_AGGREGATE";
+    case MPI_T_PVAR_CLASS_TIMER:
+        return "MPI_T_PVAR_CLASS_TIMER";
+    case MPI_T_PVAR_CLASS_GENERIC:
+        return "MPI_T_PVAR_CLASS_GENERIC";
+    default:
+        return "Unknown";
+    }
+}
 
-    err = MPI_T_cvar_handle_alloc(cvar_index, no_object_handel, &handle, &count);
+/**
+ * Counters, aggregates and timers only grow, so the difference of two reads is what happened in
+ * between. The other classes describe a state, e.g. a queue length.
+ *
+ * @return true if the difference of two reads of a PVar of this class is meaningful
+ */
+bool is_cumulative_pvar_class(int var_class)
+{
+    return var_class == MPI_T_PVAR_CLASS_COUNTER || var_class == MPI_T_PVAR_CLASS_AGGREGATE ||
+           var_class == MPI_T_PVAR_CLASS_TIMER;
+}
 
-    if (err != MPI_SUCCESS)
+/**
+ * Checks whether a CVar can be read and written by this class, see check_supported().
+ *
+ * @param cvar_index CVar to check
+ *
+ * @return true if the datatype and binding of the CVar are supported
+ */
+bool mpit_values::is_supported(int cvar_index) const
+{
+    const cvar_info &info = get_cvar_info(cvar_index);
+    if (info.bind != MPI_T_BIND_NO_OBJECT && info.bind != MPI_T_BIND_MPI_COMM)
     {
-        throw mpit_error(get_mpit_error(err), err);
+        return false;
+    }
+    if (info.enumtype != MPI_T_ENUM_NULL)
+    {
+        return info.datatype == MPI_INT;
+    }
+    return info.datatype == MPI_INT || info.datatype == MPI_UNSIGNED ||
+           info.datatype == MPI_UNSIGNED_LONG || info.datatype == MPI_UNSIGNED_LONG_LONG ||
+           info.datatype == MPI_COUNT;
+}
+
+/**
+ * Supported are CVars without binding or bound to a communicator, of the types MPI_INT,
+ * MPI_UNSIGNED, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG_LONG and MPI_COUNT, and enumerations.
+ *
+ * Throws an mpit_error describing the CVar if it is not supported.
+ */
+void mpit_values::check_supported(int cvar_index) const
+{
+    if (is_supported(cvar_index))
+    {
+        return;
     }
+    const cvar_info &info = get_cvar_info(cvar_index);
+    throw mpit_error(std::string("error: Not supported: Bind:") + get_mpit_bind(info.bind) +
+                         std::string(" Datatype: ") + get_mpit_datatype(info.datatype) +
+                         std::string(" Enumtype: ") +
+                         (info.enumtype != MPI_T_ENUM_NULL ? "yes" : "empty") +
+                         std::string(" for parameter ") + info.name,
+        -1);
+}
 
-    /* The following assumes that the variable is */
-    /* represented by a single integer */
-    err = MPI_T_cvar_read(handle, value);
+/**
+ * Returns the state of a CVar.
+ *
+ * Throws a cvar_not_found exception if the index is not in the catalogue.
+ */
+cvar_state &mpit_values::get_state(int cvar_index) const
+{
+    get_cvar_info(cvar_index);
+    return *catalogue.load(std::memory_order_acquire)->states[cvar_index];
+}
 
-    if (err != MPI_SUCCESS)
+/**
+ * Returns the handle of a CVar. CVars bound to a communicator are bound to the communicator set
+ * with set_bind_comm(), MPI_COMM_WORLD by default. The handle is allocated on first use and kept
+ * until the instance is destroyed or the communicator changes.
+ *
+ * @param cvar_index CVar to get the handle for
+ *
+ * Throws an mpit_error if an MPI-T returns an error code, or if the CVar is not supported.
+ */
+MPI_T_cvar_handle mpit_values::get_handle(int cvar_index)
+{
+    cvar_state &state = get_state(cvar_index);
+    MPI_T_cvar_handle handle = state.handle.load(std::memory_order_acquire);
+    if (handle != MPI_T_CVAR_HANDLE_NULL)
     {
-        MPI_T_cvar_handle_free(&handle);
-        throw mpit_error(get_mpit_error(err), err);
+        return handle;
+    }
+    check_supported(cvar_index);
+    const cvar_info &info = get_cvar_info(cvar_index);
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    handle = state.handle.load(std::memory_order_relaxed);
+    if (handle != MPI_T_CVAR_HANDLE_NULL)
+    {
+        return handle;
+    }
+
+    void *object = NULL;
+    if (info.bind == MPI_T_BIND_MPI_COMM)
+    {
+        /* communicators, including MPI_COMM_WORLD, exist only between MPI_Init and
+         * MPI_Finalize */
+        int initialized = 0;
+        MPI_Initialized(&initialized);
+        if (!initialized)
+        {
+            throw mpit_error(
+                std::string("binding ") + info.name + " to a communicator before MPI_Init", -1);
+        }
+        object = &bind_comm;
     }
 
-    err = MPI_T_cvar_handle_free(&handle);
+    int count;
+    int err = MPI_T_cvar_handle_alloc(cvar_index, object, &handle, &count);
     if (err != MPI_SUCCESS)
     {
         throw mpit_error(get_mpit_error(err), err);
     }
+    if (count != 1)
+    {
+        MPI_T_cvar_handle_free(&handle);
+        throw mpit_error(std::string("CVar ") + info.name + " has " + std::to_string(count) +
+                             " elements, handle allocation",
+            -1);
+    }
+    state.handle.store(handle, std::memory_order_release);
+    return handle;
 }
 
 /**
- * set the value from a given CVar to val.
+ * Sets the communicator CVars with MPI_T_BIND_MPI_COMM are bound to. Handles bound to the
+ * previous communicator are freed, the next access allocates new ones.
  *
- * @param cvar_index CVar to set
- * @param val value to set the CVar to
+ * Must not be called while other threads use this instance.
  *
- * Throws an mpit_error if an MPI-T returns an error code.
+ * @param comm communicator to bind to, e.g. MPI_COMM_WORLD
+ */
+void mpit_values::set_bind_comm(MPI_Comm comm)
+{
+    if (comm == bind_comm)
+    {
+        return;
+    }
+    const cvar_catalogue *current = catalogue.load(std::memory_order_acquire);
+    for (size_t i = 0; i < current->cvars.size(); i++)
+    {
+        cvar_state &state = *current->states[i];
+        MPI_T_cvar_handle handle = state.handle.load();
+        if (current->cvars[i].bind == MPI_T_BIND_MPI_COMM && handle != MPI_T_CVAR_HANDLE_NULL)
+        {
+            MPI_T_cvar_handle_free(&handle);
+            state.handle.store(MPI_T_CVAR_HANDLE_NULL);
+            state.shadow_valid.store(false);
+        }
+    }
+    bind_comm = comm;
+}
+
+/**
+ * Buffer large enough for every supported datatype.
  */
-void mpit_values::set_mpit_bind_no_object_int_values(int cvar_index, int *value)
+union value_buffer
 {
-    int err, count;
-    void *no_object_handel = NULL;
-    MPI_T_cvar_handle handle;
+    int i;
+    unsigned u;
+    unsigned long ul;
+    unsigned long long ull;
+    MPI_Count count;
+    double d;
+};
 
-    err = MPI_T_cvar_handle_alloc(cvar_index, no_object_handel, &handle, &count);
+/**
+ * Reads a CVar with MPI_T_cvar_read and converts it to long long.
+ *
+ * Throws an mpit_error if an MPI-T returns an error code or if the value does not fit into a
+ * long long.
+ */
+void mpit_values::read_raw_value(int cvar_index, MPI_T_cvar_handle handle, long long *value)
+{
+    const cvar_info &info = get_cvar_info(cvar_index);
 
+    value_buffer buffer;
+    int err = MPI_T_cvar_read(handle, &buffer);
     if (err != MPI_SUCCESS)
     {
         throw mpit_error(get_mpit_error(err), err);
     }
-    /* The following assumes that the variable is */
-    /* represented by a single integer */
-    err = MPI_T_cvar_write(handle, value);
 
-    if (err != MPI_SUCCESS)
+    unsigned long long unsigned_value;
+    if (info.datatype == MPI_INT)
     {
-        MPI_T_cvar_handle_free(&handle);
-        throw mpit_error(get_mpit_error(err), err);
+        *value = buffer.i;
     }
-
-    err = MPI_T_cvar_handle_free(&handle);
-    if (err != MPI_SUCCESS)
+    else if (info.datatype == MPI_COUNT)
     {
-        throw mpit_error(get_mpit_error(err), err);
+        *value = buffer.count;
+    }
+    else
+    {
+        if (info.datatype == MPI_UNSIGNED)
+        {
+            unsigned_value = buffer.u;
+        }
+        else if (info.datatype == MPI_UNSIGNED_LONG)
+        {
+            unsigned_value = buffer.ul;
+        }
+        else
+        {
+            unsigned_value = buffer.ull;
+        }
+        if (unsigned_value > (unsigned long long) LLONG_MAX)
+        {
+            throw mpit_error(std::string("reading ") + info.name + " (value " +
+                                 std::to_string(unsigned_value) + " out of range)",
+                -1);
+        }
+        *value = unsigned_value;
     }
 }
 
 /**
- * Set the value for the CVar index to the value value.
+ * Read the value of a given CVar in its own datatype, and save it into value.
  *
- * @param index index of CVar to read
- * @param[in|out] value value to set CVar to. On successful exit returns value the old value of
- * CVar.
+ * Never waits for other threads. If no other thread changes the CVar at the same time, the
+ * value written last is updated with the value read.
  *
- * Throws an mpit_error if an MPI-T returns an error code, or if setting CVar is not supported.
+ * @param cvar_index cvar to read
+ * @param[out] value return value
  *
+ * Throws an mpit_error if an MPI-T returns an error code, if the CVar is not supported or if the
+ * value does not fit into a long long.
  */
-void mpit_values::change_mpi_variable(int cvar_index, int *value)
+void mpit_values::read_value(int cvar_index, long long *value)
 {
-    int err;
-    char cvar_name[1000];
-    int cvar_name_len = 1000;
-    int verbosity = 0;
-    MPI_Datatype datatype;
-    MPI_T_enum enumtype;
-    char desc[1000];
-    int desc_len = 1000;
-    int bind = 0;
-    int scope = 0;
-    int old_value = 0;
-    int new_value = 0;
+    MPI_T_cvar_handle handle = get_handle(cvar_index);
+    cvar_state &state = get_state(cvar_index);
 
-    // getting informations about the variable
-    err = MPI_T_cvar_get_info(cvar_index,
-        cvar_name,
-        &cvar_name_len,
-        &verbosity,
-        &datatype,
-        &enumtype,
-        desc,
-        &desc_len,
-        &bind,
-        &scope);
+    std::unique_lock<std::mutex> lock(state.mutex, std::try_to_lock);
+    read_raw_value(cvar_index, handle, value);
+    if (lock.owns_lock())
+    {
+        state.shadow.store(*value, std::memory_order_relaxed);
+        state.shadow_valid.store(true, std::memory_order_release);
+    }
+}
 
-    if (err != MPI_SUCCESS)
+/**
+ * Set the value of a given CVar, converted to its own datatype.
+ *
+ * Skips the write if the value written last is the same, without taking a lock. Writes to the
+ * same CVar are serialized. If verification is enabled, the value is read back after writing.
+ *
+ * @param cvar_index CVar to set
+ * @param value value to set the CVar to
+ *
+ * Throws an mpit_error if an MPI-T returns an error code, if the CVar is not supported, if the
+ * value does not fit into the datatype of the CVar or the verification fails.
+ */
+void mpit_values::write_value(int cvar_index, long long value)
+{
+    cvar_state &state = get_state(cvar_index);
+    if (state.shadow_valid.load(std::memory_order_acquire) &&
+        state.shadow.load(std::memory_order_relaxed) == value)
     {
-        throw mpit_error(get_mpit_error(err), err);
         return;
     }
+    MPI_T_cvar_handle handle = get_handle(cvar_index);
+    const cvar_info &info = get_cvar_info(cvar_index);
+
+    value_buffer buffer;
+    bool in_range;
+    if (info.datatype == MPI_INT)
+    {
+        buffer.i = value;
+        in_range = (buffer.i == value);
+    }
+    else if (info.datatype == MPI_COUNT)
+    {
+        buffer.count = value;
+        in_range = (buffer.count == value);
+    }
+    else if (info.datatype == MPI_UNSIGNED)
+    {
+        buffer.u = value;
+        in_range = (value >= 0 && buffer.u == (unsigned long long) value);
+    }
+    else if (info.datatype == MPI_UNSIGNED_LONG)
+    {
+        buffer.ul = value;
+        in_range = (value >= 0 && buffer.ul == (unsigned long long) value);
+    }
     else
     {
-        /* check if we support this kind of CVar.*/
-        if ((bind == MPI_T_BIND_NO_OBJECT) && (datatype == MPI_INT) &&
-            (enumtype == MPI_T_ENUM_NULL))
-        {
+        buffer.ull = value;
+        in_range = (value >= 0);
+    }
+    if (!in_range)
+    {
+        throw mpit_error(std::string("writing ") + std::to_string(value) + " to " + info.name +
+                             " (" + get_mpit_datatype(info.datatype) + ", out of range)",
+            -1);
+    }
 
-            get_mpit_bind_no_object_int_values(cvar_index, &old_value);
-            set_mpit_bind_no_object_int_values(cvar_index, value);
-            get_mpit_bind_no_object_int_values(cvar_index, &new_value);
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.shadow_valid.load(std::memory_order_relaxed) &&
+        state.shadow.load(std::memory_order_relaxed) == value)
+    {
+        return;
+    }
+    int err = MPI_T_cvar_write(handle, &buffer);
+    if (err != MPI_SUCCESS)
+    {
+        state.shadow_valid.store(false, std::memory_order_release);
+        throw mpit_error(get_mpit_error(err), err);
+    }
+    state.shadow.store(value, std::memory_order_relaxed);
+    state.shadow_valid.store(true, std::memory_order_release);
 
-            if (new_value != *value)
-            {
-                throw mpit_error(get_mpit_error(err), err);
-            }
-            else
-            {
-                *value = old_value;
-            }
-        }
-        else
+    if (verify_writes)
+    {
+        long long new_value = 0;
+        read_raw_value(cvar_index, handle, &new_value);
+        if (new_value != value)
         {
-            /*if we don't support this CVar obtain some additional informations, and throw an
-             * error*/
-            char enumname[1000];
-            int enumname_len = 1000;
-            int enumnum = 0;
-
-            if ((enumtype != MPI_T_ENUM_NULL) && (datatype == MPI_INT))
-            {
-                err = MPI_T_enum_get_info(enumtype, &enumnum, enumname, &enumname_len);
-                if (err != MPI_SUCCESS)
-                {
-                    throw mpit_error(get_mpit_error(err), err);
-                }
-            }
-            else
-            {
-                strcpy(enumname, "empty");
-            }
-
-            throw mpit_error(std::string("error: Not supported: Bind:") + get_mpit_bind(bind) +
-                                 std::string(" Datatype: ") + get_mpit_datatype(datatype) +
-                                 std::string(" Enumtype: ") + std::string(enumname) +
-                                 std::string(" for parameter ") + std::string(cvar_name),
+            state.shadow_valid.store(false, std::memory_order_release);
+            throw mpit_error(std::string("verifying ") + info.name + " (read " +
+                                 std::to_string(new_value) + ")",
                 -1);
         }
     }
 }
 
 /**
- * Gets a CVar Id by name. Needed for MPI 3.0. MPI 3.1 specify the a build in function.
+ * Returns the items of the enumeration of a CVar. They are read on first use.
  *
- * This function searches all CVars until it finds the CVar with the given name "cvar_name".
- * If there is no CVar with the name "cvar_name" this function throws an "cvar_not_found" exception.
- *
- * @param[in] cvar_name name of the CVar to search for.
+ * @param cvar_index CVar to get the enumeration for
  *
- * @return id of the CVar given by "cvar_name"
+ * @return the items, in MPI_T index order; empty if the CVar has no enumeration
  *
+ * Throws an mpit_error if an MPI-T returns an error code.
  */
-int mpit_values::get_cvar_by_name(const std::string &cvar_name)
+const std::vector<enum_item> &mpit_values::get_enum_items(int cvar_index)
 {
-    int num_mpi_vars = 0;
-    int cvar_id = -1;
-    char cvar_info_name[1000];
-    int cvar_name_len;
-    char desc[1000];
-    int desc_len;
-    int err, bind, verbose, scope;
-    MPI_T_enum enumtype;
-    MPI_Datatype datatype;
-    err = MPI_T_cvar_get_num(&num_mpi_vars);
+    const cvar_info &info = get_cvar_info(cvar_index);
+    cvar_state &state = get_state(cvar_index);
+    if (state.items_valid.load(std::memory_order_acquire) || info.enumtype == MPI_T_ENUM_NULL)
+    {
+        return state.items;
+    }
 
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.items_valid.load(std::memory_order_relaxed))
+    {
+        return state.items;
+    }
+    int num_items = 0;
+    int name_len = 0;
+    int err = MPI_T_enum_get_info(info.enumtype, &num_items, NULL, &name_len);
     if (err != MPI_SUCCESS)
     {
         throw mpit_error(get_mpit_error(err), err);
     }
-    for (int i = 0; i < num_mpi_vars; i++)
-    {
-        cvar_name_len = 1000;
-        desc_len = 1000;
-        err = MPI_T_cvar_get_info(i,
-            cvar_info_name,
-            &cvar_name_len,
-            &verbose,
-            &datatype,
-            &enumtype,
-            desc,
-            &desc_len, /*no description */
-            &bind,
-            &scope);
+    std::vector<enum_item> items;
+    for (int i = 0; i < num_items; i++)
+    {
+        enum_item item;
+        name_len = 0;
+        err = MPI_T_enum_get_item(info.enumtype, i, &item.value, NULL, &name_len);
         if (err != MPI_SUCCESS)
         {
             throw mpit_error(get_mpit_error(err), err);
         }
-        if (strcmp(cvar_info_name, cvar_name.c_str()) == 0)
+        std::vector<char> name(name_len + 1, '\0');
+        name_len = name.size();
+        err = MPI_T_enum_get_item(info.enumtype, i, &item.value, name.data(), &name_len);
+        if (err != MPI_SUCCESS)
         {
-            cvar_id = i;
-            break;
+            throw mpit_error(get_mpit_error(err), err);
         }
+        item.name = name.data();
+        items.push_back(item);
     }
+    state.items = items;
+    state.items_valid.store(true, std::memory_order_release);
+    return state.items;
+}
+
+/**
+ * Read a CVar as tuning value. For CVars with an enumeration this is the index of the current
+ * value in get_enum_items(), otherwise the value itself.
+ *
+ * @param cvar_index cvar to read
+ * @param[out] value return value
+ *
+ * Throws an mpit_error if an MPI-T returns an error code, if the CVar is not supported, if the
+ * value does not fit into an int or is not part of the enumeration.
+ */
+void mpit_values::get_int_value(int cvar_index, int *value)
+{
+    long long raw_value = 0;
+    read_value(cvar_index, &raw_value);
 
-    if (cvar_id == -1)
+    const cvar_info &info = get_cvar_info(cvar_index);
+    if (info.enumtype != MPI_T_ENUM_NULL)
     {
-        throw cvar_not_found(cvar_name);
+        const std::vector<enum_item> &items = get_enum_items(cvar_index);
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            if (items[i].value == raw_value)
+            {
+                *value = i;
+                return;
+            }
+        }
+        throw mpit_error(std::string("reading ") + info.name + " (value " +
+                             std::to_string(raw_value) + " not in enumeration)",
+            -1);
     }
-
-    return cvar_id;
+    if (raw_value < INT_MIN || raw_value > INT_MAX)
+    {
+        throw mpit_error(std::string("reading ") + info.name + " (value " +
+                             std::to_string(raw_value) + " out of range)",
+            -1);
+    }
+    *value = raw_value;
 }
 
-/* Changes a value by name.
- *
- * This function looks in a internal map for the Id of the given CVar. If the CVar
- * "cvar_name" is not found in the map it calls get_cvar_by_name() and saves the returned
- * value in the local map.
- *
- * @param[in] cvar_name name of the CVar to change.
- * @param[in|out] value value to set CVar to. On successful exit returns value the old value of
- * CVar.
- *
- * @return The mpit id of the requested CVar.
+/**
+ * set a CVar to a tuning value. For CVars with an enumeration the value is the index of the
+ * item in get_enum_items() to set the CVar to, otherwise the value itself.
  *
- * Throws a mpit_error if an MPI-T returns an error code, or if setting CVar is not supported.
- * Throws a cvar_not_found exception if there is no CVar with name "cvar_name" is found.
+ * @param cvar_index CVar to set
+ * @param value value to set the CVar to
  *
+ * Throws an mpit_error if an MPI-T returns an error code, if the CVar is not supported, if the
+ * value does not fit into the CVar or the verification fails.
  */
-int mpit_values::change_mpi_variable_by_name(std::string cvar_name, int *value)
+void mpit_values::set_int_value(int cvar_index, int *value)
 {
-    int cvar_id = 0;
-    std::map<std::string, int>::iterator it;
+    const cvar_info &info = get_cvar_info(cvar_index);
+    if (info.enumtype != MPI_T_ENUM_NULL)
+    {
+        const std::vector<enum_item> &items = get_enum_items(cvar_index);
+        if (*value < 0 || *value >= (int) items.size())
+        {
+            throw mpit_error(std::string("writing item ") + std::to_string(*value) + " to " +
+                                 info.name + " (" + std::to_string(items.size()) + " items)",
+                -1);
+        }
+        write_value(cvar_index, items[*value].value);
+        return;
+    }
+    write_value(cvar_index, *value);
+}
 
-    it = known_cvars.find(cvar_name);
+/**
+ * @return the value written last, read from the CVar only if there is none
+ */
+long long mpit_values::get_current_value(int cvar_index)
+{
+    cvar_state &state = get_state(cvar_index);
+    if (state.shadow_valid.load(std::memory_order_acquire))
+    {
+        return state.shadow.load(std::memory_order_relaxed);
+    }
+    long long value = 0;
+    read_value(cvar_index, &value);
+    return value;
+}
 
-    if (it != known_cvars.end())
+/**
+ * Converts a value of a CVar to a tuning value, see get_int_value().
+ */
+int mpit_values::get_tuning_value(int cvar_index, long long raw_value)
+{
+    if (get_cvar_info(cvar_index).enumtype == MPI_T_ENUM_NULL)
     {
-        cvar_id = it->second;
+        return raw_value;
     }
-    else
+    const std::vector<enum_item> &items = get_enum_items(cvar_index);
+    for (size_t i = 0; i < items.size(); i++)
     {
-        cvar_id = get_cvar_by_name(cvar_name);
-        known_cvars.insert(std::pair<std::string, int>(cvar_name, cvar_id));
+        if (items[i].value == raw_value)
+        {
+            return i;
+        }
     }
+    return -1;
+}
 
-    change_mpi_variable(cvar_id, value);
-
-    return cvar_id;
+/**
+ * Returns the value stack of the calling thread. Creates it on the first call of the thread,
+ * which is the only time a lock is taken.
+ */
+std::vector<value_stack_entry> &mpit_values::get_value_stack()
+{
+    static thread_local unsigned long long cached_id = 0;
+    static thread_local std::vector<value_stack_entry> *cached_stack = nullptr;
+    if (cached_id == id)
+    {
+        return *cached_stack;
+    }
+    std::unique_ptr<std::vector<value_stack_entry>> stack(new std::vector<value_stack_entry>());
+    cached_stack = stack.get();
+    cached_id = id;
+    std::lock_guard<std::mutex> lock(value_stacks_mutex);
+    value_stacks.push_back(std::move(stack));
+    return *cached_stack;
 }
 
-/** Constructor
- *
- * Creates an instance of mpi_value. This function does the
- * MPI_T_init_thread().
- *
- * You are allowed to have one instance at a time. It is possible
- * to destroy the instance and create a new one.
+/**
+ * Sets a CVar for a nested region, see write_value(). The calling thread remembers the old value
+ * if it changes, so the matching pop_value() only has work to do for CVars that changed.
  *
- * It is allowed to use these class even before MPI_Init().
- * Pleas see MPI specification for details.
+ * @param cvar_index CVar to set
+ * @param value value to set the CVar to
  *
- * Throws an mpit_error if an MPI-T returns an error code
+ * Throws an mpit_error like write_value(). The push is recorded anyway, as unchanged.
  */
-mpit_values::mpit_values()
+void mpit_values::push_value(int cvar_index, long long value)
 {
-    int err;
-    int threadsupport;
-
-    err = MPI_T_init_thread(MPI_THREAD_SINGLE, &threadsupport);
-    if (err != MPI_SUCCESS)
+    std::vector<value_stack_entry> &stack = get_value_stack();
+    stack.push_back({ cvar_index, 0, false });
+    value_stack_entry &entry = stack.back();
+    entry.previous = get_current_value(cvar_index);
+    if (entry.previous == value)
     {
-        throw mpit_error(get_mpit_error(err), err);
+        return;
     }
+    write_value(cvar_index, value);
+    entry.changed = true;
 }
 
-/** Destructor
+/**
+ * Records a push that keeps the current value of a CVar, e.g. because the new value can not be
+ * set yet, so the matching pop_value() does not restore an outer push.
+ */
+void mpit_values::push_current_value(int cvar_index)
+{
+    get_value_stack().push_back({ cvar_index, 0, false });
+}
+
+/**
+ * Restores the value a CVar had before the innermost push_value() of the calling thread for it.
+ * Pushes of other CVars in between stay in place. Does not write the CVar if the push did not
+ * change it or it already has the old value.
  *
- * Deletes the instance. Does MPI_T_finalize().
+ * @param cvar_index CVar to restore
+ * @param[out] restored the restored value, if POP_RESTORED is returned
+ * @return whether the CVar was written
  *
- * Throws an mpit_error if an MPI-T returns an error code
+ * Throws an mpit_error like write_value(); the push is removed anyway.
  */
-mpit_values::~mpit_values()
+pop_result mpit_values::pop_value(int cvar_index, long long *restored)
 {
-    int err;
-    err = MPI_T_finalize();
-    if (err != MPI_SUCCESS)
+    std::vector<value_stack_entry> &stack = get_value_stack();
+    auto it = std::find_if(stack.rbegin(), stack.rend(),
+        [cvar_index](const value_stack_entry &entry) { return entry.cvar_index == cvar_index; });
+    if (it == stack.rend())
     {
-        throw mpit_error(get_mpit_error(err), err);
+        return POP_NOT_PUSHED;
+    }
+    value_stack_entry entry = *it;
+    stack.erase(std::next(it).base());
+    if (!entry.changed || get_current_value(cvar_index) == entry.previous)
+    {
+        return POP_UNCHANGED;
+    }
+    write_value(cvar_index, entry.previous);
+    *restored = entry.previous;
+    return POP_RESTORED;
+}
+
+/**
+ * Sets a CVar to a tuning value for a nested region, see set_int_value() and push_value().
+ */
+void mpit_values::push_int_value(int cvar_index, int *value)
+{
+    const cvar_info &info = get_cvar_info(cvar_index);
+    if (info.enumtype != MPI_T_ENUM_NULL)
+    {
+        const std::vector<enum_item> &items = get_enum_items(cvar_index);
+        if (*value < 0 || *value >= (int) items.size())
+        {
+            push_current_value(cvar_index);
+            throw mpit_error(std::string("writing item ") + std::to_string(*value) + " to " +
+                                 info.name + " (" + std::to_string(items.size()) + " items)",
+                -1);
+        }
+        push_value(cvar_index, items[*value].value);
+        return;
+    }
+    push_value(cvar_index, *value);
+}
+
+/**
+ * Restores a CVar, see pop_value().
+ *
+ * @param[out] restored the restored tuning value, if POP_RESTORED is returned
+ */
+pop_result mpit_values::pop_int_value(int cvar_index, int *restored)
+{
+    long long raw_value = 0;
+    pop_result result = pop_value(cvar_index, &raw_value);
+    if (result == POP_RESTORED)
+    {
+        *restored = get_tuning_value(cvar_index, raw_value);
+    }
+    return result;
+}
+
+/**
+ * Enables reading back every written value. Meant for debugging, as it costs an additional
+ * MPI_T_cvar_read per write. Must not be called while other threads use this instance.
+ */
+void mpit_values::set_verify_writes(bool verify)
+{
+    verify_writes = verify;
+}
+
+/**
+ * Set the tuning value for the CVar index to the value value, see set_int_value().
+ *
+ * The old value is taken from the value written last, so setting a CVar costs at most one
+ * MPI_T_cvar_write. Only the first access reads the CVar. If the application changes the CVar
+ * by other means, the old value might be outdated.
+ *
+ * @param index index of CVar to read
+ * @param[in|out] value value to set CVar to. On successful exit returns value the old value of
+ * CVar.
+ *
+ * Throws an mpit_error if an MPI-T returns an error code, or if setting CVar is not supported.
+ *
+ */
+void mpit_values::change_mpi_variable(int cvar_index, int *value)
+{
+    check_supported(cvar_index);
+
+    int old_value = 0;
+    cvar_state &state = get_state(cvar_index);
+    bool shadow_valid = state.shadow_valid.load(std::memory_order_acquire);
+    long long shadow = state.shadow.load(std::memory_order_relaxed);
+    if (shadow_valid && get_cvar_info(cvar_index).enumtype == MPI_T_ENUM_NULL &&
+        shadow >= INT_MIN && shadow <= INT_MAX)
+    {
+        old_value = shadow;
+    }
+    else
+    {
+        get_int_value(cvar_index, &old_value);
+    }
+    set_int_value(cvar_index, value);
+    *value = old_value;
+}
+
+/**
+ * Adds the CVars the MPI library added since the last call to the catalogue.
+ *
+ * The number of CVars can grow at runtime, e.g. when the MPI library loads a component. The name
+ * is queried with a length of 0 first, so names of any length fit. The grown catalogue is
+ * published as a new snapshot, so readers never wait; only concurrent updates are serialized.
+ *
+ * Throws an mpit_error if an MPI-T returns an error code.
+ */
+void mpit_values::update_cvar_catalogue()
+{
+    std::lock_guard<std::mutex> lock(catalogue_mutex);
+    const cvar_catalogue *current = catalogue.load(std::memory_order_acquire);
+    size_t known = (current != nullptr) ? current->cvars.size() : 0;
+
+    int num_mpi_vars = 0;
+    int err = MPI_T_cvar_get_num(&num_mpi_vars);
+    if (err != MPI_SUCCESS)
+    {
+        throw mpit_error(get_mpit_error(err), err);
+    }
+    if (num_mpi_vars <= (int) known)
+    {
+        return;
+    }
+
+    std::unique_ptr<cvar_catalogue> grown(
+        current != nullptr ? new cvar_catalogue(*current) : new cvar_catalogue());
+    std::vector<cvar_info> &cvars = grown->cvars;
+    cvars.reserve(num_mpi_vars);
+    for (int i = known; i < num_mpi_vars; i++)
+    {
+        cvar_info info;
+        int name_len = 0;
+        int desc_len = 0;
+        info.index = i;
+        err = MPI_T_cvar_get_info(i, NULL, &name_len, &info.verbosity, &info.datatype,
+            &info.enumtype, NULL, &desc_len, &info.bind, &info.scope);
+        if (err == MPI_T_ERR_INVALID_INDEX)
+        {
+            /* e.g. Open MPI keeps the indices of CVars of unloaded components; no name marks
+             * them */
+            cvars.push_back(info);
+            continue;
+        }
+        if (err != MPI_SUCCESS)
+        {
+            throw mpit_error(get_mpit_error(err), err);
+        }
+        std::vector<char> name(name_len + 1, '\0');
+        name_len = name.size();
+        desc_len = 0;
+        err = MPI_T_cvar_get_info(i, name.data(), &name_len, &info.verbosity, &info.datatype,
+            &info.enumtype, NULL, &desc_len, &info.bind, &info.scope);
+        if (err != MPI_SUCCESS)
+        {
+            throw mpit_error(get_mpit_error(err), err);
+        }
+        info.name = name.data();
+        cvars.push_back(info);
+    }
+    while (states.size() < cvars.size())
+    {
+        states.emplace_back(new cvar_state());
+        grown->states.push_back(states.back().get());
+    }
+
+    grown->cvars_by_name.clear();
+    for (size_t i = 0; i < cvars.size(); i++)
+    {
+        if (!cvars[i].name.empty())
+        {
+            grown->cvars_by_name.push_back(i);
+        }
+    }
+    std::sort(grown->cvars_by_name.begin(), grown->cvars_by_name.end(),
+        [&cvars](int a, int b) { return cvars[a].name < cvars[b].name; });
+
+    catalogue.store(grown.get(), std::memory_order_release);
+    catalogues.push_back(std::move(grown));
+}
+
+/**
+ * Reads the metadata of all PVars into the catalogue. Indices the MPI library reports as invalid
+ * get an empty name.
+ *
+ * Throws an mpit_error if an MPI-T returns an error code.
+ */
+void mpit_values::update_pvar_catalogue()
+{
+    int num_pvars = 0;
+    int err = MPI_T_pvar_get_num(&num_pvars);
+    if (err != MPI_SUCCESS)
+    {
+        throw mpit_error(get_mpit_error(err), err);
+    }
+
+    pvars.reserve(num_pvars);
+    for (int i = pvars.size(); i < num_pvars; i++)
+    {
+        pvar_info info;
+        int name_len = 0;
+        int desc_len = 0;
+        info.index = i;
+        err = MPI_T_pvar_get_info(i, NULL, &name_len, &info.verbosity, &info.var_class,
+            &info.datatype, &info.enumtype, NULL, &desc_len, &info.bind, &info.readonly,
+            &info.continuous, &info.atomic);
+#ifdef MPI_T_ERR_INVALID
+        /* Open MPI reports PVars of unloaded components as MPI_T_ERR_INVALID */
+        if (err == MPI_T_ERR_INVALID_INDEX || err == MPI_T_ERR_INVALID)
+#else
+        if (err == MPI_T_ERR_INVALID_INDEX)
+#endif
+        {
+            pvars.push_back(info);
+            continue;
+        }
+        if (err != MPI_SUCCESS)
+        {
+            throw mpit_error(get_mpit_error(err), err);
+        }
+        std::vector<char> name(name_len + 1, '\0');
+        name_len = name.size();
+        desc_len = 0;
+        err = MPI_T_pvar_get_info(i, name.data(), &name_len, &info.verbosity, &info.var_class,
+            &info.datatype, &info.enumtype, NULL, &desc_len, &info.bind, &info.readonly,
+            &info.continuous, &info.atomic);
+        if (err != MPI_SUCCESS)
+        {
+            throw mpit_error(get_mpit_error(err), err);
+        }
+        info.name = name.data();
+        pvars.push_back(info);
+    }
+}
+
+#if MPIT_HAVE_EVENTS
+/**
+ * Size of the predefined datatypes MPI_T events use. MPI_Type_size can not be used before
+ * MPI_Init.
+ *
+ * @return the size in bytes, 0 for other datatypes
+ */
+static size_t get_event_datatype_size(MPI_Datatype datatype)
+{
+    if (datatype == MPI_CHAR || datatype == MPI_SIGNED_CHAR || datatype == MPI_UNSIGNED_CHAR ||
+        datatype == MPI_BYTE || datatype == MPI_INT8_T || datatype == MPI_UINT8_T ||
+        datatype == MPI_C_BOOL)
+    {
+        return 1;
+    }
+    if (datatype == MPI_INT16_T || datatype == MPI_UINT16_T)
+    {
+        return 2;
+    }
+    if (datatype == MPI_INT || datatype == MPI_UNSIGNED || datatype == MPI_INT32_T ||
+        datatype == MPI_UINT32_T || datatype == MPI_FLOAT)
+    {
+        return 4;
+    }
+    if (datatype == MPI_INT64_T || datatype == MPI_UINT64_T || datatype == MPI_DOUBLE)
+    {
+        return 8;
+    }
+    if (datatype == MPI_LONG || datatype == MPI_UNSIGNED_LONG)
+    {
+        return sizeof(long);
+    }
+    if (datatype == MPI_LONG_LONG || datatype == MPI_UNSIGNED_LONG_LONG)
+    {
+        return sizeof(long long);
+    }
+    if (datatype == MPI_COUNT)
+    {
+        return sizeof(MPI_Count);
+    }
+    if (datatype == MPI_AINT)
+    {
+        return sizeof(MPI_Aint);
+    }
+    return 0;
+}
+#endif
+
+/**
+ * Reads the metadata of all event types. Needs MPI 4.0, the catalogue stays empty otherwise.
+ *
+ * Throws an mpit_error if an MPI-T returns an error code
+ */
+void mpit_values::update_event_catalogue()
+{
+#if MPIT_HAVE_EVENTS
+    int num_events = 0;
+    int err = MPI_T_event_get_num(&num_events);
+    if (err != MPI_SUCCESS)
+    {
+        throw mpit_error(get_mpit_error(err), err);
+    }
+
+    events.reserve(num_events);
+    for (int i = events.size(); i < num_events; i++)
+    {
+        event_info info;
+        int name_len = 0;
+        int desc_len = 0;
+        int num_elements = 0;
+        MPI_T_enum enumtype;
+        info.index = i;
+        info.size = 0;
+        err = MPI_T_event_get_info(i, NULL, &name_len, &info.verbosity, NULL, NULL,
+            &num_elements, &enumtype, NULL, NULL, &desc_len, &info.bind);
+        if (err == MPI_T_ERR_INVALID_INDEX)
+        {
+            events.push_back(info);
+            continue;
+        }
+        if (err != MPI_SUCCESS)
+        {
+            throw mpit_error(get_mpit_error(err), err);
+        }
+        std::vector<char> name(name_len + 1, '\0');
+        std::vector<MPI_Datatype> datatypes(num_elements);
+        std::vector<MPI_Aint> displacements(num_elements);
+        name_len = name.size();
+        desc_len = 0;
+        err = MPI_T_event_get_info(i, name.data(), &name_len, &info.verbosity, datatypes.data(),
+            displacements.data(), &num_elements, &enumtype, NULL, NULL, &desc_len, &info.bind);
+        if (err != MPI_SUCCESS)
+        {
+            throw mpit_error(get_mpit_error(err), err);
+        }
+        info.name = name.data();
+        for (int e = 0; e < num_elements; e++)
+        {
+            size_t size = get_event_datatype_size(datatypes[e]);
+            if (size == 0)
+            {
+                info.size = 0;
+                break;
+            }
+            info.size = std::max(info.size, (size_t) displacements[e] + size);
+        }
+        events.push_back(info);
+    }
+#endif
+}
+
+/**
+ * Binary search for cvar_name in the catalogue.
+ *
+ * @return index of the CVar, -1 if it is not in the catalogue
+ */
+int mpit_values::find_cvar(const std::string &cvar_name) const
+{
+    const cvar_catalogue *current = catalogue.load(std::memory_order_acquire);
+    const std::vector<cvar_info> &cvars = current->cvars;
+    auto it = std::lower_bound(current->cvars_by_name.begin(), current->cvars_by_name.end(),
+        cvar_name,
+        [&cvars](int index, const std::string &name) { return cvars[index].name < name; });
+    if (it != current->cvars_by_name.end() && cvars[*it].name == cvar_name)
+    {
+        return *it;
+    }
+    return -1;
+}
+
+/**
+ * Gets a CVar Id by name.
+ *
+ * Looks the name up in the catalogue built by the constructor. If it is not found, the MPI
+ * library might have added CVars since. With MPI 3.1 MPI_T_cvar_get_index tells whether the CVar
+ * exists; for MPI 3.0 the catalogue is updated and searched again.
+ * If there is no CVar with the name "cvar_name" this function throws an "cvar_not_found" exception.
+ *
+ * @param[in] cvar_name name of the CVar to search for.
+ *
+ * @return id of the CVar given by "cvar_name"
+ *
+ */
+int mpit_values::get_cvar_by_name(const std::string &cvar_name)
+{
+    int cvar_id = find_cvar(cvar_name);
+    if (cvar_id != -1)
+    {
+        return cvar_id;
+    }
+
+#if MPI_VERSION > 3 || (MPI_VERSION == 3 && MPI_SUBVERSION >= 1)
+    int err = MPI_T_cvar_get_index(cvar_name.c_str(), &cvar_id);
+    if (err != MPI_SUCCESS)
+    {
+        throw cvar_not_found(cvar_name);
+    }
+    update_cvar_catalogue();
+#else
+    update_cvar_catalogue();
+    cvar_id = find_cvar(cvar_name);
+#endif
+
+    if (cvar_id == -1 || cvar_id >= (int) get_cvars().size())
+    {
+        throw cvar_not_found(cvar_name);
+    }
+
+    return cvar_id;
+}
+
+/**
+ * Returns the metadata of a CVar from the catalogue, without calling MPI_T.
+ *
+ * Throws a cvar_not_found exception if the index is not in the catalogue.
+ */
+const cvar_info &mpit_values::get_cvar_info(int cvar_index) const
+{
+    const std::vector<cvar_info> &cvars = get_cvars();
+    if (cvar_index < 0 || cvar_index >= (int) cvars.size() || cvars[cvar_index].name.empty())
+    {
+        throw cvar_not_found(std::string("index ") + std::to_string(cvar_index));
+    }
+    return cvars[cvar_index];
+}
+
+/**
+ * Returns the description of a CVar. It is not kept in the catalogue, so every call queries
+ * MPI_T.
+ *
+ * Throws a cvar_not_found exception if the index is not in the catalogue, and an mpit_error if an
+ * MPI-T returns an error code.
+ */
+std::string mpit_values::get_cvar_description(int cvar_index) const
+{
+    cvar_info info = get_cvar_info(cvar_index);
+    int name_len = 0;
+    int desc_len = 0;
+    int err = MPI_T_cvar_get_info(cvar_index, NULL, &name_len, &info.verbosity, &info.datatype,
+        &info.enumtype, NULL, &desc_len, &info.bind, &info.scope);
+    if (err != MPI_SUCCESS)
+    {
+        throw mpit_error(get_mpit_error(err), err);
+    }
+    std::vector<char> desc(desc_len + 1, '\0');
+    desc_len = desc.size();
+    name_len = 0;
+    err = MPI_T_cvar_get_info(cvar_index, NULL, &name_len, &info.verbosity, &info.datatype,
+        &info.enumtype, desc.data(), &desc_len, &info.bind, &info.scope);
+    if (err != MPI_SUCCESS)
+    {
+        throw mpit_error(get_mpit_error(err), err);
+    }
+    return desc.data();
+}
+
+/**
+ * @return all CVars known to the MPI library, in MPI_T index order. The vector stays valid until
+ * the instance is destroyed, but does not include CVars added later.
+ */
+const std::vector<cvar_info> &mpit_values::get_cvars() const
+{
+    return catalogue.load(std::memory_order_acquire)->cvars;
+}
+
+/**
+ * @return all PVars known to the MPI library, in MPI_T index order. Invalid indices have an empty
+ * name.
+ */
+const std::vector<pvar_info> &mpit_values::get_pvars() const
+{
+    return pvars;
+}
+
+const std::vector<event_info> &mpit_values::get_events() const
+{
+    return events;
+}
+
+/**
+ * @return the communicator CVars with MPI_T_BIND_MPI_COMM are bound to
+ */
+MPI_Comm mpit_values::get_bind_comm() const
+{
+    return bind_comm;
+}
+
+/**
+ * @return the thread level MPI_T provides
+ */
+int mpit_values::get_thread_level() const
+{
+    return thread_level;
+}
+
+/* Changes a value by name.
+ *
+ * This function looks up the Id of the given CVar in the catalogue, see get_cvar_by_name().
+ *
+ * @param[in] cvar_name name of the CVar to change.
+ * @param[in|out] value value to set CVar to. On successful exit returns value the old value of
+ * CVar.
+ *
+ * @return The mpit id of the requested CVar.
+ *
+ * Throws a mpit_error if an MPI-T returns an error code, or if setting CVar is not supported.
+ * Throws a cvar_not_found exception if there is no CVar with name "cvar_name" is found.
+ *
+ */
+int mpit_values::change_mpi_variable_by_name(const std::string &cvar_name, int *value)
+{
+    int cvar_id = get_cvar_by_name(cvar_name);
+
+    change_mpi_variable(cvar_id, value);
+
+    return cvar_id;
+}
+
+/** Constructor
+ *
+ * Creates an instance of mpi_value. This function does the
+ * MPI_T_init_thread() and reads the metadata of all CVars into a catalogue, so later
+ * lookups need no MPI_T calls.
+ *
+ * You are allowed to have one instance at a time. It is possible
+ * to destroy the instance and create a new one.
+ *
+ * It is allowed to use these class even before MPI_Init().
+ * Pleas see MPI specification for details.
+ *
+ * With MPI_THREAD_MULTIPLE, all functions except set_bind_comm() and set_verify_writes() may be
+ * called by several threads at once. Lookups take no lock; only writes to the same CVar wait for
+ * each other.
+ *
+ * @param required_thread_level thread level the application uses, see MPI_Query_thread()
+ *
+ * Throws an mpit_error if an MPI-T returns an error code
+ */
+mpit_values::mpit_values(int required_thread_level)
+    : thread_level(MPI_THREAD_SINGLE), verify_writes(false), bind_comm(MPI_COMM_WORLD),
+      catalogue(nullptr), id(next_instance_id++)
+{
+    int err;
+
+    err = MPI_T_init_thread(required_thread_level, &thread_level);
+    if (err != MPI_SUCCESS)
+    {
+        throw mpit_error(get_mpit_error(err), err);
+    }
+
+    update_cvar_catalogue();
+    update_pvar_catalogue();
+    update_event_catalogue();
+}
+
+/** Destructor
+ *
+ * Deletes the instance. Frees the CVar handles and does MPI_T_finalize().
+ *
+ * Throws an mpit_error if an MPI-T returns an error code
+ */
+mpit_values::~mpit_values()
+{
+    int err;
+    for (std::unique_ptr<cvar_state> &state : states)
+    {
+        MPI_T_cvar_handle handle = state->handle.load();
+        if (handle != MPI_T_CVAR_HANDLE_NULL)
+        {
+            MPI_T_cvar_handle_free(&handle);
+        }
+    }
+    err = MPI_T_finalize();
+    if (err != MPI_SUCCESS)
+    {
+        throw mpit_error(get_mpit_error(err), err);
+    }
+}
+
+/** Constructor
+ *
+ * Creates a PVar session, allocates a handle for every PVar in selected and starts the PVars
+ * that are not continuous. PVars whose handle can not be allocated, which are no numbers, or
+ * bound to other objects than a communicator are skipped, see is_valid().
+ *
+ * @param selected PVars to read
+ * @param comm communicator to bind PVars with MPI_T_BIND_MPI_COMM to
+ *
+ * Throws an mpit_error if the session can not be created.
+ */
+pvar_session::pvar_session(const std::vector<pvar_info> &selected, MPI_Comm comm)
+    : bind_comm(comm), handles(selected.size(), MPI_T_PVAR_HANDLE_NULL),
+      datatypes(selected.size(), MPI_DATATYPE_NULL), buffers(selected.size()),
+      errors(selected.size())
+{
+    int err = MPI_T_pvar_session_create(&session);
+    if (err != MPI_SUCCESS)
+    {
+        throw mpit_error(get_mpit_error(err), err);
+    }
+
+    for (size_t i = 0; i < selected.size(); i++)
+    {
+        const pvar_info &info = selected[i];
+        datatypes[i] = info.datatype;
+        if (info.datatype != MPI_INT && info.datatype != MPI_UNSIGNED &&
+            info.datatype != MPI_UNSIGNED_LONG && info.datatype != MPI_UNSIGNED_LONG_LONG &&
+            info.datatype != MPI_COUNT && info.datatype != MPI_DOUBLE)
+        {
+            errors[i] = "datatype " + get_mpit_datatype(info.datatype) + " not supported";
+            continue;
+        }
+
+        void *object = NULL;
+        if (info.bind == MPI_T_BIND_MPI_COMM)
+        {
+            int initialized = 0;
+            MPI_Initialized(&initialized);
+            if (!initialized)
+            {
+                errors[i] = "binding to a communicator before MPI_Init";
+                continue;
+            }
+            object = &bind_comm;
+        }
+        else if (info.bind != MPI_T_BIND_NO_OBJECT)
+        {
+            errors[i] = "bind " + get_mpit_bind(info.bind) + " not supported";
+            continue;
+        }
+
+        int count = 0;
+        err = MPI_T_pvar_handle_alloc(session, info.index, object, &handles[i], &count);
+        if (err != MPI_SUCCESS)
+        {
+            handles[i] = MPI_T_PVAR_HANDLE_NULL;
+            errors[i] = get_mpit_error(err);
+            continue;
+        }
+        buffers[i].resize(count > 0 ? count : 1);
+        if (!info.continuous)
+        {
+            err = MPI_T_pvar_start(session, handles[i]);
+            if (err != MPI_SUCCESS)
+            {
+                MPI_T_pvar_handle_free(session, &handles[i]);
+                handles[i] = MPI_T_PVAR_HANDLE_NULL;
+                errors[i] = get_mpit_error(err);
+            }
+        }
+    }
+}
+
+/** Destructor
+ *
+ * Frees the handles and the session. Errors are ignored, as MPI might be finalized already.
+ */
+pvar_session::~pvar_session()
+{
+    for (MPI_T_pvar_handle &handle : handles)
+    {
+        if (handle != MPI_T_PVAR_HANDLE_NULL)
+        {
+            MPI_T_pvar_handle_free(session, &handle);
+        }
+    }
+    MPI_T_pvar_session_free(&session);
+}
+
+/**
+ * Reads all PVars of the session.
+ *
+ * @param[out] values one value per selected PVar, NaN if the PVar is not valid. Resized to the
+ * number of selected PVars.
+ *
+ * Throws an mpit_error if an MPI-T returns an error code.
+ */
+void pvar_session::read(std::vector<double> &values)
+{
+    values.resize(handles.size());
+    for (size_t i = 0; i < handles.size(); i++)
+    {
+        if (handles[i] == MPI_T_PVAR_HANDLE_NULL)
+        {
+            values[i] = std::numeric_limits<double>::quiet_NaN();
+            continue;
+        }
+        std::vector<unsigned long long> &buffer = buffers[i];
+        int err = MPI_T_pvar_read(session, handles[i], buffer.data());
+        if (err != MPI_SUCCESS)
+        {
+            throw mpit_error(get_mpit_error(err), err);
+        }
+
+        /* the elements are packed in their own datatype */
+        MPI_Datatype datatype = datatypes[i];
+        const char *raw = reinterpret_cast<const char *>(buffer.data());
+        double sum = 0.0;
+        value_buffer element;
+        for (size_t e = 0; e < buffer.size(); e++)
+        {
+            if (datatype == MPI_INT)
+            {
+                memcpy(&element.i, raw + e * sizeof(int), sizeof(int));
+                sum += element.i;
+            }
+            else if (datatype == MPI_UNSIGNED)
+            {
+                memcpy(&element.u, raw + e * sizeof(unsigned), sizeof(unsigned));
+                sum += element.u;
+            }
+            else if (datatype == MPI_UNSIGNED_LONG)
+            {
+                memcpy(&element.ul, raw + e * sizeof(unsigned long), sizeof(unsigned long));
+                sum += element.ul;
+            }
+            else if (datatype == MPI_UNSIGNED_LONG_LONG)
+            {
+                memcpy(&element.ull, raw + e * sizeof(unsigned long long),
+                    sizeof(unsigned long long));
+                sum += element.ull;
+            }
+            else if (datatype == MPI_COUNT)
+            {
+                memcpy(&element.count, raw + e * sizeof(MPI_Count), sizeof(MPI_Count));
+                sum += element.count;
+            }
+            else
+            {
+                memcpy(&element.d, raw + e * sizeof(double), sizeof(double));
+                sum += element.d;
+            }
+        }
+        values[i] = sum;
+    }
+}
+
+/**
+ * @return true if the PVar with the position pvar in the selection can be read
+ */
+bool pvar_session::is_valid(size_t pvar) const
+{
+    return handles.at(pvar) != MPI_T_PVAR_HANDLE_NULL;
+}
+
+/**
+ * @return why the PVar with the position pvar in the selection can not be read, empty if it can
+ */
+const std::string &pvar_session::get_error(size_t pvar) const
+{
+    return errors.at(pvar);
+}
+
+/** bytes of each stored event before the copied data */
+static const size_t EVENT_HEADER_SIZE = 16;
+
+/**
+ * Registration of one event type.
+ */
+struct event_recorder::event_type
+{
+    event_recorder *recorder;
+    /** position in the selection, stored with every event */
+    int position;
+    event_info info;
+#if MPIT_HAVE_EVENTS
+    MPI_T_event_registration registration;
+#endif
+    bool registered = false;
+    /** bound to a communicator, registered by register_pending() after MPI_Init */
+    bool pending = false;
+    std::atomic<unsigned long long> mpi_dropped{0};
+    /** events of threads without a buffer */
+    std::atomic<unsigned long long> unbuffered{0};
+    std::string error;
+};
+
+/**
+ * Events of one thread. Only the owning thread writes events; count is published with release
+ * order, so write() can read the events after stop().
+ */
+struct event_recorder::thread_buffer
+{
+    std::vector<unsigned char> events;
+    std::atomic<size_t> count{0};
+    std::atomic<unsigned long long> dropped{0};
+};
+
+#if MPIT_HAVE_EVENTS
+static void event_callback(MPI_T_event_instance instance, MPI_T_event_registration registration,
+    MPI_T_cb_safety cb_safety, void *user_data)
+{
+    event_recorder::event_type *type = static_cast<event_recorder::event_type *>(user_data);
+    event_recorder::thread_buffer *buffer = type->recorder->get_thread_buffer();
+    if (buffer == nullptr)
+    {
+        type->unbuffered.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    size_t record_size = type->recorder->get_record_size();
+    size_t count = buffer->count.load(std::memory_order_relaxed);
+    if ((count + 1) * record_size > buffer->events.size())
+    {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    unsigned char *event = buffer->events.data() + count * record_size;
+    MPI_Count timestamp = 0;
+    int source = -1;
+    MPI_T_event_get_timestamp(instance, &timestamp);
+    MPI_T_event_get_source(instance, &source);
+    uint64_t time = timestamp;
+    int32_t header[2] = { type->position, source };
+    memcpy(event, &time, sizeof(time));
+    memcpy(event + sizeof(time), header, sizeof(header));
+    if (MPI_T_event_copy(instance, event + EVENT_HEADER_SIZE) != MPI_SUCCESS)
+    {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+static void event_dropped_callback(MPI_Count count, MPI_T_event_registration registration,
+    int source_index, MPI_T_cb_safety cb_safety, void *user_data)
+{
+    static_cast<event_recorder::event_type *>(user_data)->mpi_dropped.fetch_add(
+        count, std::memory_order_relaxed);
+}
+
+/* the event callbacks of the registration may run until this is called */
+static void event_free_callback(
+    MPI_T_event_registration registration, MPI_T_cb_safety cb_safety, void *user_data)
+{
+    static_cast<event_recorder::event_type *>(user_data)->recorder->registration_freed();
+}
+#endif
+
+/**
+ * Registers a callback for each selected event type. Event types that can not be registered are
+ * skipped, see is_valid() and get_error(). Event types bound to a communicator wait for
+ * register_pending() if MPI is not initialized yet, see is_pending().
+ *
+ * @param selected event types to record
+ * @param events_per_thread events each thread can store
+ * @param comm communicator MPI_T_BIND_MPI_COMM event types are bound to
+ */
+event_recorder::event_recorder(
+    const std::vector<event_info> &selected, size_t events_per_thread, MPI_Comm comm)
+    : bind_comm(comm), events_per_thread(events_per_thread), record_size(EVENT_HEADER_SIZE),
+      has_pending(false), outstanding(0), id(next_instance_id++), stopped(false)
+{
+    for (size_t i = 0; i < selected.size(); i++)
+    {
+        std::unique_ptr<event_type> type(new event_type());
+        type->recorder = this;
+        type->position = i;
+        type->info = selected[i];
+        record_size = std::max(record_size, EVENT_HEADER_SIZE + selected[i].size);
+        types.push_back(std::move(type));
+    }
+    /* keep the timestamps of the stored events aligned */
+    record_size = (record_size + 7) / 8 * 8;
+
+    int initialized = 0;
+    MPI_Initialized(&initialized);
+    for (std::unique_ptr<event_type> &type : types)
+    {
+#if MPIT_HAVE_EVENTS
+        if (type->info.bind == MPI_T_BIND_MPI_COMM && !initialized)
+        {
+            type->pending = true;
+            type->error = "waiting for MPI_Init";
+            has_pending.store(true);
+            continue;
+        }
+#endif
+        register_type(*type);
+    }
+}
+
+/**
+ * Allocates the handle of an event type and registers the callback. Sets the error of the type
+ * if that fails.
+ */
+void event_recorder::register_type(event_type &type)
+{
+#if MPIT_HAVE_EVENTS
+    const event_info &info = type.info;
+    if (info.name.empty())
+    {
+        type.error = "not available";
+        return;
+    }
+    if (info.size == 0)
+    {
+        type.error = "datatype not supported";
+        return;
+    }
+    void *object = NULL;
+    if (info.bind == MPI_T_BIND_MPI_COMM)
+    {
+        object = &bind_comm;
+    }
+    else if (info.bind != MPI_T_BIND_NO_OBJECT)
+    {
+        type.error = "bind " + get_mpit_bind(info.bind) + " not supported";
+        return;
+    }
+    int err = MPI_T_event_handle_alloc(info.index, object, MPI_INFO_NULL, &type.registration);
+    if (err != MPI_SUCCESS)
+    {
+        type.error = get_mpit_error(err);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(outstanding_mutex);
+        outstanding++;
+    }
+    /* the callback only touches the buffer of the calling thread */
+    err = MPI_T_event_register_callback(type.registration, MPI_T_CB_REQUIRE_THREAD_SAFE,
+        MPI_INFO_NULL, &type, event_callback);
+    if (err != MPI_SUCCESS)
+    {
+        type.error = get_mpit_error(err);
+        MPI_T_event_handle_free(type.registration, &type, event_free_callback);
+        return;
+    }
+    MPI_T_event_set_dropped_handler(type.registration, event_dropped_callback);
+    type.error.clear();
+    type.registered = true;
+#else
+    type.error = "MPI_T events need MPI 4.0";
+#endif
+}
+
+/**
+ * Registers the event types bound to a communicator that waited for MPI_Init. Costs one atomic
+ * load once nothing is pending anymore.
+ *
+ * @return true if pending event types were registered by this call, whether successfully or not
+ */
+bool event_recorder::register_pending()
+{
+    if (!has_pending.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    int initialized = 0;
+    int finalized = 0;
+    MPI_Initialized(&initialized);
+    MPI_Finalized(&finalized);
+    if (!initialized || finalized)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(register_mutex);
+    if (!has_pending.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+    for (std::unique_ptr<event_type> &type : types)
+    {
+        if (type->pending)
+        {
+            type->pending = false;
+            register_type(*type);
+        }
+    }
+    has_pending.store(false, std::memory_order_release);
+    return true;
+}
+
+event_recorder::~event_recorder()
+{
+    stop();
+}
+
+/**
+ * @return true if the MPI library was built with MPI_T events
+ */
+bool event_recorder::is_supported()
+{
+#if MPIT_HAVE_EVENTS
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @return true if the event type with the position event in the selection is recorded
+ */
+bool event_recorder::is_valid(size_t event) const
+{
+    return types.at(event)->registered;
+}
+
+/**
+ * @return true if the event type with the position event in the selection waits for MPI_Init
+ */
+bool event_recorder::is_pending(size_t event) const
+{
+    return types.at(event)->pending;
+}
+
+/**
+ * @return why the event type with the position event in the selection is not recorded, empty
+ * if it is
+ */
+const std::string &event_recorder::get_error(size_t event) const
+{
+    return types.at(event)->error;
+}
+
+size_t event_recorder::get_record_size() const
+{
+    return record_size;
+}
+
+/** recorder of the buffer of the calling thread, 0 if it has none */
+static thread_local unsigned long long buffer_recorder_id = 0;
+static thread_local event_recorder::thread_buffer *this_thread_buffer = nullptr;
+
+/**
+ * @return the buffer of the calling thread, NULL if add_thread() was not called by the thread
+ */
+event_recorder::thread_buffer *event_recorder::get_thread_buffer() const
+{
+    return (buffer_recorder_id == id) ? this_thread_buffer : nullptr;
+}
+
+/**
+ * Allocates the buffer of the calling thread, if it has none. Must be called by every thread
+ * whose events are recorded, before its first event.
+ */
+void event_recorder::add_thread()
+{
+    if (buffer_recorder_id == id)
+    {
+        return;
+    }
+    std::unique_ptr<thread_buffer> buffer(new thread_buffer());
+    buffer->events.resize(events_per_thread * record_size);
+    this_thread_buffer = buffer.get();
+    buffer_recorder_id = id;
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    buffers.push_back(std::move(buffer));
+}
+
+/**
+ * Counts a free callback of the MPI library, see stop().
+ */
+void event_recorder::registration_freed()
+{
+    std::lock_guard<std::mutex> lock(outstanding_mutex);
+    outstanding--;
+    outstanding_freed.notify_all();
+}
+
+/**
+ * Frees the registrations, no events are recorded afterwards. Event callbacks may still run
+ * until the MPI library calls the free callback of their registration, so this waits for all
+ * free callbacks before the buffers are read or deleted.
+ */
+void event_recorder::stop()
+{
+    std::lock_guard<std::mutex> lock(register_mutex);
+    if (stopped)
+    {
+        return;
+    }
+    stopped = true;
+    has_pending.store(false);
+#if MPIT_HAVE_EVENTS
+    for (std::unique_ptr<event_type> &type : types)
+    {
+        if (type->registered)
+        {
+            MPI_T_event_handle_free(type->registration, type.get(), event_free_callback);
+            type->registered = false;
+        }
+    }
+#endif
+    std::unique_lock<std::mutex> outstanding_lock(outstanding_mutex);
+    outstanding_freed.wait(outstanding_lock, [this] { return outstanding == 0; });
+}
+
+/**
+ * @return the number of events stored by all threads
+ */
+unsigned long long event_recorder::get_recorded() const
+{
+    unsigned long long recorded = 0;
+    for (const std::unique_ptr<thread_buffer> &buffer : buffers)
+    {
+        recorded += buffer->count.load(std::memory_order_acquire);
+    }
+    return recorded;
+}
+
+/**
+ * @return the number of events dropped by full or missing buffers and by the MPI library
+ */
+unsigned long long event_recorder::get_dropped() const
+{
+    unsigned long long dropped = 0;
+    for (const std::unique_ptr<thread_buffer> &buffer : buffers)
+    {
+        dropped += buffer->dropped.load(std::memory_order_relaxed);
+    }
+    for (const std::unique_ptr<event_type> &type : types)
+    {
+        dropped += type->mpi_dropped.load(std::memory_order_relaxed);
+        dropped += type->unbuffered.load(std::memory_order_relaxed);
+    }
+    return dropped;
+}
+
+static void write_string(FILE *file, const std::string &text)
+{
+    uint32_t length = text.size();
+    fwrite(&length, sizeof(length), 1, file);
+    fwrite(text.data(), 1, length, file);
+}
+
+/**
+ * Stops the recording and writes the events of all threads to file_name. The layout is
+ * described in README.md.
+ *
+ * Throws a runtime_error if the file can not be written
+ */
+void event_recorder::write(const std::string &file_name)
+{
+    stop();
+    FILE *file = fopen(file_name.c_str(), "wb");
+    if (file == NULL)
+    {
+        throw std::runtime_error(file_name + ": " + strerror(errno));
+    }
+    fwrite("MPITEVT1", 1, 8, file);
+    uint32_t header[2] = { (uint32_t) record_size, (uint32_t) types.size() };
+    fwrite(header, sizeof(header), 1, file);
+    for (const std::unique_ptr<event_type> &type : types)
+    {
+        int32_t index = type->info.index;
+        uint32_t size = type->info.size;
+        uint64_t mpi_dropped = type->mpi_dropped.load();
+        uint64_t unbuffered = type->unbuffered.load();
+        fwrite(&index, sizeof(index), 1, file);
+        fwrite(&size, sizeof(size), 1, file);
+        fwrite(&mpi_dropped, sizeof(mpi_dropped), 1, file);
+        fwrite(&unbuffered, sizeof(unbuffered), 1, file);
+        write_string(file, type->info.name);
+    }
+
+    /* timestamps are ticks of their source */
+    uint32_t num_sources = 0;
+#if MPIT_HAVE_EVENTS
+    int sources = 0;
+    if (MPI_T_source_get_num(&sources) == MPI_SUCCESS)
+    {
+        num_sources = sources;
+    }
+#endif
+    fwrite(&num_sources, sizeof(num_sources), 1, file);
+#if MPIT_HAVE_EVENTS
+    for (int i = 0; i < (int) num_sources; i++)
+    {
+        char name[256] = "";
+        int name_len = sizeof(name);
+        int desc_len = 0;
+        MPI_T_source_order ordering;
+        MPI_Count ticks_per_second = 0;
+        MPI_Count max_ticks = 0;
+        MPI_T_source_get_info(i, name, &name_len, NULL, &desc_len, &ordering, &ticks_per_second,
+            &max_ticks, NULL);
+        int32_t index = i;
+        int64_t ticks = ticks_per_second;
+        fwrite(&index, sizeof(index), 1, file);
+        fwrite(&ticks, sizeof(ticks), 1, file);
+        write_string(file, name);
+    }
+#endif
+
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    uint32_t num_threads = buffers.size();
+    fwrite(&num_threads, sizeof(num_threads), 1, file);
+    for (const std::unique_ptr<thread_buffer> &buffer : buffers)
+    {
+        uint64_t count = buffer->count.load(std::memory_order_acquire);
+        uint64_t dropped = buffer->dropped.load(std::memory_order_relaxed);
+        fwrite(&count, sizeof(count), 1, file);
+        fwrite(&dropped, sizeof(dropped), 1, file);
+        fwrite(buffer->events.data(), record_size, count, file);
+    }
+    bool failed = ferror(file);
+    if (fclose(file) != 0 || failed)
+    {
+        throw std::runtime_error(file_name + ": write failed");
     }
 }
 }
@@ -12,13 +12,22 @@
 #ifndef MPIT_INTERFACE_H_
 #define MPIT_INTERFACE_H_
 
-#include <map>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <mpi.h>
+#include <mutex>
 #include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <vector>
+
+/* MPI_T events were added in MPI 4.0; define MPIT_HAVE_EVENTS to 0 to leave them out */
+#if !defined(MPIT_HAVE_EVENTS) && MPI_VERSION >= 4
+#define MPIT_HAVE_EVENTS 1
+#endif
 
 namespace mpit_interface
 {
@@ -41,26 +50,272 @@ public:
     }
 };
 
+/**
+ * Metadata of one CVar, as returned by MPI_T_cvar_get_info.
+ */
+struct cvar_info
+{
+    int index;
+    std::string name;
+    int verbosity;
+    MPI_Datatype datatype;
+    MPI_T_enum enumtype;
+    int bind;
+    int scope;
+};
+
+/**
+ * Metadata of one PVar, as returned by MPI_T_pvar_get_info.
+ */
+struct pvar_info
+{
+    int index;
+    std::string name;
+    int verbosity;
+    int var_class;
+    MPI_Datatype datatype;
+    MPI_T_enum enumtype;
+    int bind;
+    int readonly;
+    int continuous;
+    int atomic;
+};
+
+/**
+ * Metadata of one event type, as returned by MPI_T_event_get_info.
+ */
+struct event_info
+{
+    int index;
+    std::string name;
+    int verbosity;
+    int bind;
+    /** bytes copied by MPI_T_event_copy, 0 if the layout uses unknown datatypes */
+    size_t size;
+};
+
+/**
+ * One item of an MPI_T enumeration, as returned by MPI_T_enum_get_item.
+ */
+struct enum_item
+{
+    int value;
+    std::string name;
+};
+
+/**
+ * Cached handle, the value written last and the enumeration items of one CVar.
+ *
+ * The fields are read without lock. handle, shadow and items are only changed while holding
+ * mutex, so threads only wait for each other when they change the same CVar.
+ */
+struct cvar_state
+{
+    std::mutex mutex;
+    std::atomic<MPI_T_cvar_handle> handle{MPI_T_CVAR_HANDLE_NULL};
+    std::atomic<long long> shadow{0};
+    std::atomic<bool> shadow_valid{false};
+    std::vector<enum_item> items;
+    std::atomic<bool> items_valid{false};
+};
+
+/**
+ * CVar changed by mpit_values::push_value(), with the value it had before.
+ */
+struct value_stack_entry
+{
+    int cvar_index;
+    long long previous;
+    /** false if the push did not change the CVar, then the pop has nothing to restore */
+    bool changed;
+};
+
+/** Result of mpit_values::pop_value() */
+enum pop_result
+{
+    /** no value of the CVar was pushed by the calling thread */
+    POP_NOT_PUSHED,
+    /** the CVar already has the value from before the push */
+    POP_UNCHANGED,
+    POP_RESTORED
+};
+
+/**
+ * Snapshot of all CVars known to the MPI library. A published snapshot is never changed, a
+ * grown catalogue is published as a new snapshot.
+ */
+struct cvar_catalogue
+{
+    /** all CVars, in MPI_T index order */
+    std::vector<cvar_info> cvars;
+    /** indices into cvars, sorted by name */
+    std::vector<int> cvars_by_name;
+    /** state of each CVar, shared by all snapshots */
+    std::vector<cvar_state *> states;
+};
+
 class mpit_values
 {
 public:
-    mpit_values();
+    explicit mpit_values(int required_thread_level = MPI_THREAD_SINGLE);
     ~mpit_values();
-    void get_mpit_bind_no_object_int_values(int cvar_index, int *value);
-    void set_mpit_bind_no_object_int_values(int cvar_index, int *value);
+    void read_value(int cvar_index, long long *value);
+    void write_value(int cvar_index, long long value);
+    void get_int_value(int cvar_index, int *value);
+    void set_int_value(int cvar_index, int *value);
     void change_mpi_variable(int cvar_index, int *value);
-    int change_mpi_variable_by_name(std::string cvar_name, int *value);
+    void push_value(int cvar_index, long long value);
+    void push_current_value(int cvar_index);
+    pop_result pop_value(int cvar_index, long long *restored);
+    void push_int_value(int cvar_index, int *value);
+    pop_result pop_int_value(int cvar_index, int *restored);
+    bool is_supported(int cvar_index) const;
+    const std::vector<enum_item> &get_enum_items(int cvar_index);
+    void set_bind_comm(MPI_Comm comm);
+    int change_mpi_variable_by_name(const std::string &cvar_name, int *value);
+    int get_cvar_by_name(const std::string &cvar_name);
+    const cvar_info &get_cvar_info(int cvar_index) const;
+    std::string get_cvar_description(int cvar_index) const;
+    const std::vector<cvar_info> &get_cvars() const;
+    const std::vector<pvar_info> &get_pvars() const;
+    const std::vector<event_info> &get_events() const;
+    MPI_Comm get_bind_comm() const;
+    int get_thread_level() const;
+    void set_verify_writes(bool verify);
 
 private:
-    int get_cvar_by_name(const std::string &cvar_name);
+    void update_cvar_catalogue();
+    void update_pvar_catalogue();
+    void update_event_catalogue();
+    int find_cvar(const std::string &cvar_name) const;
+    cvar_state &get_state(int cvar_index) const;
+    MPI_T_cvar_handle get_handle(int cvar_index);
+    void read_raw_value(int cvar_index, MPI_T_cvar_handle handle, long long *value);
+    void check_supported(int cvar_index) const;
+    long long get_current_value(int cvar_index);
+    int get_tuning_value(int cvar_index, long long raw_value);
+    std::vector<value_stack_entry> &get_value_stack();
+
+    int thread_level;
+    bool verify_writes;
+    /** communicator MPI_T_BIND_MPI_COMM CVars are bound to */
+    MPI_Comm bind_comm;
+
+    /** current snapshot of the CVars, read without lock */
+    std::atomic<const cvar_catalogue *> catalogue;
+    /** serializes growing the catalogue */
+    std::mutex catalogue_mutex;
+    /** all snapshots ever published, as readers might still use older ones */
+    std::vector<std::unique_ptr<cvar_catalogue>> catalogues;
+    std::vector<std::unique_ptr<cvar_state>> states;
+
+    /** all PVars known to the MPI library, in MPI_T index order */
+    std::vector<pvar_info> pvars;
+    /** all event types known to the MPI library, in MPI_T index order, empty before MPI 4.0 */
+    std::vector<event_info> events;
+
+    /** identifies the instance in the value stack cache of the threads */
+    unsigned long long id;
+    std::mutex value_stacks_mutex;
+    /** per-thread stacks of the CVars changed by push_value() */
+    std::vector<std::unique_ptr<std::vector<value_stack_entry>>> value_stacks;
+};
+
+/**
+ * Records MPI_T events into per-thread buffers.
+ *
+ * A callback is registered for each selected event type. The callback copies the event, its
+ * timestamp and its source into a buffer of the calling thread. The buffers hold a fixed number
+ * of events and are allocated by add_thread(), never in the callback, so events of threads
+ * without a buffer are dropped and counted. So are events that do not fit and the events the MPI
+ * library dropped itself. stop() frees the registrations and waits until the MPI library
+ * confirmed with the free callbacks that no event callback runs anymore; write() then stores all
+ * buffers in a binary file, see README.md. Event types bound to a communicator are bound to the given
+ * communicator; before MPI_Init they stay pending until register_pending() is called.
+ */
+class event_recorder
+{
+public:
+    event_recorder(const std::vector<event_info> &selected, size_t events_per_thread,
+        MPI_Comm comm);
+    ~event_recorder();
+    static bool is_supported();
+    bool is_valid(size_t event) const;
+    bool is_pending(size_t event) const;
+    const std::string &get_error(size_t event) const;
+    bool register_pending();
+    void add_thread();
+    void stop();
+    void write(const std::string &file_name);
+    unsigned long long get_recorded() const;
+    unsigned long long get_dropped() const;
+
+    struct event_type;
+    struct thread_buffer;
+    /** buffer of the calling thread, for the event callbacks */
+    thread_buffer *get_thread_buffer() const;
+    size_t get_record_size() const;
+    /** for the free callbacks */
+    void registration_freed();
+
+private:
+    void register_type(event_type &type);
+
+    MPI_Comm bind_comm;
+    size_t events_per_thread;
+    /** bytes per stored event, the header and the largest selected event */
+    size_t record_size;
+    std::vector<std::unique_ptr<event_type>> types;
+    /** set while event types wait for MPI_Init */
+    std::atomic<bool> has_pending;
+    /** serializes registering pending event types and stop() */
+    std::mutex register_mutex;
+    /** allocated handles whose free callback did not run yet */
+    int outstanding;
+    std::mutex outstanding_mutex;
+    std::condition_variable outstanding_freed;
+    std::mutex buffers_mutex;
+    std::vector<std::unique_ptr<thread_buffer>> buffers;
+    /** identifies the recorder in the buffer cache of the threads */
+    unsigned long long id;
+    bool stopped;
+};
 
-    std::map<std::string, int> known_cvars;
+/**
+ * A PVar session with one handle per selected PVar.
+ *
+ * The handles are allocated and non-continuous PVars are started when the session is created,
+ * so read() only calls MPI_T_pvar_read. PVars with several elements, e.g. one per peer, are
+ * read as the sum of their elements. PVars bound to a communicator are bound to the given
+ * communicator and need MPI_Init. A session must only be used by one thread at a time and must
+ * be deleted before the mpit_values instance.
+ */
+class pvar_session
+{
+public:
+    pvar_session(const std::vector<pvar_info> &selected, MPI_Comm comm);
+    ~pvar_session();
+    void read(std::vector<double> &values);
+    bool is_valid(size_t pvar) const;
+    const std::string &get_error(size_t pvar) const;
+
+private:
+    MPI_T_pvar_session session;
+    MPI_Comm bind_comm;
+    std::vector<MPI_T_pvar_handle> handles;
+    std::vector<MPI_Datatype> datatypes;
+    /** read buffers, one 8 byte slot per element */
+    std::vector<std::vector<unsigned long long>> buffers;
+    /** why a handle could not be allocated, empty for valid handles */
+    std::vector<std::string> errors;
 };
 
 std::string get_mpit_scope(int scope);
 std::string get_mpit_error(int error);
 std::string get_mpit_bind(int bind);
 std::string get_mpit_datatype(MPI_Datatype datatype);
+std::string get_mpit_pvar_class(int var_class);
+bool is_cumulative_pvar_class(int var_class);
 }
 
 #endif /* MPIT_INTERFACE_H_ */
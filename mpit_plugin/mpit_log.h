@@ -0,0 +1,21 @@
+/*
+ * mpit_plugin,
+ *
+ * a c++ MPI_T tuning plugin for Score-P.
+ * Copyright (C) 2015 TU Dresden, ZIH
+ *
+ * @brief Log function of the plugin, shared by its source files.
+ *
+ */
+
+#ifndef MPIT_LOG_H_
+#define MPIT_LOG_H_
+
+typedef enum { LOG_VERBOSE, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_INVALID } log_level;
+
+/**
+ * Prints messages depending on SCOREP_TUNING_MPIT_PLUGIN_VERBOSE, see mpit_plugin.cpp.
+ */
+void llog(log_level msg_level, const char *message_fmt, ...);
+
+#endif /* MPIT_LOG_H_ */
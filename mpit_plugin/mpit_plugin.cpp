@@ -12,15 +12,36 @@
  */
 
 #include "mpit_plugin.h"
+#include "mpi_histogram.h"
+#include "mpit_log.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <errno.h>
+#include <fnmatch.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
-typedef enum { LOG_VERBOSE, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_INVALID } log_level;
+/** maximum number of CVars exposed as tuning actions */
+#define MAX_TUNING_ACTIONS 256
+/** CVars exposed if SCOREP_TUNING_MPIT_PLUGIN_CVARS is not set */
+#define DEFAULT_CVARS "MPIR_CVAR_REDUCE_SHORT_MSG_SIZE"
+/** tuning action whose value tags the region PVars are sampled for */
+#define PVAR_REGION_ACTION "MPIT_PVAR_REGION"
+/** events each thread can store if SCOREP_TUNING_MPIT_PLUGIN_EVENT_BUFFER is not set */
+#define DEFAULT_EVENT_BUFFER 65536
+/** exits of a region tag after which the online histogram mode picks its threshold */
+#define HISTOGRAM_ONLINE_EXITS 8
 
 /**
  * log function.
@@ -80,84 +101,1655 @@ void llog(log_level msg_level, const char *message_fmt, ...)
 }
 
 /**
- * Initialize the plugin
+ * CVar index and name of each tuning action slot. The RRL callbacks only get the value, so every
+ * slot has its own functions, see enter_slot(), exit_slot() and get_slot().
+ */
+static int slot_cvars[MAX_TUNING_ACTIONS];
+static std::string slot_names[MAX_TUNING_ACTIONS];
+static int num_slots = 0;
+
+/* one action per CVar slot, PVAR_REGION_ACTION and the terminating entry */
+static rrl_tuning_action_info return_values[MAX_TUNING_ACTIONS + 2];
+
+/**
+ * Consistency check of one value of an _EQ CVar, running as non-blocking allreduce. The
+ * buffers must stay in place until the request completes.
+ */
+struct eq_check
+{
+    int value;
+    MPI_Request request;
+    unsigned long long hash[2];
+    unsigned long long result[2];
+};
+
+/**
+ * State of a CVar with scope MPI_T_SCOPE_ALL_EQ or MPI_T_SCOPE_GROUP_EQ, which must have the
+ * same value on all processes.
+ */
+struct eq_slot
+{
+    std::mutex mutex;
+    /** duplicate of the communicator the scope refers to, created by the first check */
+    MPI_Comm comm = MPI_COMM_NULL;
+    MPI_Comm scope_comm = MPI_COMM_WORLD;
+    /** values all processes requested at the same check, the same set on all processes */
+    std::set<int> verified;
+    /** values that failed a check before, only used to warn once */
+    std::set<int> rejected;
+    /** check started by the last request, if pending is set */
+    eq_check check;
+    bool pending = false;
+};
+
+/** NULL for slots of CVars that may differ between processes */
+static eq_slot *slot_eq[MAX_TUNING_ACTIONS];
+
+/**
+ * CVar tuning value for each tuning value of the slot, empty if they are the same. Used by the
+ * portable collective actions, see create_collective_actions(). -1 marks values the MPI library
+ * does not provide.
+ */
+static std::vector<int> slot_values[MAX_TUNING_ACTIONS];
+
+/**
+ * Mixes the CVar index and the value into a hash that differs for different values.
+ */
+static unsigned long long eq_hash(int cvar, int value)
+{
+    unsigned long long hash =
+        ((unsigned long long) (unsigned) cvar << 32 | (unsigned) value) + 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * Completes the pending check. Adds its value to verified if all processes requested it;
+ * otherwise the processes disagreed and all verified values are dropped, on all processes alike.
+ * Needs the mutex of the slot.
+ */
+static void eq_finish(int slot, eq_slot &eq)
+{
+    eq_check &check = eq.check;
+    MPI_Wait(&check.request, MPI_STATUS_IGNORE);
+    eq.pending = false;
+    /* the maximum of the hash and of its complement are the own ones only if all processes
+     * contributed the same hash */
+    if (check.result[0] == check.hash[0] && check.result[1] == check.hash[1])
+    {
+        if (eq.verified.insert(check.value).second)
+        {
+            llog(LOG_DEBUG, "MPIT tuning plugin: %d for \"%s\" is consistent\n", check.value,
+                slot_names[slot].c_str());
+        }
+        return;
+    }
+    eq.verified.clear();
+    if (eq.rejected.insert(check.value).second)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: processes use different values for \"%s\", "
+                       "checking all values again\n",
+            slot_names[slot].c_str());
+    }
+}
+
+/**
+ * Decides whether a value of an _EQ CVar may be applied now.
+ *
+ * Every request takes part in exactly one check, whatever its value: it completes the check of
+ * the previous request, then starts a non-blocking allreduce of the hash of its own value. As
+ * the callbacks of a tuned region happen at the same point of the program on every process,
+ * every process starts the same checks in the same order, so the one completed here was started
+ * by all processes already and the wait does not block for long. A value is applied if an
+ * earlier check found that all processes requested it. The verified values only change with the
+ * results of completed checks, so all processes decide from the same set. Processes that request
+ * different values at the same point are detected by the next request, which drops all verified
+ * values until they are requested by all processes again. The callbacks are also a safe point: no
+ * collective is in flight that could see the old value on some processes and the new one on
+ * others.
+ *
+ * @return true if the value can be written
+ */
+static bool eq_allows(int slot, int value)
+{
+    eq_slot &eq = *slot_eq[slot];
+    std::lock_guard<std::mutex> lock(eq.mutex);
+    int initialized = 0;
+    int finalized = 0;
+    MPI_Initialized(&initialized);
+    MPI_Finalized(&finalized);
+    if (!initialized || finalized)
+    {
+        /* no collectives can be affected */
+        return true;
+    }
+    if (eq.comm == MPI_COMM_NULL && MPI_Comm_dup(eq.scope_comm, &eq.comm) != MPI_SUCCESS)
+    {
+        eq.comm = MPI_COMM_NULL;
+        return false;
+    }
+    if (eq.pending)
+    {
+        eq_finish(slot, eq);
+    }
+    bool allowed = eq.verified.count(value) != 0;
+
+    eq_check &check = eq.check;
+    check.value = value;
+    check.hash[0] = eq_hash(slot_cvars[slot], value);
+    check.hash[1] = ~check.hash[0];
+    if (MPI_Iallreduce(check.hash, check.result, 2, MPI_UNSIGNED_LONG_LONG, MPI_MAX, eq.comm,
+            &check.request) == MPI_SUCCESS)
+    {
+        eq.pending = true;
+    }
+    if (!allowed)
+    {
+        llog(LOG_DEBUG, "MPIT tuning plugin: deferring %d for \"%s\" until all processes agree\n",
+            value, slot_names[slot].c_str());
+    }
+    return allowed;
+}
+
+/**
+ * Frees the _EQ slots. The last check of a slot may not have been started by all processes, so
+ * it is only tested; a slot with an unfinished check is leaked with its communicator, as
+ * collective requests can not be cancelled. If MPI is finalized already, MPI_Finalize completed
+ * the checks.
+ */
+static void eq_fini()
+{
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    for (int slot = 0; slot < num_slots; slot++)
+    {
+        eq_slot *eq = slot_eq[slot];
+        if (eq == NULL)
+        {
+            continue;
+        }
+        slot_eq[slot] = NULL;
+        if (!finalized)
+        {
+            int done = 1;
+            if (eq->pending)
+            {
+                MPI_Test(&eq->check.request, &done, MPI_STATUS_IGNORE);
+            }
+            if (!done)
+            {
+                llog(LOG_DEBUG, "MPIT tuning plugin: leaving the last check of \"%s\" pending\n",
+                    slot_names[slot].c_str());
+                continue;
+            }
+            if (eq->comm != MPI_COMM_NULL)
+            {
+                MPI_Comm_free(&eq->comm);
+            }
+        }
+        delete eq;
+    }
+}
+
+/**
+ * Sets the CVar of a slot.
+ *
+ * @param slot tuning action slot
+ * @param new_settings new CVar setting
+ * @return 0 on success, -1 on failure
+ */
+static int set_cvar(int slot, int new_settings)
+{
+    const std::vector<int> &values = slot_values[slot];
+    if (!values.empty())
+    {
+        if (new_settings < 0 || new_settings >= (int) values.size() || values[new_settings] < 0)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: \"%s\" has no value %d with this MPI\n",
+                slot_names[slot].c_str(), new_settings);
+            return -1;
+        }
+        new_settings = values[new_settings];
+    }
+    if (slot_eq[slot] != NULL && !eq_allows(slot, new_settings))
+    {
+        return 0;
+    }
+    try
+    {
+        mpi_value_->set_int_value(slot_cvars[slot], &new_settings);
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: setting \"%s\" to %d: %s\n",
+            slot_names[slot].c_str(), new_settings, e.what());
+        return -1;
+    }
+    llog(LOG_DEBUG, "MPIT tuning plugin: set \"%s\" to %d\n", slot_names[slot].c_str(),
+        new_settings);
+    return 0;
+}
+
+static void register_pending_events();
+
+/**
+ * Sets the CVar of a slot when a region is entered. The old value is kept on the value stack of
+ * the thread, if it changes.
+ *
+ * @param slot tuning action slot
+ * @param new_settings new CVar setting
+ * @return 0 on success, -1 on failure
+ */
+static int enter_cvar(int slot, int new_settings)
+{
+    register_pending_events();
+    const std::vector<int> &values = slot_values[slot];
+    if (!values.empty())
+    {
+        if (new_settings < 0 || new_settings >= (int) values.size() || values[new_settings] < 0)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: \"%s\" has no value %d with this MPI\n",
+                slot_names[slot].c_str(), new_settings);
+            mpi_value_->push_current_value(slot_cvars[slot]);
+            return -1;
+        }
+        new_settings = values[new_settings];
+    }
+    if (slot_eq[slot] != NULL && !eq_allows(slot, new_settings))
+    {
+        mpi_value_->push_current_value(slot_cvars[slot]);
+        return 0;
+    }
+    try
+    {
+        mpi_value_->push_int_value(slot_cvars[slot], &new_settings);
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: setting \"%s\" to %d: %s\n",
+            slot_names[slot].c_str(), new_settings, e.what());
+        return -1;
+    }
+    llog(LOG_DEBUG, "MPIT tuning plugin: entered \"%s\" = %d\n", slot_names[slot].c_str(),
+        new_settings);
+    return 0;
+}
+
+/**
+ * Restores the CVar of a slot when a region is left, to the value from before the matching
+ * enter_cvar(). Costs nothing if the enter did not change the CVar. Falls back to set_cvar() with
+ * the value given by the tuning substrate if the enter was not seen by this thread.
+ *
+ * @param slot tuning action slot
+ * @param old_settings CVar setting to restore, as given by the tuning substrate
+ * @return 0 on success, -1 on failure
+ */
+static int exit_cvar(int slot, int old_settings)
+{
+    mpit_interface::pop_result result;
+    int restored = 0;
+    try
+    {
+        result = mpi_value_->pop_int_value(slot_cvars[slot], &restored);
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: restoring \"%s\": %s\n", slot_names[slot].c_str(),
+            e.what());
+        return -1;
+    }
+    if (result == mpit_interface::POP_NOT_PUSHED)
+    {
+        return set_cvar(slot, old_settings);
+    }
+    if (result == mpit_interface::POP_RESTORED)
+    {
+        llog(LOG_DEBUG, "MPIT tuning plugin: restored \"%s\" = %d\n", slot_names[slot].c_str(),
+            restored);
+    }
+    return 0;
+}
+
+/**
+ * Reads the CVar of a slot.
+ *
+ * @param slot tuning action slot
+ * @return value of the CVar, -1 on failure
+ */
+static int get_cvar(int slot)
+{
+    int value = -1;
+    try
+    {
+        mpi_value_->get_int_value(slot_cvars[slot], &value);
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: reading \"%s\": %s\n", slot_names[slot].c_str(),
+            e.what());
+        return -1;
+    }
+    const std::vector<int> &values = slot_values[slot];
+    if (!values.empty())
+    {
+        auto it = std::find(values.begin(), values.end(), value);
+        return (it != values.end()) ? (int) (it - values.begin()) : -1;
+    }
+    return value;
+}
+
+template <int SLOT>
+static int enter_slot(int new_settings)
+{
+    return enter_cvar(SLOT, new_settings);
+}
+
+template <int SLOT>
+static int exit_slot(int old_settings)
+{
+    return exit_cvar(SLOT, old_settings);
+}
+
+template <int SLOT>
+static int get_slot()
+{
+    return get_cvar(SLOT);
+}
+
+/**
+ * Fills return_values[0 .. N-1] with the callbacks of the slots, instantiating enter_slot(),
+ * exit_slot() and get_slot() for every slot at compile time.
+ */
+template <int N>
+struct slot_table
+{
+    static void fill(rrl_tuning_action_info *actions)
+    {
+        slot_table<N - 1>::fill(actions);
+        actions[N - 1].current_config = &get_slot<N - 1>;
+        actions[N - 1].enter_region_set_config = &enter_slot<N - 1>;
+        actions[N - 1].exit_region_set_config = &exit_slot<N - 1>;
+    }
+};
+
+template <>
+struct slot_table<0>
+{
+    static void fill(rrl_tuning_action_info *)
+    {
+    }
+};
+
+/**
+ * Checks whether a CVar can be exposed as tuning action.
+ */
+static bool supported_cvar(const mpit_interface::cvar_info &info)
+{
+    if (info.scope == MPI_T_SCOPE_CONSTANT || info.scope == MPI_T_SCOPE_READONLY)
+    {
+        return false;
+    }
+    return mpi_value_->is_supported(info.index);
+}
+
+/**
+ * Logs the tuning values of a CVar with enumeration.
+ */
+static void log_enum_items(int slot)
+{
+    try
+    {
+        const std::vector<mpit_interface::enum_item> &items =
+            mpi_value_->get_enum_items(slot_cvars[slot]);
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            llog(LOG_DEBUG, "MPIT tuning plugin: \"%s\": %zu = %s (%d)\n",
+                slot_names[slot].c_str(), i, items[i].name.c_str(), items[i].value);
+        }
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: reading enumeration of \"%s\": %s\n",
+            slot_names[slot].c_str(), e.what());
+    }
+}
+
+/**
+ * Splits a comma separated list, skipping empty elements.
+ */
+static std::vector<std::string> split_patterns(const std::string &patterns)
+{
+    std::vector<std::string> result;
+    size_t begin = 0;
+    while (begin <= patterns.size())
+    {
+        size_t end = patterns.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = patterns.size();
+        }
+        if (end > begin)
+        {
+            result.push_back(patterns.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return result;
+}
+
+/**
+ * PVar values at the enter of one tagged region.
+ */
+struct pvar_frame
+{
+    int region;
+    std::vector<double> enter;
+    /** false if the PVars could not be read at the enter, the exit then skips the accounting */
+    bool valid = false;
+    /** value of the online threshold CVar before the enter, if it was changed */
+    bool online_set = false;
+    int online_previous = 0;
+};
+
+/**
+ * Accumulated PVar values of one region tag.
+ */
+struct pvar_region_stats
+{
+    uint64_t samples = 0;
+    std::vector<double> sum;
+};
+
+/**
+ * PVar session and counters of one thread. Only the owning thread writes them; fini() reads
+ * them after all regions are left.
+ */
+struct pvar_thread
+{
+    mpit_interface::pvar_session *session = nullptr;
+    bool failed = false;
+    /** frames[0 .. depth-1] are the open regions; deeper frames are kept for reuse */
+    std::vector<pvar_frame> frames;
+    size_t depth = 0;
+    std::vector<double> exit_values;
+    std::map<int, pvar_region_stats> regions;
+};
+
+static std::vector<mpit_interface::pvar_info> selected_pvars;
+static std::vector<pvar_thread *> pvar_threads;
+static std::mutex pvar_threads_mutex;
+static thread_local pvar_thread *this_pvar_thread = nullptr;
+/** rank written into the name of the summary, -1 if MPI was not initialized yet */
+static std::atomic<int> pvar_rank(-1);
+
+/**
+ * Returns the PVar state of the calling thread. Creates the session on the first call, which
+ * is the only time a lock is taken.
+ *
+ * @return the state, NULL if no session could be created
+ */
+static pvar_thread *get_pvar_thread()
+{
+    pvar_thread *thread = this_pvar_thread;
+    if (thread == nullptr)
+    {
+        thread = new pvar_thread();
+        this_pvar_thread = thread;
+        std::lock_guard<std::mutex> lock(pvar_threads_mutex);
+        pvar_threads.push_back(thread);
+    }
+    if (thread->session != nullptr)
+    {
+        return thread;
+    }
+    if (thread->failed)
+    {
+        return nullptr;
+    }
+
+    int initialized = 0;
+    MPI_Initialized(&initialized);
+    if (initialized && pvar_rank.load() < 0)
+    {
+        int rank = 0;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        pvar_rank.store(rank);
+    }
+    try
+    {
+        thread->session =
+            new mpit_interface::pvar_session(selected_pvars, mpi_value_->get_bind_comm());
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: creating PVar session: %s\n", e.what());
+        thread->failed = true;
+        return nullptr;
+    }
+    static std::once_flag logged;
+    std::call_once(logged, [thread]() {
+        for (size_t i = 0; i < selected_pvars.size(); i++)
+        {
+            if (!thread->session->is_valid(i))
+            {
+                llog(LOG_WARN, "MPIT tuning plugin: can not read PVar \"%s\": %s\n",
+                    selected_pvars[i].name.c_str(), thread->session->get_error(i).c_str());
+            }
+        }
+    });
+    return thread;
+}
+
+/**
+ * Threshold picked by the online histogram mode for one region tag.
+ */
+struct online_region
+{
+    uint64_t exits = 0;
+    /** -1 until picked */
+    long long threshold = -1;
+};
+
+/** CVar set by the online histogram mode, -1 if the mode is off */
+static int online_cvar = -1;
+static mpi_histogram::call online_call = mpi_histogram::NUM_CALLS;
+static std::map<int, online_region> online_regions;
+static std::mutex online_mutex;
+static MPI_Comm online_comm = MPI_COMM_NULL;
+
+/**
+ * Sets the online threshold CVar to the threshold picked for the region, if there is one.
+ */
+static void online_enter(pvar_frame &frame)
+{
+    int threshold;
+    {
+        std::lock_guard<std::mutex> lock(online_mutex);
+        auto it = online_regions.find(frame.region);
+        if (it == online_regions.end() || it->second.threshold < 0)
+        {
+            return;
+        }
+        threshold = (int) it->second.threshold;
+    }
+    try
+    {
+        mpi_value_->get_int_value(online_cvar, &frame.online_previous);
+        mpi_value_->set_int_value(online_cvar, &threshold);
+        frame.online_set = true;
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: setting online threshold: %s\n", e.what());
+    }
+}
+
+/**
+ * Restores the online threshold CVar, and picks the threshold of the region after
+ * HISTOGRAM_ONLINE_EXITS exits. The histograms of all threads of all processes are summed, so
+ * all processes pick the same threshold, and the threshold is the largest size of the bucket
+ * that holds the median message. As the sum is a blocking collective, tagged regions must be
+ * left by all processes in the same order, by one thread per process.
+ */
+static void online_exit(pvar_frame &frame)
+{
+    if (frame.online_set)
+    {
+        try
+        {
+            mpi_value_->set_int_value(online_cvar, &frame.online_previous);
+        }
+        catch (std::runtime_error &e)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: restoring online threshold: %s\n", e.what());
+        }
+        frame.online_set = false;
+    }
+
+    std::lock_guard<std::mutex> lock(online_mutex);
+    online_region &region = online_regions[frame.region];
+    if (++region.exits != HISTOGRAM_ONLINE_EXITS)
+    {
+        return;
+    }
+    int initialized = 0;
+    int finalized = 0;
+    MPI_Initialized(&initialized);
+    MPI_Finalized(&finalized);
+    if (!initialized || finalized)
+    {
+        return;
+    }
+    if (online_comm == MPI_COMM_NULL && PMPI_Comm_dup(MPI_COMM_WORLD, &online_comm) != MPI_SUCCESS)
+    {
+        online_comm = MPI_COMM_NULL;
+        return;
+    }
+
+    uint64_t local[mpi_histogram::NUM_BUCKETS] = {};
+    uint64_t global[mpi_histogram::NUM_BUCKETS] = {};
+    mpi_histogram::get_process_histogram(frame.region, online_call, local);
+    /* PMPI, so the histogram wrappers do not count it */
+    if (PMPI_Allreduce(local, global, mpi_histogram::NUM_BUCKETS, MPI_UINT64_T, MPI_SUM,
+            online_comm) != MPI_SUCCESS)
+    {
+        return;
+    }
+    uint64_t total = 0;
+    for (int b = 0; b < mpi_histogram::NUM_BUCKETS; b++)
+    {
+        total += global[b];
+    }
+    if (total == 0)
+    {
+        llog(LOG_INFO, "MPIT tuning plugin: no %s calls in region %d, keeping the threshold\n",
+            mpi_histogram::get_call_name(online_call), frame.region);
+        return;
+    }
+    uint64_t below = 0;
+    int median = 0;
+    while (median < mpi_histogram::NUM_BUCKETS - 1 && 2 * (below + global[median]) < total)
+    {
+        below += global[median++];
+    }
+    uint64_t threshold = (median < mpi_histogram::NUM_BUCKETS - 1) ?
+                             mpi_histogram::get_bucket_min(median + 1) - 1 :
+                             (uint64_t) INT_MAX;
+    region.threshold = (long long) std::min(threshold, (uint64_t) INT_MAX);
+    llog(LOG_INFO, "MPIT tuning plugin: region %d: %llu %s calls, setting \"%s\" to %lld\n",
+        frame.region, (unsigned long long) total, mpi_histogram::get_call_name(online_call),
+        mpi_value_->get_cvar_info(online_cvar).name.c_str(), region.threshold);
+}
+
+/**
+ * Enables the online histogram mode given by SCOREP_TUNING_MPIT_PLUGIN_HISTOGRAM_ONLINE as
+ * <CVar>:<MPI call>.
+ */
+static void select_histogram_online()
+{
+    const char *env = getenv("SCOREP_TUNING_MPIT_PLUGIN_HISTOGRAM_ONLINE");
+    if (env == NULL || env[0] == '\0')
+    {
+        return;
+    }
+    std::string setting(env);
+    size_t separator = setting.rfind(':');
+    mpi_histogram::call call = (separator != std::string::npos) ?
+                                   mpi_histogram::find_call(setting.substr(separator + 1)) :
+                                   mpi_histogram::NUM_CALLS;
+    if (call == mpi_histogram::NUM_CALLS)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: \"%s\" is not <CVar>:<MPI call>\n", env);
+        return;
+    }
+    if (!mpi_histogram::is_enabled())
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: the online threshold needs "
+                       "SCOREP_TUNING_MPIT_PLUGIN_HISTOGRAM\n");
+        return;
+    }
+    std::string cvar_name = setting.substr(0, separator);
+    try
+    {
+        int cvar = mpi_value_->get_cvar_by_name(cvar_name);
+        if (!supported_cvar(mpi_value_->get_cvar_info(cvar)))
+        {
+            throw std::runtime_error("not supported");
+        }
+        online_cvar = cvar;
+        online_call = call;
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: online threshold \"%s\": %s\n", cvar_name.c_str(),
+            e.what());
+        return;
+    }
+    llog(LOG_VERBOSE, "MPIT tuning plugin: setting \"%s\" from the %s histogram\n",
+        cvar_name.c_str(), mpi_histogram::get_call_name(call));
+}
+
+/**
+ * Enter of a tagged region. Reads the PVars and remembers the tag. The frame is pushed even if
+ * reading fails, so the exit pops the frame of this region.
+ *
+ * @param region tag of the region, as given by the tuning model
+ * @return 0 on success, -1 on failure
+ */
+static int pvar_region_enter(int region)
+{
+    register_pending_events();
+    pvar_thread *thread = get_pvar_thread();
+    if (thread == nullptr)
+    {
+        return -1;
+    }
+    if (thread->depth == thread->frames.size())
+    {
+        thread->frames.emplace_back();
+    }
+    pvar_frame &frame = thread->frames[thread->depth];
+    frame.region = region;
+    frame.valid = true;
+    try
+    {
+        thread->session->read(frame.enter);
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: reading PVars: %s\n", e.what());
+        frame.valid = false;
+    }
+    if (online_cvar >= 0)
+    {
+        online_enter(frame);
+    }
+    thread->depth++;
+    return frame.valid ? 0 : -1;
+}
+
+/**
+ * Exit of a tagged region. Reads the PVars and adds the difference since the enter to the
+ * counters of the region. PVars that describe a state instead of counting are added as read at
+ * the exit, so the summary reports their mean.
+ *
+ * @param region tag of the enclosing region, ignored, the tag of the enter is used
+ * @return 0 on success, -1 on failure
+ */
+static int pvar_region_exit(int region)
+{
+    (void) region;
+    pvar_thread *thread = this_pvar_thread;
+    if (thread == nullptr || thread->depth == 0)
+    {
+        return -1;
+    }
+    thread->depth--;
+    pvar_frame &frame = thread->frames[thread->depth];
+    if (online_cvar >= 0)
+    {
+        online_exit(frame);
+    }
+    if (!frame.valid)
+    {
+        return 0;
+    }
+    try
+    {
+        thread->session->read(thread->exit_values);
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: reading PVars: %s\n", e.what());
+        return -1;
+    }
+
+    pvar_region_stats &stats = thread->regions[frame.region];
+    if (stats.sum.empty())
+    {
+        stats.sum.resize(selected_pvars.size(), 0.0);
+    }
+    stats.samples++;
+    for (size_t i = 0; i < selected_pvars.size(); i++)
+    {
+        if (mpit_interface::is_cumulative_pvar_class(selected_pvars[i].var_class))
+        {
+            stats.sum[i] += thread->exit_values[i] - frame.enter[i];
+        }
+        else
+        {
+            stats.sum[i] += thread->exit_values[i];
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return the tag of the innermost region of the calling thread, 0 outside of tagged regions
+ */
+static int pvar_region_current()
+{
+    pvar_thread *thread = this_pvar_thread;
+    if (thread == nullptr || thread->depth == 0)
+    {
+        return 0;
+    }
+    return thread->frames[thread->depth - 1].region;
+}
+
+/**
+ * Selects the PVars matching one of the comma separated names or shell patterns in
+ * SCOREP_TUNING_MPIT_PLUGIN_PVARS.
+ *
+ * @return true if any PVar is selected
+ */
+static bool select_pvars()
+{
+    const char *env = getenv("SCOREP_TUNING_MPIT_PLUGIN_PVARS");
+    if (env == NULL || env[0] == '\0')
+    {
+        return false;
+    }
+    std::set<int> selected;
+    for (const std::string &pattern : split_patterns(env))
+    {
+        bool found = false;
+        for (const mpit_interface::pvar_info &info : mpi_value_->get_pvars())
+        {
+            if (!info.name.empty() && fnmatch(pattern.c_str(), info.name.c_str(), 0) == 0)
+            {
+                found = true;
+                selected.insert(info.index);
+            }
+        }
+        if (!found)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: no PVar matches \"%s\"\n", pattern.c_str());
+        }
+    }
+    for (int pvar : selected)
+    {
+        const mpit_interface::pvar_info &info = mpi_value_->get_pvars()[pvar];
+        llog(LOG_DEBUG, "MPIT tuning plugin: sampling PVar \"%s\" (%s)\n", info.name.c_str(),
+            mpit_interface::get_mpit_pvar_class(info.var_class).c_str());
+        selected_pvars.push_back(info);
+    }
+    return !selected_pvars.empty();
+}
+
+/**
+ * @return <prefix>.<rank><suffix>, with the prefix from the environment variable env or
+ * default_prefix, and the process id if the rank is not known
+ */
+static std::string get_output_name(
+    const char *env, const char *default_prefix, const char *suffix = ".csv")
+{
+    const char *prefix = getenv(env);
+    if (prefix == NULL || prefix[0] == '\0')
+    {
+        prefix = default_prefix;
+    }
+    int rank = pvar_rank.load();
+    return std::string(prefix) + "." + std::to_string(rank >= 0 ? rank : getpid()) + suffix;
+}
+
+/**
+ * Writes the counters of all threads, merged per region tag, to
+ * <SCOREP_TUNING_MPIT_PLUGIN_PVAR_OUTPUT>.<rank>.csv and frees the sessions.
+ */
+static void write_pvar_summary()
+{
+    std::map<int, pvar_region_stats> regions;
+    for (pvar_thread *thread : pvar_threads)
+    {
+        for (const auto &region : thread->regions)
+        {
+            pvar_region_stats &stats = regions[region.first];
+            if (stats.sum.empty())
+            {
+                stats.sum.resize(selected_pvars.size(), 0.0);
+            }
+            stats.samples += region.second.samples;
+            for (size_t i = 0; i < selected_pvars.size(); i++)
+            {
+                stats.sum[i] += region.second.sum[i];
+            }
+        }
+        delete thread->session;
+        delete thread;
+    }
+    pvar_threads.clear();
+
+    if (regions.empty() || selected_pvars.empty())
+    {
+        return;
+    }
+    std::string file_name = get_output_name("SCOREP_TUNING_MPIT_PLUGIN_PVAR_OUTPUT", "mpit_pvars");
+    FILE *file = fopen(file_name.c_str(), "w");
+    if (file == NULL)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: can not write %s: %s\n", file_name.c_str(),
+            strerror(errno));
+        return;
+    }
+    fprintf(file, "region,pvar,class,statistic,samples,value\n");
+    for (const auto &region : regions)
+    {
+        for (size_t i = 0; i < selected_pvars.size(); i++)
+        {
+            bool cumulative = mpit_interface::is_cumulative_pvar_class(selected_pvars[i].var_class);
+            double value = region.second.sum[i];
+            if (!cumulative)
+            {
+                value /= region.second.samples;
+            }
+            fprintf(file, "%d,%s,%s,%s,%llu,%.17g\n", region.first,
+                selected_pvars[i].name.c_str(),
+                mpit_interface::get_mpit_pvar_class(selected_pvars[i].var_class).c_str(),
+                cumulative ? "delta" : "mean", (unsigned long long) region.second.samples,
+                value);
+        }
+    }
+    fclose(file);
+    llog(LOG_INFO, "MPIT tuning plugin: PVar summary written to %s\n", file_name.c_str());
+}
+
+/** records the MPI_T events selected by SCOREP_TUNING_MPIT_PLUGIN_EVENTS, NULL if none */
+static mpit_interface::event_recorder *event_recorder_ = nullptr;
+static std::vector<mpit_interface::event_info> selected_events;
+
+/**
+ * Logs whether the event type at position i of the selection is recorded.
+ */
+static void log_event_state(size_t i)
+{
+    if (event_recorder_->is_valid(i))
+    {
+        llog(LOG_DEBUG, "MPIT tuning plugin: recording event \"%s\"\n",
+            selected_events[i].name.c_str());
+    }
+    else if (event_recorder_->is_pending(i))
+    {
+        llog(LOG_DEBUG, "MPIT tuning plugin: event \"%s\" is registered after MPI_Init\n",
+            selected_events[i].name.c_str());
+    }
+    else
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: can not record event \"%s\": %s\n",
+            selected_events[i].name.c_str(), event_recorder_->get_error(i).c_str());
+    }
+}
+
+/**
+ * Registers the event types bound to a communicator once MPI is initialized. Called by the
+ * tuning actions, tagged regions and new threads, as the plugin is initialized before MPI_Init.
+ */
+static void register_pending_events()
+{
+    if (event_recorder_ == nullptr || !event_recorder_->register_pending())
+    {
+        return;
+    }
+    for (size_t i = 0; i < selected_events.size(); i++)
+    {
+        if (selected_events[i].bind == MPI_T_BIND_MPI_COMM)
+        {
+            log_event_state(i);
+        }
+    }
+}
+
+/**
+ * Starts recording the MPI_T events matching one of the comma separated names or shell patterns
+ * in SCOREP_TUNING_MPIT_PLUGIN_EVENTS.
+ */
+static void select_events()
+{
+    const char *env = getenv("SCOREP_TUNING_MPIT_PLUGIN_EVENTS");
+    if (env == NULL || env[0] == '\0')
+    {
+        return;
+    }
+    if (!mpit_interface::event_recorder::is_supported())
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: MPI_T events need MPI 4.0, not recording events\n");
+        return;
+    }
+    std::set<int> selected;
+    for (const std::string &pattern : split_patterns(env))
+    {
+        bool found = false;
+        for (const mpit_interface::event_info &info : mpi_value_->get_events())
+        {
+            if (!info.name.empty() && fnmatch(pattern.c_str(), info.name.c_str(), 0) == 0)
+            {
+                found = true;
+                selected.insert(info.index);
+            }
+        }
+        if (!found)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: no event matches \"%s\"\n", pattern.c_str());
+        }
+    }
+    if (selected.empty())
+    {
+        return;
+    }
+    for (int event : selected)
+    {
+        selected_events.push_back(mpi_value_->get_events()[event]);
+    }
+
+    long long events_per_thread = DEFAULT_EVENT_BUFFER;
+    const char *buffer = getenv("SCOREP_TUNING_MPIT_PLUGIN_EVENT_BUFFER");
+    if (buffer != NULL && buffer[0] != '\0')
+    {
+        events_per_thread = atoll(buffer);
+        if (events_per_thread <= 0)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: invalid event buffer size \"%s\", using %d\n",
+                buffer, DEFAULT_EVENT_BUFFER);
+            events_per_thread = DEFAULT_EVENT_BUFFER;
+        }
+    }
+    event_recorder_ = new mpit_interface::event_recorder(
+        selected_events, events_per_thread, mpi_value_->get_bind_comm());
+    /* the buffers of other threads are allocated by create_location() */
+    event_recorder_->add_thread();
+    for (size_t i = 0; i < selected_events.size(); i++)
+    {
+        log_event_state(i);
+    }
+}
+
+/**
+ * Stops the event recording and writes the events to
+ * <SCOREP_TUNING_MPIT_PLUGIN_EVENT_OUTPUT>.<rank>.bin.
+ */
+static void write_events()
+{
+    if (event_recorder_ == nullptr)
+    {
+        return;
+    }
+    for (size_t i = 0; i < selected_events.size(); i++)
+    {
+        if (event_recorder_->is_pending(i))
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: event \"%s\" was not recorded, no tuning "
+                           "action, tagged region or thread started after MPI_Init\n",
+                selected_events[i].name.c_str());
+        }
+    }
+    std::string file_name =
+        get_output_name("SCOREP_TUNING_MPIT_PLUGIN_EVENT_OUTPUT", "mpit_events", ".bin");
+    try
+    {
+        event_recorder_->write(file_name);
+        llog(LOG_INFO, "MPIT tuning plugin: %llu events written to %s, %llu dropped\n",
+            event_recorder_->get_recorded(), file_name.c_str(), event_recorder_->get_dropped());
+    }
+    catch (std::runtime_error &e)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: writing events: %s\n", e.what());
+    }
+    delete event_recorder_;
+    event_recorder_ = nullptr;
+    selected_events.clear();
+}
+
+/**
+ * Parses a profile value: a number, or the name of an item for CVars with an enumeration.
  *
- * loads mpi_value
+ * @return true if the value could be parsed
+ */
+static bool parse_profile_value(int cvar, const std::string &text, long long *value)
+{
+    char *end = NULL;
+    errno = 0;
+    *value = strtoll(text.c_str(), &end, 0);
+    if (errno == 0 && end != text.c_str() && *end == '\0')
+    {
+        return true;
+    }
+    for (const mpit_interface::enum_item &item : mpi_value_->get_enum_items(cvar))
+    {
+        if (item.name == text)
+        {
+            *value = item.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Writes the CVars listed in the file SCOREP_TUNING_MPIT_PLUGIN_PROFILE.
  *
- * @return 0 at sucess
+ * Each line holds a CVar name and a value, separated by white space or "=". Empty lines and
+ * lines starting with "#" are ignored. As many CVars are only honoured before MPI_Init, this is
+ * done at init(), which Score-P calls before MPI_Init. CVars that can not be set are reported,
+ * the remaining ones are still written.
  */
-int32_t init()
+static void apply_profile()
 {
-    llog(LOG_DEBUG, "GIT revision: %s", GIT_REV);
-    llog(LOG_VERBOSE, "MPIT tuning plugin: initializing\n");
+    const char *file_name = getenv("SCOREP_TUNING_MPIT_PLUGIN_PROFILE");
+    if (file_name == NULL || file_name[0] == '\0')
+    {
+        return;
+    }
+    FILE *file = fopen(file_name, "r");
+    if (file == NULL)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: can not read profile %s: %s\n", file_name,
+            strerror(errno));
+        return;
+    }
+    int initialized = 0;
+    MPI_Initialized(&initialized);
+    if (initialized)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: applying profile %s after MPI_Init, CVars read by "
+                       "MPI_Init keep their value\n",
+            file_name);
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    int applied = 0;
+    int failed = 0;
+    int line_number = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        char name[1024];
+        char value_text[1024];
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0')
+        {
+            continue;
+        }
+        for (char *c = start; *c != '\0'; c++)
+        {
+            if (*c == '=')
+            {
+                *c = ' ';
+            }
+        }
+        if (sscanf(start, "%1023s %1023s", name, value_text) != 2)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: %s:%d: expected \"name value\"\n", file_name,
+                line_number);
+            failed++;
+            continue;
+        }
+        try
+        {
+            int cvar = mpi_value_->get_cvar_by_name(name);
+            long long value = 0;
+            if (!parse_profile_value(cvar, value_text, &value))
+            {
+                llog(LOG_WARN, "MPIT tuning plugin: %s:%d: invalid value \"%s\" for \"%s\"\n",
+                    file_name, line_number, value_text, name);
+                failed++;
+                continue;
+            }
+            mpi_value_->write_value(cvar, value);
+            llog(LOG_DEBUG, "MPIT tuning plugin: profile: set \"%s\" to %lld\n", name, value);
+            applied++;
+        }
+        catch (std::runtime_error &e)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: %s:%d: setting \"%s\": %s\n", file_name,
+                line_number, name, e.what());
+            failed++;
+        }
+    }
+    fclose(file);
+    double elapsed =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin)
+            .count();
+    llog(LOG_INFO, "MPIT tuning plugin: profile %s: set %d CVars, %d failed, in %.3f ms\n",
+        file_name, applied, failed, elapsed);
+}
+
+/**
+ * Adds a tuning action slot for a CVar.
+ *
+ * @param cvar CVar to set
+ * @param name name of the tuning action
+ * @return the slot, -1 if all slots are used
+ */
+static int add_slot(int cvar, const std::string &name)
+{
+    if (num_slots == MAX_TUNING_ACTIONS)
+    {
+        return -1;
+    }
+    int slot = num_slots++;
+    slot_cvars[slot] = cvar;
+    slot_names[slot] = name;
+    const mpit_interface::cvar_info &info = mpi_value_->get_cvar_info(cvar);
+    llog(LOG_DEBUG, "MPIT tuning plugin: tuning action %d: \"%s\" (%s)\n", slot, name.c_str(),
+        info.name.c_str());
+    if (info.enumtype != MPI_T_ENUM_NULL)
+    {
+        log_enum_items(slot);
+    }
+    if (info.scope == MPI_T_SCOPE_ALL_EQ || info.scope == MPI_T_SCOPE_GROUP_EQ)
+    {
+        llog(LOG_DEBUG, "MPIT tuning plugin: \"%s\" has scope %s, checking new values\n",
+            name.c_str(), mpit_interface::get_mpit_scope(info.scope).c_str());
+        slot_eq[slot] = new eq_slot();
+        /* GROUP_EQ refers to the processes of the object the CVar is bound to */
+        if (info.scope == MPI_T_SCOPE_GROUP_EQ && info.bind == MPI_T_BIND_MPI_COMM)
+        {
+            slot_eq[slot]->scope_comm = mpi_value_->get_bind_comm();
+        }
+        /* the value set by the MPI library is the same everywhere */
+        try
+        {
+            int initial = 0;
+            mpi_value_->get_int_value(cvar, &initial);
+            slot_eq[slot]->verified.insert(initial);
+        }
+        catch (std::runtime_error &e)
+        {
+        }
+    }
+    return slot;
+}
 
-    mpi_value_ = new mpit_interface::mpit_values();
+/** MPI libraries with a known collective algorithm CVar naming */
+typedef enum { MPI_IMPL_UNKNOWN, MPI_IMPL_MPICH, MPI_IMPL_OPEN_MPI } mpi_implementation;
 
-    llog(LOG_DEBUG, "MPIT tuning plugin: initialised\n");
-    return 0;
+static mpi_implementation mpi_impl = MPI_IMPL_UNKNOWN;
+
+#define MAX_ALGORITHMS 8
+
+/**
+ * Portable algorithm selection of one collective. The tuning value is the position in
+ * algorithms, each given by its portable name and the enumeration item names used by MPICH and
+ * Open MPI. NULL marks an algorithm the library does not have.
+ */
+struct collective_entry
+{
+    const char *action;
+    const char *mpich_cvar;
+    const char *open_mpi_cvar;
+    const char *algorithms[MAX_ALGORITHMS][3];
+};
+
+static const collective_entry collective_catalog[] = {
+    { "ALLREDUCE_ALGORITHM",
+        "MPIR_CVAR_ALLREDUCE_INTRA_ALGORITHM",
+        "coll_tuned_allreduce_algorithm",
+        { { "default", "auto", "ignore" },
+            { "linear", NULL, "basic_linear" },
+            { "recursive_doubling", "recursive_doubling", "recursive_doubling" },
+            { "ring", "ring", "ring" },
+            { "reduce_scatter_allgather", "reduce_scatter_allgather", "rabenseifner" },
+            { "tree", "tree", NULL } } },
+    { "BCAST_ALGORITHM",
+        "MPIR_CVAR_BCAST_INTRA_ALGORITHM",
+        "coll_tuned_bcast_algorithm",
+        { { "default", "auto", "ignore" },
+            { "linear", NULL, "basic_linear" },
+            { "binomial", "binomial", "binomial" },
+            { "pipeline", "pipelined_tree", "pipeline" },
+            { "scatter_recursive_doubling_allgather", "scatter_recursive_doubling_allgather",
+                "scatter_allgather" },
+            { "scatter_ring_allgather", "scatter_ring_allgather", "scatter_allgather_ring" } } },
+    { "ALLTOALL_ALGORITHM",
+        "MPIR_CVAR_ALLTOALL_INTRA_ALGORITHM",
+        "coll_tuned_alltoall_algorithm",
+        { { "default", "auto", "ignore" },
+            { "linear", "scattered", "linear" },
+            { "pairwise", "pairwise", "pairwise" },
+            { "bruck", "brucks", "modified_bruck" } } },
+    { "ALLGATHER_ALGORITHM",
+        "MPIR_CVAR_ALLGATHER_INTRA_ALGORITHM",
+        "coll_tuned_allgather_algorithm",
+        { { "default", "auto", "ignore" },
+            { "bruck", "brucks", "bruck" },
+            { "recursive_doubling", "recursive_doubling", "recursive_doubling" },
+            { "ring", "ring", "ring" } } },
+    { "REDUCE_ALGORITHM",
+        "MPIR_CVAR_REDUCE_INTRA_ALGORITHM",
+        "coll_tuned_reduce_algorithm",
+        { { "default", "auto", "ignore" },
+            { "linear", NULL, "linear" },
+            { "binomial", "binomial", "binomial" },
+            { "reduce_scatter_gather", "reduce_scatter_gather", "rabenseifner" } } },
+};
+
+/**
+ * Detects the MPI library with MPI_Get_library_version, which may be called before MPI_Init.
+ */
+static mpi_implementation detect_mpi_implementation()
+{
+    char version[MPI_MAX_LIBRARY_VERSION_STRING];
+    int length = 0;
+    if (MPI_Get_library_version(version, &length) != MPI_SUCCESS)
+    {
+        return MPI_IMPL_UNKNOWN;
+    }
+    llog(LOG_DEBUG, "MPIT tuning plugin: MPI library: %.*s\n", (int) strcspn(version, "\n"),
+        version);
+    if (strstr(version, "Open MPI") != NULL)
+    {
+        return MPI_IMPL_OPEN_MPI;
+    }
+    if (strstr(version, "MPICH") != NULL || strstr(version, "MVAPICH") != NULL)
+    {
+        return MPI_IMPL_MPICH;
+    }
+    return MPI_IMPL_UNKNOWN;
 }
 
-void create_location(RRL_LocationType location_type, uint32_t location_id)
+/**
+ * Returns the names of the values of a CVar. For CVars with an enumeration these are the item
+ * names, indexed like the tuning values. MPICH exposes its algorithm CVars as plain int and lists
+ * the values as "name - text" lines in the description, in the order of their numbers, with the
+ * names padded to the same width. The heading before the first value line is skipped. Any other
+ * line that does not parse makes the numbering unreliable.
+ *
+ * @throws std::runtime_error if a line after the first value line can not be parsed
+ */
+static std::vector<std::string> get_value_names(int cvar)
 {
+    std::vector<std::string> names;
+    if (mpi_value_->get_cvar_info(cvar).enumtype != MPI_T_ENUM_NULL)
+    {
+        for (const mpit_interface::enum_item &item : mpi_value_->get_enum_items(cvar))
+        {
+            names.push_back(item.name);
+        }
+        return names;
+    }
+    std::string description = mpi_value_->get_cvar_description(cvar);
+    size_t begin = 0;
+    while (begin < description.size())
+    {
+        size_t end = description.find('\n', begin);
+        if (end == std::string::npos)
+        {
+            end = description.size();
+        }
+        std::string line = description.substr(begin, end - begin);
+        begin = end + 1;
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string::npos)
+        {
+            continue;
+        }
+        size_t name_end = line.find_first_of(" \t", start);
+        size_t dash = (name_end != std::string::npos) ? line.find_first_not_of(" \t", name_end) :
+                                                        std::string::npos;
+        if (dash == std::string::npos || line[dash] != '-' ||
+            (dash + 1 < line.size() && line[dash + 1] != ' ' && line[dash + 1] != '\t'))
+        {
+            if (!names.empty())
+            {
+                throw std::runtime_error("can not parse \"" + line + "\" in the description");
+            }
+            continue;
+        }
+        names.push_back(line.substr(start, name_end - start));
+    }
+    return names;
 }
 
-void delete_location(RRL_LocationType location_type, uint32_t location_id)
+/**
+ * Creates the portable collective actions matching SCOREP_TUNING_MPIT_PLUGIN_COLLECTIVES, like
+ * ALLREDUCE_ALGORITHM. Each maps to the algorithm CVar of the detected MPI library, with the
+ * portable algorithm numbers translated to the values of the library.
+ *
+ * Open MPI copies the coll_tuned_*_algorithm values into a communicator when it is created, so
+ * setting them only affects communicators created afterwards, not MPI_COMM_WORLD.
+ */
+static void create_collective_actions()
 {
+    const char *env = getenv("SCOREP_TUNING_MPIT_PLUGIN_COLLECTIVES");
+    if (env == NULL || env[0] == '\0')
+    {
+        return;
+    }
+    if (mpi_impl == MPI_IMPL_UNKNOWN)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: unknown MPI library, no collective actions\n");
+        return;
+    }
+    std::vector<std::string> patterns = split_patterns(env);
+    for (const collective_entry &entry : collective_catalog)
+    {
+        bool selected = false;
+        for (const std::string &pattern : patterns)
+        {
+            selected = selected || fnmatch(pattern.c_str(), entry.action, 0) == 0;
+        }
+        if (!selected)
+        {
+            continue;
+        }
+
+        int library = (mpi_impl == MPI_IMPL_MPICH) ? 1 : 2;
+        const char *cvar_name = (mpi_impl == MPI_IMPL_MPICH) ? entry.mpich_cvar :
+                                                                 entry.open_mpi_cvar;
+        int cvar;
+        std::vector<std::string> names;
+        try
+        {
+            cvar = mpi_value_->get_cvar_by_name(cvar_name);
+            if (!mpi_value_->is_supported(cvar))
+            {
+                throw std::runtime_error("not supported");
+            }
+            names = get_value_names(cvar);
+        }
+        catch (std::runtime_error &e)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: %s: \"%s\": %s\n", entry.action, cvar_name,
+                e.what());
+            continue;
+        }
+
+        std::vector<int> values;
+        for (int i = 0; i < MAX_ALGORITHMS && entry.algorithms[i][0] != NULL; i++)
+        {
+            const char *name = entry.algorithms[i][library];
+            auto it = (name != NULL) ? std::find(names.begin(), names.end(), name) : names.end();
+            values.push_back(it != names.end() ? (int) (it - names.begin()) : -1);
+            llog(LOG_DEBUG, "MPIT tuning plugin: %s: %d = %s (%s)\n", entry.action, i,
+                entry.algorithms[i][0], it != names.end() ? name : "not available");
+        }
+        if (std::count(values.begin(), values.end(), -1) == (long) values.size())
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: %s: no known values in \"%s\"\n", entry.action,
+                cvar_name);
+            continue;
+        }
+        int slot = add_slot(cvar, entry.action);
+        if (slot < 0)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: no slot left for %s\n", entry.action);
+            return;
+        }
+        slot_values[slot] = values;
+        if (mpi_impl == MPI_IMPL_OPEN_MPI)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: %s only affects communicators created after it is "
+                           "set, use SCOREP_TUNING_MPIT_PLUGIN_PROFILE for MPI_COMM_WORLD\n",
+                entry.action);
+        }
+    }
 }
 
 /**
- * finalising the plugin
+ * Creates a tuning action for every supported CVar matching one of the comma separated names or
+ * shell patterns in SCOREP_TUNING_MPIT_PLUGIN_CVARS.
  */
-void fini()
+static void create_tuning_actions()
 {
-    llog(LOG_DEBUG, "MPIT tuning plugin: finalizing\n");
-    delete mpi_value_;
-    llog(LOG_DEBUG, "MPIT tuning plugin: finalised\n");
+    const char *env = getenv("SCOREP_TUNING_MPIT_PLUGIN_CVARS");
+    std::set<int> selected;
+
+    for (const std::string &pattern :
+        split_patterns((env != NULL && env[0] != '\0') ? env : DEFAULT_CVARS))
+    {
+        bool found = false;
+        for (const mpit_interface::cvar_info &info : mpi_value_->get_cvars())
+        {
+            if (info.name.empty() || fnmatch(pattern.c_str(), info.name.c_str(), 0) != 0)
+            {
+                continue;
+            }
+            found = true;
+            if (!supported_cvar(info))
+            {
+                llog(LOG_INFO, "MPIT tuning plugin: \"%s\" is not supported (%s, %s, %s)\n",
+                    info.name.c_str(), mpit_interface::get_mpit_datatype(info.datatype).c_str(),
+                    mpit_interface::get_mpit_bind(info.bind).c_str(),
+                    mpit_interface::get_mpit_scope(info.scope).c_str());
+                continue;
+            }
+            selected.insert(info.index);
+        }
+        if (!found)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: no CVar matches \"%s\"\n", pattern.c_str());
+        }
+    }
+
+    for (int cvar : selected)
+    {
+        if (add_slot(cvar, mpi_value_->get_cvar_info(cvar).name) < 0)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: more than %d CVars selected, ignoring the rest\n",
+                MAX_TUNING_ACTIONS);
+            break;
+        }
+    }
+    create_collective_actions();
+
+    slot_table<MAX_TUNING_ACTIONS>::fill(return_values);
+    for (int slot = 0; slot < num_slots; slot++)
+    {
+        return_values[slot].name = (char *) slot_names[slot].c_str();
+    }
+
+    int num_actions = num_slots;
+    bool histogram = mpi_histogram::init(pvar_region_current);
+    select_histogram_online();
+    if (select_pvars() || histogram)
+    {
+        return_values[num_actions].name = (char *) PVAR_REGION_ACTION;
+        return_values[num_actions].current_config = pvar_region_current;
+        return_values[num_actions].enter_region_set_config = pvar_region_enter;
+        return_values[num_actions].exit_region_set_config = pvar_region_exit;
+        num_actions++;
+    }
+    return_values[num_actions].name = NULL;
+    return_values[num_actions].current_config = NULL;
+    return_values[num_actions].enter_region_set_config = NULL;
+    return_values[num_actions].exit_region_set_config = NULL;
 }
 
 /**
- * Set the MPIT_value change_MPIR_CVAR_REDUCE_SHORT_MSG_SIZE
+ * Initialize the plugin
  *
- * Implemented for MPICH 3.2. Please see the MPI implementation.
+ * loads mpi_value
  *
- * @param[in]   new_settings new CVar setting
- * @param[out]  old_setting old CVar setting
- * @return return 0 on success, -1 on failure
+ * @return 0 at sucess
  */
-static int change_MPIR_CVAR_REDUCE_SHORT_MSG_SIZE(int new_settings)
+int32_t init()
 {
+    llog(LOG_DEBUG, "GIT revision: %s", GIT_REV);
+    llog(LOG_VERBOSE, "MPIT tuning plugin: initializing\n");
 
-    int new_settings_ = new_settings;
+    mpi_impl = detect_mpi_implementation();
+    const char *collectives = getenv("SCOREP_TUNING_MPIT_PLUGIN_COLLECTIVES");
+    if (mpi_impl == MPI_IMPL_OPEN_MPI && collectives != NULL && collectives[0] != '\0' &&
+        getenv("OMPI_MCA_coll_tuned_use_dynamic_rules") == NULL)
+    {
+        /* Open MPI only honours coll_tuned_*_algorithm with dynamic rules, which can not be set
+         * through MPI_T and are read when MPI_T is initialised */
+        int initialized = 0;
+        MPI_Initialized(&initialized);
+        if (initialized)
+        {
+            llog(LOG_WARN, "MPIT tuning plugin: MPI is initialised, collective actions need "
+                           "OMPI_MCA_coll_tuned_use_dynamic_rules=1\n");
+        }
+        else
+        {
+            setenv("OMPI_MCA_coll_tuned_use_dynamic_rules", "1", 0);
+            llog(LOG_INFO, "MPIT tuning plugin: enabled coll_tuned_use_dynamic_rules\n");
+        }
+    }
 
-    try
+    /* Before MPI_Init the thread level of the application is unknown, so ask for the highest */
+    int thread_level = MPI_THREAD_MULTIPLE;
+    int initialized = 0;
+    MPI_Initialized(&initialized);
+    if (initialized)
     {
-        int cvar_id = mpi_value_->change_mpi_variable_by_name(
-            std::string("MPIR_CVAR_REDUCE_SHORT_MSG_SIZE"), &new_settings);
-        llog(LOG_DEBUG, "MPIT tuning plugin: CVar ID: %d \n", cvar_id);
+        MPI_Query_thread(&thread_level);
     }
-    catch (mpit_interface::cvar_not_found &e)
+    mpi_value_ = new mpit_interface::mpit_values(thread_level);
+    if (mpi_value_->get_thread_level() < thread_level)
     {
-        llog(LOG_WARN, "MPIT tuning plugin: %s", e.what());
-        return -1;
+        llog(LOG_WARN, "MPIT tuning plugin: MPI_T provides thread level %d, requested %d\n",
+            mpi_value_->get_thread_level(), thread_level);
     }
 
-    llog(LOG_DEBUG,
-        "MPIT tuning plugin: setting \"MPIR_CVAR_REDUCE_SHORT_MSG_SIZE\" from %d to %d \n",
-        new_settings,
-        new_settings_);
+    const char *verify = getenv("SCOREP_TUNING_MPIT_PLUGIN_VERIFY");
+    if (verify != NULL && strcmp(verify, "1") == 0)
+    {
+        llog(LOG_INFO, "MPIT tuning plugin: verifying CVar writes\n");
+        mpi_value_->set_verify_writes(true);
+    }
+
+    const char *comm = getenv("SCOREP_TUNING_MPIT_PLUGIN_COMM");
+    if (comm != NULL && strcasecmp(comm, "SELF") == 0)
+    {
+        mpi_value_->set_bind_comm(MPI_COMM_SELF);
+    }
+    else if (comm != NULL && strcasecmp(comm, "WORLD") != 0)
+    {
+        llog(LOG_WARN, "MPIT tuning plugin: unknown communicator \"%s\", using WORLD\n", comm);
+    }
+
+    apply_profile();
+    create_tuning_actions();
+    select_events();
 
+    llog(LOG_DEBUG, "MPIT tuning plugin: initialised\n");
     return 0;
 }
 
-static int get_MPIR_CVAR_REDUCE_SHORT_MSG_SIZE()
+/**
+ * Allocates the event buffer of a new thread, so the event callbacks never allocate.
+ */
+void create_location(RRL_LocationType location_type, uint32_t)
 {
-    // int value = 0;
-    // int cvar_id = mpi_value_->get_cvar_by_name("MPIR_CVAR_REDUCE_SHORT_MSG_SIZE");
-    // mpi_value_->get_mpit_bind_no_object_int_values(cvar_id, &value);
-    int value = mpi_value_->change_mpi_variable_by_name(
-        std::string("MPIR_CVAR_REDUCE_SHORT_MSG_SIZE"), &value);
+    if (event_recorder_ != nullptr && location_type == RRL_LOCATION_TYPE_CPU_THREAD)
+    {
+        event_recorder_->add_thread();
+        register_pending_events();
+    }
+}
 
-    return value;
+void delete_location(RRL_LocationType, uint32_t)
+{
+}
+
+/**
+ * finalising the plugin
+ */
+void fini()
+{
+    llog(LOG_DEBUG, "MPIT tuning plugin: finalizing\n");
+    write_pvar_summary();
+    write_events();
+    if (mpi_histogram::is_enabled())
+    {
+        std::string file_name =
+            get_output_name("SCOREP_TUNING_MPIT_PLUGIN_HISTOGRAM_OUTPUT", "mpit_histogram");
+        mpi_histogram::fini(file_name);
+        llog(LOG_INFO, "MPIT tuning plugin: histograms written to %s\n", file_name.c_str());
+    }
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if (!finalized && online_comm != MPI_COMM_NULL)
+    {
+        MPI_Comm_free(&online_comm);
+    }
+    eq_fini();
+    delete mpi_value_;
+    llog(LOG_DEBUG, "MPIT tuning plugin: finalised\n");
 }
 
 /**
@@ -165,18 +1757,7 @@ static int get_MPIR_CVAR_REDUCE_SHORT_MSG_SIZE()
  *
  * @param return return_values.
  */
-#define MPIT_TUNING_FUNCTIONS 1
-rrl_tuning_action_info return_values[MPIT_TUNING_FUNCTIONS + 1];
 rrl_tuning_action_info *get_tuning_info()
 {
-    return_values[0].name = (char *) "MPIR_CVAR_REDUCE_SHORT_MSG_SIZE";
-    return_values[0].current_config = &get_MPIR_CVAR_REDUCE_SHORT_MSG_SIZE;
-    return_values[0].enter_region_set_config = &change_MPIR_CVAR_REDUCE_SHORT_MSG_SIZE;
-    return_values[0].exit_region_set_config = &change_MPIR_CVAR_REDUCE_SHORT_MSG_SIZE;
-
-    return_values[MPIT_TUNING_FUNCTIONS].name = NULL;
-    return_values[MPIT_TUNING_FUNCTIONS].enter_region_set_config = NULL;
-    return_values[MPIT_TUNING_FUNCTIONS].exit_region_set_config = NULL;
-
     return return_values;
 }
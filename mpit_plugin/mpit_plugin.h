@@ -24,8 +24,6 @@ void fini();
 
 static mpit_interface::mpit_values *mpi_value_;
 
-static int change_MPIR_CVAR_REDUCE_SHORT_MSG_SIZE(int new_settings);
-
 extern "C" {
 
 /**
@@ -41,6 +39,8 @@ RRL_TUNING_PLUGIN_ENTRY(mpit_plugin)
     info.plugin_version = RRL_TUNING_PLUGIN_VERSION;
     info.initialize = init;
     info.get_tuning_info = get_tuning_info;
+    info.create_location = create_location;
+    info.delete_location = delete_location;
     info.finalize = fini;
     return info;
 }
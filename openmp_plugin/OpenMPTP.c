@@ -15,12 +15,19 @@
  *
  */
 
+#define _GNU_SOURCE
+#include <dlfcn.h>
 #include <errno.h>
 #include <omp.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 #ifdef __cplusplus
@@ -29,9 +36,132 @@ extern "C" {
 
 #include "scorep/rrl_tuning_plugins.h"
 
-#define PLUGIN_NAME "OpenMPTP"
+#include "OpenMPTP.h"
 
-typedef enum { LOG_VERBOSE, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_INVALID } log_level;
+/**
+ * Encoding of the SCHEDULE tuning action:
+ *
+ *  * bits 0 - 2: kind, see omp_sched_t (1 static, 2 dynamic, 3 guided, 4 auto)
+ *  * bit 3: monotonic modifier. If not set, the runtime may schedule nonmonotonic.
+ *  * bits 4 - 30: chunk size, 0 for the default chunk size
+ *
+ * e.g. (16 << 4) | 2 = 258 is dynamic, 16 or nonmonotonic:dynamic, 16.
+ */
+#define SCHEDULE_KIND_MASK 0x7
+#define SCHEDULE_MONOTONIC_FLAG 0x8
+#define SCHEDULE_CHUNK_SHIFT 4
+/* largest chunk size that fits into the encoding, 2^27 - 1 */
+#define SCHEDULE_MAX_CHUNK_SIZE (0x7fffffff >> SCHEDULE_CHUNK_SHIFT)
+
+/* omp_sched_monotonic of OpenMP 4.5, not known to older omp.h */
+#define OMP_SCHED_MONOTONIC 0x80000000u
+
+/**
+ * ICVs like nthreads-var and run-sched-var only change for the calling thread. To reach other
+ * threads that open parallel regions, each thread seen by create_location gets a slot. Setting
+ * a value stores it into the slots of all other threads and marks it pending. Each thread applies
+ * its pending values the next time it calls into the plugin, e.g. when entering a tuned region.
+ * Neither side takes a lock.
+ */
+#define MAX_ICV_SLOTS 1024
+
+typedef enum {
+    ICV_NUM_THREADS = 0,
+    ICV_SCHEDULE,
+    ICV_BLOCKTIME,
+    ICV_MAX_ACTIVE_LEVELS,
+    ICV_DYNAMIC,
+    ICV_TEAMS_THREAD_LIMIT,
+    NUM_ICVS
+} icv_id;
+
+struct icv_slot
+{
+    _Alignas(64) atomic_uint pending; /**< bit mask of pending icv_ids */
+    atomic_int values[NUM_ICVS];
+};
+
+static struct icv_slot icv_slots[MAX_ICV_SLOTS];
+static atomic_int num_icv_slots;
+static __thread struct icv_slot *own_icv_slot;
+
+/**
+ * OpenMP runtime the plugin runs on, detected at init with dlsym. The KMP extensions of the
+ * LLVM and Intel runtimes are looked up, so one plugin binary works on all runtimes.
+ */
+typedef enum {
+    OMP_RUNTIME_UNKNOWN = 0,
+    OMP_RUNTIME_LLVM,
+    OMP_RUNTIME_INTEL,
+    OMP_RUNTIME_GNU
+} omp_runtime;
+
+static const char *omp_runtime_names[] = {"unknown", "LLVM libomp", "Intel libiomp", "GNU libgomp"};
+static omp_runtime runtime = OMP_RUNTIME_UNKNOWN;
+
+static void (*kmp_set_blocktime_fn)(int);
+static int (*kmp_get_blocktime_fn)(void);
+/* OpenMP 5.1, looked up as older runtimes do not provide them */
+static void (*omp_set_teams_thread_limit_fn)(int);
+static int (*omp_get_teams_thread_limit_fn)(void);
+
+/**
+ * Shadow copies of the ICVs of the calling thread, so setting an unchanged value costs no
+ * runtime call. -1 means unknown, the shadow is then read from the runtime first. Calls to
+ * current_config refresh the shadows, in case the application changed an ICV itself.
+ */
+static __thread int shadow_num_threads = -1;
+/* kind including the monotonic modifier, and chunk size as passed to omp_set_schedule */
+static __thread int shadow_schedule_kind = -1;
+static __thread int shadow_chunk_size;
+static __thread int shadow_max_active_levels = -1;
+static __thread int shadow_dynamic = -1;
+static __thread int shadow_teams_thread_limit = -1;
+
+/**
+ * Thread placements of the AFFINITY tuning action. Except for AFFINITY_INITIAL and
+ * AFFINITY_NONE, every registered thread is pinned to one CPU: the n-th registered thread to the
+ * n-th CPU in the order of the strategy. The orders are computed from the sysfs topology of the
+ * CPUs the process may use, the union of the initial masks of the registered threads. The
+ * runtime may have pinned the thread that initializes the plugin already, so its mask alone is
+ * not enough. The orders are computed again whenever a registered thread adds CPUs.
+ */
+typedef enum {
+    AFFINITY_INITIAL = -1, /**< the mask each thread had when it was registered */
+    AFFINITY_NONE = 0,     /**< all CPUs the process may use */
+    AFFINITY_COMPACT,      /**< hardware threads of a core first, then cores, then packages */
+    AFFINITY_CORES,        /**< one thread per core, package by package, then the SMT siblings */
+    AFFINITY_SCATTER,      /**< round robin over the packages, one thread per core first */
+    NUM_AFFINITIES
+} affinity_strategy;
+
+struct cpu_topology
+{
+    int cpu;
+    int package;
+    int core;
+    int smt;       /**< rank of the hardware thread within its core */
+    int core_rank; /**< rank of the core within its package */
+};
+
+struct worker
+{
+    pid_t tid;
+    cpu_set_t *initial_mask; /**< NULL if it could not be read */
+};
+
+static int *affinity_orders[NUM_AFFINITIES];
+static int num_affinity_cpus;
+/* CPU sets are allocated with CPU_ALLOC for max_cpus CPUs, cpu_set_size bytes */
+static int max_cpus;
+static size_t cpu_set_size;
+static cpu_set_t *process_cpus;
+static cpu_set_t *pin_mask;
+static int current_affinity = AFFINITY_INITIAL;
+static struct worker workers[MAX_ICV_SLOTS];
+static int num_workers;
+static __thread int own_worker = -1;
+static pthread_mutex_t affinity_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * log function.
@@ -97,25 +227,397 @@ void llog(log_level msg_level, const char *message_fmt, ...)
     }
 }
 
+/**
+ * Gives the calling thread a slot for pending ICVs, if it does not have one yet.
+ */
+static void register_icv_slot()
+{
+    if (own_icv_slot != NULL)
+    {
+        return;
+    }
+    int index = atomic_fetch_add(&num_icv_slots, 1);
+    if (index >= MAX_ICV_SLOTS)
+    {
+        llog(LOG_WARN, "More than %d threads, ICVs are not propagated to this thread",
+            MAX_ICV_SLOTS);
+        return;
+    }
+    own_icv_slot = &icv_slots[index];
+    llog(LOG_DEBUG, "registered ICV slot %d", index);
+}
+
+/**
+ * Stores an ICV value into the slots of all other threads and marks it as pending.
+ */
+static void publish_icv(icv_id icv, int value)
+{
+    int slots = atomic_load(&num_icv_slots);
+    if (slots > MAX_ICV_SLOTS)
+    {
+        slots = MAX_ICV_SLOTS;
+    }
+    for (int i = 0; i < slots; i++)
+    {
+        struct icv_slot *slot = &icv_slots[i];
+        if (slot == own_icv_slot)
+        {
+            continue;
+        }
+        atomic_store_explicit(&slot->values[icv], value, memory_order_relaxed);
+        atomic_fetch_or_explicit(&slot->pending, 1u << icv, memory_order_release);
+    }
+}
+
+static int apply_schedule(int new_setting);
+
+/**
+ * Sets nthreads-var of the calling thread, unless the shadow shows it is set already.
+ *
+ * @return 1 if the ICV changed, 0 otherwise
+ */
+static int set_num_threads(int value)
+{
+    if (shadow_num_threads == -1)
+    {
+        shadow_num_threads = omp_get_max_threads();
+    }
+    if (shadow_num_threads == value)
+    {
+        return 0;
+    }
+    omp_set_num_threads(value);
+    shadow_num_threads = value;
+    return 1;
+}
+
+/**
+ * Reads run-sched-var of the calling thread from the runtime and refreshes the shadow.
+ */
+static void read_schedule(omp_sched_t *kind, int *chunk_size)
+{
+    omp_get_schedule(kind, chunk_size);
+    shadow_schedule_kind = (int) *kind;
+    shadow_chunk_size = *chunk_size;
+}
+
+/**
+ * Returns run-sched-var of the calling thread from the shadow, read from the runtime if unknown.
+ */
+static void get_schedule(omp_sched_t *kind, int *chunk_size)
+{
+    if (shadow_schedule_kind == -1)
+    {
+        read_schedule(kind, chunk_size);
+        return;
+    }
+    *kind = (omp_sched_t) shadow_schedule_kind;
+    *chunk_size = shadow_chunk_size;
+}
+
+/**
+ * Sets run-sched-var of the calling thread, unless the shadow shows it is set already.
+ *
+ * @return 1 if the ICV changed, 0 otherwise
+ */
+static int set_schedule(omp_sched_t kind, int chunk_size)
+{
+    if (shadow_schedule_kind == (int) kind && shadow_chunk_size == chunk_size)
+    {
+        return 0;
+    }
+    omp_set_schedule(kind, chunk_size);
+    shadow_schedule_kind = (int) kind;
+    shadow_chunk_size = chunk_size;
+    return 1;
+}
+
+/**
+ * Sets max-active-levels-var of the calling thread, unless the shadow shows it is set already.
+ *
+ * @return 1 if the ICV changed, 0 otherwise
+ */
+static int set_max_active_levels(int value)
+{
+    if (shadow_max_active_levels == -1)
+    {
+        shadow_max_active_levels = omp_get_max_active_levels();
+    }
+    if (shadow_max_active_levels == value)
+    {
+        return 0;
+    }
+    omp_set_max_active_levels(value);
+    shadow_max_active_levels = value;
+    return 1;
+}
+
+/**
+ * Sets dyn-var of the calling thread, unless the shadow shows it is set already.
+ *
+ * @return 1 if the ICV changed, 0 otherwise
+ */
+static int set_dynamic(int value)
+{
+    if (shadow_dynamic == -1)
+    {
+        shadow_dynamic = omp_get_dynamic();
+    }
+    if (shadow_dynamic == value)
+    {
+        return 0;
+    }
+    omp_set_dynamic(value);
+    shadow_dynamic = value;
+    return 1;
+}
+
+/**
+ * Sets teams-thread-limit-var, unless the shadow shows it is set already.
+ *
+ * @return 1 if the ICV changed, 0 otherwise
+ */
+static int set_teams_thread_limit(int value)
+{
+    if (shadow_teams_thread_limit == -1)
+    {
+        shadow_teams_thread_limit = omp_get_teams_thread_limit_fn();
+    }
+    if (shadow_teams_thread_limit == value)
+    {
+        return 0;
+    }
+    omp_set_teams_thread_limit_fn(value);
+    shadow_teams_thread_limit = value;
+    return 1;
+}
+
+/**
+ * Applies a single ICV to the calling thread.
+ */
+static void apply_icv(icv_id icv, int value)
+{
+    switch (icv)
+    {
+        case ICV_NUM_THREADS:
+            set_num_threads(value);
+            break;
+        case ICV_SCHEDULE:
+            apply_schedule(value);
+            break;
+        case ICV_BLOCKTIME:
+            kmp_set_blocktime_fn(value);
+            break;
+        case ICV_MAX_ACTIVE_LEVELS:
+            set_max_active_levels(value);
+            break;
+        case ICV_DYNAMIC:
+            set_dynamic(value);
+            break;
+        case ICV_TEAMS_THREAD_LIMIT:
+            set_teams_thread_limit(value);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Applies the ICVs other threads have set since the calling thread last called into the
+ * plugin. Only costs an atomic load if nothing is pending.
+ */
+static void apply_pending_icvs()
+{
+    if (own_icv_slot == NULL ||
+        atomic_load_explicit(&own_icv_slot->pending, memory_order_relaxed) == 0)
+    {
+        return;
+    }
+    unsigned int pending =
+        atomic_exchange_explicit(&own_icv_slot->pending, 0, memory_order_acquire);
+    for (int icv = 0; icv < NUM_ICVS; icv++)
+    {
+        if (pending & (1u << icv))
+        {
+            int value = atomic_load_explicit(&own_icv_slot->values[icv], memory_order_relaxed);
+            apply_icv((icv_id) icv, value);
+            llog(LOG_DEBUG, "applied pending ICV %d = %d", icv, value);
+        }
+    }
+}
+
 static int scorep_omp_set_num_threads(int new_setting)
 {
     llog(LOG_DEBUG, "[NUMTHREADS]: Set new setting");
-    omp_set_num_threads(new_setting);
-    llog(LOG_DEBUG, "[NUMTHREADS]: New Setting = %d", new_setting);
+    apply_pending_icvs();
+    if (set_num_threads(new_setting))
+    {
+        publish_icv(ICV_NUM_THREADS, new_setting);
+        llog(LOG_DEBUG, "[NUMTHREADS]: New Setting = %d", new_setting);
+    }
     return 0;
 }
 
 static int scorep_omp_get_num_threads()
 {
-    int max_threads = omp_get_max_threads();
+    apply_pending_icvs();
+    shadow_num_threads = omp_get_max_threads();
+    return shadow_num_threads;
+}
 
-    return max_threads;
+static int scorep_omp_set_max_active_levels(int new_setting)
+{
+    if (new_setting < 0)
+    {
+        llog(LOG_WARN, "[MAX_ACTIVE_LEVELS]: Invalid value %d", new_setting);
+        return -1;
+    }
+    apply_pending_icvs();
+    if (set_max_active_levels(new_setting))
+    {
+        publish_icv(ICV_MAX_ACTIVE_LEVELS, new_setting);
+        llog(LOG_DEBUG, "[MAX_ACTIVE_LEVELS]: New Setting = %d", new_setting);
+    }
+    return 0;
 }
 
-// static void scorep_kmp_set_blocktime(int new_setting, int* old_setting) {
-//    (*old_setting) = kmp_get_blocktime();
-//    kmp_set_blocktime(new_setting);
-//}
+static int scorep_omp_get_max_active_levels()
+{
+    apply_pending_icvs();
+    shadow_max_active_levels = omp_get_max_active_levels();
+    return shadow_max_active_levels;
+}
+
+static int scorep_omp_set_dynamic(int new_setting)
+{
+    if (new_setting != 0 && new_setting != 1)
+    {
+        llog(LOG_WARN, "[DYNAMIC]: Invalid value %d, has to be 0 or 1", new_setting);
+        return -1;
+    }
+    apply_pending_icvs();
+    if (set_dynamic(new_setting))
+    {
+        publish_icv(ICV_DYNAMIC, new_setting);
+        llog(LOG_DEBUG, "[DYNAMIC]: New Setting = %d", new_setting);
+    }
+    return 0;
+}
+
+static int scorep_omp_get_dynamic()
+{
+    apply_pending_icvs();
+    shadow_dynamic = omp_get_dynamic() ? 1 : 0;
+    return shadow_dynamic;
+}
+
+/**
+ * Sets the maximum number of threads of each team created by a teams construct. Only available
+ * on OpenMP 5.1 runtimes.
+ */
+static int scorep_omp_set_teams_thread_limit(int new_setting)
+{
+    if (new_setting < 1)
+    {
+        llog(LOG_WARN, "[TEAMS_THREAD_LIMIT]: Invalid value %d", new_setting);
+        return -1;
+    }
+    apply_pending_icvs();
+    if (set_teams_thread_limit(new_setting))
+    {
+        publish_icv(ICV_TEAMS_THREAD_LIMIT, new_setting);
+        llog(LOG_DEBUG, "[TEAMS_THREAD_LIMIT]: New Setting = %d", new_setting);
+    }
+    return 0;
+}
+
+static int scorep_omp_get_teams_thread_limit()
+{
+    apply_pending_icvs();
+    shadow_teams_thread_limit = omp_get_teams_thread_limit_fn();
+    return shadow_teams_thread_limit;
+}
+
+/**
+ * Sets the time in ms a thread waits actively after finishing a parallel region, before it
+ * sleeps. Only available on runtimes with the KMP extensions.
+ */
+static int scorep_kmp_set_blocktime(int new_setting)
+{
+    if (kmp_set_blocktime_fn == NULL)
+    {
+        llog(LOG_WARN, "[BLOCKTIME]: not supported by %s", omp_runtime_names[runtime]);
+        return -1;
+    }
+    if (new_setting < 0)
+    {
+        llog(LOG_WARN, "[BLOCKTIME]: Invalid blocktime %d", new_setting);
+        return -1;
+    }
+    apply_pending_icvs();
+    kmp_set_blocktime_fn(new_setting);
+    publish_icv(ICV_BLOCKTIME, new_setting);
+    llog(LOG_DEBUG, "[BLOCKTIME]: New Setting = %d", new_setting);
+    return 0;
+}
+
+static int scorep_kmp_get_blocktime()
+{
+    if (kmp_get_blocktime_fn == NULL)
+    {
+        return -1;
+    }
+    apply_pending_icvs();
+    return kmp_get_blocktime_fn();
+}
+
+/**
+ * Encodes a schedule as for the SCHEDULE tuning action. Chunk sizes that do not fit into the
+ * encoding, e.g. from OMP_SCHEDULE, are clamped to SCHEDULE_MAX_CHUNK_SIZE.
+ */
+static int encode_schedule(omp_sched_t kind, int chunk_size)
+{
+    int setting = (int) ((unsigned int) kind & SCHEDULE_KIND_MASK);
+    if ((unsigned int) kind & OMP_SCHED_MONOTONIC)
+    {
+        setting |= SCHEDULE_MONOTONIC_FLAG;
+    }
+    if (chunk_size < 0)
+    {
+        chunk_size = 0;
+    }
+    else if (chunk_size > SCHEDULE_MAX_CHUNK_SIZE)
+    {
+        chunk_size = SCHEDULE_MAX_CHUNK_SIZE;
+    }
+    return setting | (chunk_size << SCHEDULE_CHUNK_SHIFT);
+}
+
+/**
+ * Returns the schedule of the calling thread, encoded as for the SCHEDULE tuning action.
+ */
+static int scorep_omp_get_schedule()
+{
+    omp_sched_t kind;
+    int chunk_size;
+
+    read_schedule(&kind, &chunk_size);
+    return encode_schedule(kind, chunk_size);
+}
+
+/**
+ * Sets an encoded schedule with at most one call to omp_set_schedule. The value has to be valid.
+ *
+ * @return 1 if the ICV changed, 0 otherwise
+ */
+static int apply_schedule(int new_setting)
+{
+    int kind = new_setting & SCHEDULE_KIND_MASK;
+    int chunk_size = new_setting >> SCHEDULE_CHUNK_SHIFT;
+    unsigned int modifier = (new_setting & SCHEDULE_MONOTONIC_FLAG) ? OMP_SCHED_MONOTONIC : 0;
+
+    return set_schedule((omp_sched_t) ((unsigned int) kind | modifier), chunk_size);
+}
 
 static int scorep_omp_set_schedule_type(int new_setting)
 {
@@ -141,10 +643,17 @@ static int scorep_omp_set_schedule_type(int new_setting)
     omp_sched_t kind = 4; // set to auto;
     int chunk_size;
 
-    omp_get_schedule(&kind, &chunk_size); // get existing chunk_size
+    apply_pending_icvs();
+    get_schedule(&kind, &chunk_size); // get existing chunk_size and modifier
 
-    omp_set_schedule((omp_sched_t) new_setting, chunk_size);
-    llog(LOG_INFO, "[SCHEDULE_TYPE]: New kind = %d New chunk size = %d", new_setting, chunk_size);
+    unsigned int modifier = (unsigned int) kind & OMP_SCHED_MONOTONIC;
+    kind = (omp_sched_t) ((unsigned int) new_setting | modifier);
+    if (set_schedule(kind, chunk_size))
+    {
+        publish_icv(ICV_SCHEDULE, encode_schedule(kind, chunk_size));
+        llog(LOG_INFO, "[SCHEDULE_TYPE]: New kind = %d New chunk size = %d", new_setting,
+            chunk_size);
+    }
     return 0;
 }
 
@@ -153,19 +662,39 @@ static int scorep_omp_get_schedule_type()
     omp_sched_t kind;
     int chunk_size;
 
-    omp_get_schedule(&kind, &chunk_size);
+    apply_pending_icvs();
+    read_schedule(&kind, &chunk_size);
 
-    return (int) kind;
+    return (int) ((unsigned int) kind & ~OMP_SCHED_MONOTONIC);
 }
 
 static int scorep_omp_set_chunk_size(int new_setting)
 {
-    omp_sched_t kind = 1;
+    omp_sched_t kind;
+    int chunk_size;
 
     llog(LOG_DEBUG, "[SCHEDULE_CHUNK_SIZE]: setting scheduling chunk size");
 
-    omp_set_schedule(kind, new_setting);
-    llog(LOG_DEBUG, "[SCHEDULE_CHUNK_SIZE]: New kind = %d New chunk size = %d", kind, new_setting);
+    if (new_setting > SCHEDULE_MAX_CHUNK_SIZE)
+    {
+        llog(LOG_WARN,
+            "[SCHEDULE_CHUNK_SIZE]: Invalid chunk size %d, has to be at most %d",
+            new_setting,
+            SCHEDULE_MAX_CHUNK_SIZE);
+        return -1;
+    }
+
+    apply_pending_icvs();
+    get_schedule(&kind, &chunk_size); // get existing kind and modifier
+
+    if (set_schedule(kind, new_setting))
+    {
+        publish_icv(ICV_SCHEDULE, encode_schedule(kind, new_setting));
+        llog(LOG_DEBUG,
+            "[SCHEDULE_CHUNK_SIZE]: New kind = %d New chunk size = %d",
+            (int) ((unsigned int) kind & ~OMP_SCHED_MONOTONIC),
+            new_setting);
+    }
     return 0;
 }
 
@@ -174,11 +703,380 @@ static int scorep_omp_get_chunk_size()
     int chunk_size;
     omp_sched_t kind;
 
-    omp_get_schedule(&kind, &chunk_size);
+    apply_pending_icvs();
+    read_schedule(&kind, &chunk_size);
 
     return chunk_size;
 }
 
+/**
+ * Sets kind, modifier and chunk size of the schedule with at most one call to omp_set_schedule.
+ *
+ * @param new_setting encoded schedule, see SCHEDULE_KIND_MASK
+ * @return 0 on success, -1 on failure
+ */
+static int scorep_omp_set_schedule(int new_setting)
+{
+    int kind = new_setting & SCHEDULE_KIND_MASK;
+
+    if (new_setting < 0 || kind < 1 || kind > 4)
+    {
+        llog(LOG_WARN,
+            "[SCHEDULE]: Invalid schedule %d, kind %d has to be between 1 and 4",
+            new_setting,
+            kind);
+        return -1;
+    }
+
+    apply_pending_icvs();
+    if (apply_schedule(new_setting))
+    {
+        publish_icv(ICV_SCHEDULE, new_setting);
+        llog(LOG_DEBUG,
+            "[SCHEDULE]: New kind = %d monotonic = %d New chunk size = %d",
+            kind,
+            (new_setting & SCHEDULE_MONOTONIC_FLAG) != 0,
+            new_setting >> SCHEDULE_CHUNK_SHIFT);
+    }
+    return 0;
+}
+
+static int scorep_omp_get_current_schedule()
+{
+    apply_pending_icvs();
+    return scorep_omp_get_schedule();
+}
+
+static int read_topology_value(int cpu, const char *name, int fallback)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return fallback;
+    }
+    int value = fallback;
+    if (fscanf(file, "%d", &value) != 1)
+    {
+        value = fallback;
+    }
+    fclose(file);
+    return value;
+}
+
+static int compare_compact(const void *a, const void *b)
+{
+    const struct cpu_topology *ca = a;
+    const struct cpu_topology *cb = b;
+    if (ca->package != cb->package)
+    {
+        return ca->package - cb->package;
+    }
+    if (ca->core != cb->core)
+    {
+        return ca->core - cb->core;
+    }
+    return ca->smt - cb->smt;
+}
+
+static int compare_cores(const void *a, const void *b)
+{
+    const struct cpu_topology *ca = a;
+    const struct cpu_topology *cb = b;
+    if (ca->smt != cb->smt)
+    {
+        return ca->smt - cb->smt;
+    }
+    if (ca->package != cb->package)
+    {
+        return ca->package - cb->package;
+    }
+    return ca->core - cb->core;
+}
+
+static int compare_scatter(const void *a, const void *b)
+{
+    const struct cpu_topology *ca = a;
+    const struct cpu_topology *cb = b;
+    if (ca->smt != cb->smt)
+    {
+        return ca->smt - cb->smt;
+    }
+    if (ca->core_rank != cb->core_rank)
+    {
+        return ca->core_rank - cb->core_rank;
+    }
+    return ca->package - cb->package;
+}
+
+/**
+ * Reads the topology of the CPUs in process_cpus and computes the CPU order of each placement
+ * strategy. The previous orders are kept on failure. Must be called with affinity_mutex held,
+ * or before any thread registered.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int compute_affinity_orders()
+{
+    int cpus = CPU_COUNT_S(cpu_set_size, process_cpus);
+    int *orders[NUM_AFFINITIES] = {NULL};
+    struct cpu_topology *topology = calloc(cpus, sizeof(struct cpu_topology));
+    int error = topology == NULL;
+    for (int strategy = AFFINITY_COMPACT; strategy < NUM_AFFINITIES && !error; strategy++)
+    {
+        orders[strategy] = malloc(cpus * sizeof(int));
+        error = orders[strategy] == NULL;
+    }
+    if (error)
+    {
+        for (int strategy = AFFINITY_COMPACT; strategy < NUM_AFFINITIES; strategy++)
+        {
+            free(orders[strategy]);
+        }
+        free(topology);
+        return -1;
+    }
+    int n = 0;
+    for (int cpu = 0; cpu < max_cpus && n < cpus; cpu++)
+    {
+        if (!CPU_ISSET_S(cpu, cpu_set_size, process_cpus))
+        {
+            continue;
+        }
+        topology[n].cpu = cpu;
+        topology[n].package = read_topology_value(cpu, "physical_package_id", 0);
+        topology[n].core = read_topology_value(cpu, "core_id", cpu);
+        n++;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < i; j++)
+        {
+            if (topology[j].package == topology[i].package && topology[j].core == topology[i].core)
+            {
+                topology[i].smt++;
+            }
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            if (topology[j].smt == 0 && topology[j].package == topology[i].package &&
+                topology[j].core < topology[i].core)
+            {
+                topology[i].core_rank++;
+            }
+        }
+    }
+
+    int (*comparators[NUM_AFFINITIES])(const void *, const void *) = {
+        [AFFINITY_COMPACT] = compare_compact,
+        [AFFINITY_CORES] = compare_cores,
+        [AFFINITY_SCATTER] = compare_scatter,
+    };
+    for (int strategy = AFFINITY_COMPACT; strategy < NUM_AFFINITIES; strategy++)
+    {
+        qsort(topology, n, sizeof(struct cpu_topology), comparators[strategy]);
+        for (int i = 0; i < n; i++)
+        {
+            orders[strategy][i] = topology[i].cpu;
+        }
+        free(affinity_orders[strategy]);
+        affinity_orders[strategy] = orders[strategy];
+    }
+    num_affinity_cpus = n;
+    free(topology);
+    llog(LOG_DEBUG, "[AFFINITY]: %d CPUs", n);
+    return 0;
+}
+
+/**
+ * Sizes the CPU sets for the kernel, which rejects sets smaller than its CPU mask, and computes
+ * the placement orders for the CPUs of the calling thread.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int init_affinity()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    max_cpus = cpus > 0 ? (int) cpus : CPU_SETSIZE;
+    for (;;)
+    {
+        cpu_set_size = CPU_ALLOC_SIZE(max_cpus);
+        max_cpus = (int) cpu_set_size * 8;
+        process_cpus = CPU_ALLOC(max_cpus);
+        pin_mask = CPU_ALLOC(max_cpus);
+        if (process_cpus == NULL || pin_mask == NULL)
+        {
+            break;
+        }
+        if (sched_getaffinity(0, cpu_set_size, process_cpus) == 0)
+        {
+            return compute_affinity_orders();
+        }
+        if (errno != EINVAL || max_cpus >= (1 << 20))
+        {
+            llog(LOG_WARN, "[AFFINITY]: sched_getaffinity failed: %s", strerror(errno));
+            break;
+        }
+        CPU_FREE(process_cpus);
+        CPU_FREE(pin_mask);
+        max_cpus *= 2;
+    }
+    if (process_cpus != NULL)
+    {
+        CPU_FREE(process_cpus);
+        process_cpus = NULL;
+    }
+    if (pin_mask != NULL)
+    {
+        CPU_FREE(pin_mask);
+        pin_mask = NULL;
+    }
+    return -1;
+}
+
+/**
+ * Applies strategy to worker. Must be called with affinity_mutex held.
+ */
+static int pin_worker(int worker, int strategy)
+{
+    if (workers[worker].tid == 0)
+    {
+        return 0;
+    }
+    cpu_set_t *mask;
+    if (strategy == AFFINITY_INITIAL)
+    {
+        mask = workers[worker].initial_mask;
+        if (mask == NULL)
+        {
+            return 0;
+        }
+    }
+    else if (strategy == AFFINITY_NONE)
+    {
+        mask = process_cpus;
+    }
+    else
+    {
+        mask = pin_mask;
+        CPU_ZERO_S(cpu_set_size, mask);
+        CPU_SET_S(affinity_orders[strategy][worker % num_affinity_cpus], cpu_set_size, mask);
+    }
+    if (sched_setaffinity(workers[worker].tid, cpu_set_size, mask) != 0)
+    {
+        if (errno == ESRCH)
+        {
+            /* the thread ended */
+            workers[worker].tid = 0;
+            return 0;
+        }
+        llog(LOG_WARN, "[AFFINITY]: sched_setaffinity for thread %d failed: %s",
+            workers[worker].tid, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Adds the CPUs of mask to process_cpus. Must be called with affinity_mutex held.
+ *
+ * @return 1 if CPUs were added, 0 otherwise
+ */
+static int add_process_cpus(const cpu_set_t *mask)
+{
+    int added = 0;
+    for (int cpu = 0; cpu < max_cpus; cpu++)
+    {
+        if (CPU_ISSET_S(cpu, cpu_set_size, mask) && !CPU_ISSET_S(cpu, cpu_set_size, process_cpus))
+        {
+            CPU_SET_S(cpu, cpu_set_size, process_cpus);
+            added = 1;
+        }
+    }
+    return added;
+}
+
+/**
+ * Records the TID and the initial mask of the calling thread, so the AFFINITY action can place
+ * it, and applies the current placement. If the thread may use CPUs no other registered thread
+ * could, the orders are computed again and all threads are placed anew.
+ */
+static void register_worker()
+{
+    if (own_worker != -1 || num_affinity_cpus == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&affinity_mutex);
+    if (num_workers < MAX_ICV_SLOTS)
+    {
+        own_worker = num_workers++;
+        struct worker *worker = &workers[own_worker];
+        worker->tid = syscall(SYS_gettid);
+        worker->initial_mask = CPU_ALLOC(max_cpus);
+        if (worker->initial_mask != NULL &&
+            sched_getaffinity(0, cpu_set_size, worker->initial_mask) != 0)
+        {
+            llog(LOG_WARN, "[AFFINITY]: sched_getaffinity failed: %s", strerror(errno));
+            CPU_FREE(worker->initial_mask);
+            worker->initial_mask = NULL;
+        }
+        if (worker->initial_mask != NULL && add_process_cpus(worker->initial_mask) &&
+            compute_affinity_orders() == 0 && current_affinity != AFFINITY_INITIAL)
+        {
+            for (int other = 0; other < num_workers; other++)
+            {
+                pin_worker(other, current_affinity);
+            }
+        }
+        else if (current_affinity != AFFINITY_INITIAL)
+        {
+            pin_worker(own_worker, current_affinity);
+        }
+    }
+    pthread_mutex_unlock(&affinity_mutex);
+}
+
+/**
+ * Places all registered threads according to the strategy, see affinity_strategy.
+ */
+static int scorep_set_affinity(int new_setting)
+{
+    if (new_setting < AFFINITY_INITIAL || new_setting >= NUM_AFFINITIES)
+    {
+        llog(LOG_WARN, "[AFFINITY]: Invalid value %d", new_setting);
+        return -1;
+    }
+    apply_pending_icvs();
+    if (new_setting == current_affinity)
+    {
+        return 0;
+    }
+    int result = 0;
+    pthread_mutex_lock(&affinity_mutex);
+    if (new_setting != current_affinity)
+    {
+        for (int worker = 0; worker < num_workers; worker++)
+        {
+            result |= pin_worker(worker, new_setting);
+        }
+        current_affinity = new_setting;
+        llog(LOG_DEBUG, "[AFFINITY]: New Setting = %d for %d threads", new_setting, num_workers);
+    }
+    pthread_mutex_unlock(&affinity_mutex);
+    return result;
+}
+
+static int scorep_get_affinity()
+{
+    apply_pending_icvs();
+    return current_affinity;
+}
+
 static rrl_tuning_action_info return_values[] = {
     {
         .name = "NUMTHREADS",
@@ -186,14 +1084,12 @@ static rrl_tuning_action_info return_values[] = {
         .enter_region_set_config = &scorep_omp_set_num_threads,
         .exit_region_set_config = &scorep_omp_set_num_threads,
     },
-    /*
-        {
-            .name = "KMPBLOCKTIME",
-            .enter_region_set_config = &scorep_kmp_set_blocktime,
-            .exit_region_set_config = &scorep_kmp_set_blocktime,
-            .current_config = &scorep_kmp_get_blocktime,
-        },
-    */
+    {
+        .name = "BLOCKTIME",
+        .current_config = &scorep_kmp_get_blocktime,
+        .enter_region_set_config = &scorep_kmp_set_blocktime,
+        .exit_region_set_config = &scorep_kmp_set_blocktime,
+    },
     {
         .name = "SCHEDULE_TYPE",
         .current_config = &scorep_omp_get_schedule_type,
@@ -206,6 +1102,36 @@ static rrl_tuning_action_info return_values[] = {
         .enter_region_set_config = &scorep_omp_set_chunk_size,
         .exit_region_set_config = &scorep_omp_set_chunk_size,
     },
+    {
+        .name = "MAX_ACTIVE_LEVELS",
+        .current_config = &scorep_omp_get_max_active_levels,
+        .enter_region_set_config = &scorep_omp_set_max_active_levels,
+        .exit_region_set_config = &scorep_omp_set_max_active_levels,
+    },
+    {
+        .name = "DYNAMIC",
+        .current_config = &scorep_omp_get_dynamic,
+        .enter_region_set_config = &scorep_omp_set_dynamic,
+        .exit_region_set_config = &scorep_omp_set_dynamic,
+    },
+    {
+        .name = "TEAMS_THREAD_LIMIT",
+        .current_config = &scorep_omp_get_teams_thread_limit,
+        .enter_region_set_config = &scorep_omp_set_teams_thread_limit,
+        .exit_region_set_config = &scorep_omp_set_teams_thread_limit,
+    },
+    {
+        .name = "SCHEDULE",
+        .current_config = &scorep_omp_get_current_schedule,
+        .enter_region_set_config = &scorep_omp_set_schedule,
+        .exit_region_set_config = &scorep_omp_set_schedule,
+    },
+    {
+        .name = "AFFINITY",
+        .current_config = &scorep_get_affinity,
+        .enter_region_set_config = &scorep_set_affinity,
+        .exit_region_set_config = &scorep_set_affinity,
+    },
     {
         .name = NULL,
         .current_config = NULL,
@@ -213,15 +1139,109 @@ static rrl_tuning_action_info return_values[] = {
         .exit_region_set_config = NULL,
     }};
 
+/**
+ * Removes a tuning action the runtime does not support from return_values.
+ */
+static void remove_tuning_action(const char *name)
+{
+    rrl_tuning_action_info *action = return_values;
+    while (action->name != NULL && strcmp(action->name, name) != 0)
+    {
+        action++;
+    }
+    if (action->name == NULL)
+    {
+        return;
+    }
+    do
+    {
+        *action = *(action + 1);
+        action++;
+    } while (action->name != NULL);
+}
+
+/**
+ * Detects the OpenMP runtime and looks up its extensions.
+ *
+ * LLVM libomp and Intel libiomp both provide kmp_set_blocktime; they are told apart by the
+ * name of the library defining it. GNU libgomp is detected by its GOMP_parallel entry point.
+ */
+static void detect_omp_runtime()
+{
+    kmp_set_blocktime_fn = (void (*)(int)) dlsym(RTLD_DEFAULT, "kmp_set_blocktime");
+    kmp_get_blocktime_fn = (int (*)(void)) dlsym(RTLD_DEFAULT, "kmp_get_blocktime");
+
+    if (kmp_set_blocktime_fn != NULL)
+    {
+        Dl_info info;
+        if (dladdr((void *) kmp_set_blocktime_fn, &info) != 0 && info.dli_fname != NULL &&
+            strstr(info.dli_fname, "iomp") != NULL)
+        {
+            runtime = OMP_RUNTIME_INTEL;
+        }
+        else
+        {
+            runtime = OMP_RUNTIME_LLVM;
+        }
+    }
+    else if (dlsym(RTLD_DEFAULT, "GOMP_parallel") != NULL)
+    {
+        runtime = OMP_RUNTIME_GNU;
+    }
+
+    if (kmp_set_blocktime_fn == NULL || kmp_get_blocktime_fn == NULL)
+    {
+        kmp_set_blocktime_fn = NULL;
+        kmp_get_blocktime_fn = NULL;
+        llog(LOG_WARN,
+            "BLOCKTIME is not supported by the OpenMP runtime (%s), the tuning action is "
+            "not available. For GNU libgomp use GOMP_SPINCOUNT or OMP_WAIT_POLICY instead.",
+            omp_runtime_names[runtime]);
+        remove_tuning_action("BLOCKTIME");
+    }
+
+    omp_set_teams_thread_limit_fn =
+        (void (*)(int)) dlsym(RTLD_DEFAULT, "omp_set_teams_thread_limit");
+    omp_get_teams_thread_limit_fn =
+        (int (*)(void)) dlsym(RTLD_DEFAULT, "omp_get_teams_thread_limit");
+    if (omp_set_teams_thread_limit_fn == NULL || omp_get_teams_thread_limit_fn == NULL)
+    {
+        llog(LOG_WARN,
+            "TEAMS_THREAD_LIMIT is not supported by the OpenMP runtime (%s), the tuning action "
+            "is not available.",
+            omp_runtime_names[runtime]);
+        remove_tuning_action("TEAMS_THREAD_LIMIT");
+    }
+    llog(LOG_INFO, "Detected OpenMP runtime: %s", omp_runtime_names[runtime]);
+}
+
 int32_t init()
 {
     llog(LOG_DEBUG, "GIT revision: %s", GIT_REV);
     llog(LOG_INFO, " Initializing");
+    detect_omp_runtime();
+    register_icv_slot();
+    if (init_affinity() != 0)
+    {
+        llog(LOG_WARN, "Could not read the CPU topology, AFFINITY is not available.");
+        remove_tuning_action("AFFINITY");
+    }
+    register_worker();
     return 0;
 }
 
+/**
+ * Gives a new CPU thread a slot, so ICVs set by other threads reach it, and registers it for
+ * AFFINITY. create_location runs on the new thread.
+ */
 void create_location(RRL_LocationType location_type, uint32_t location_id)
 {
+    llog(LOG_DEBUG, "create_location for location %u with typ %u ", location_id, location_type);
+    if (location_type == RRL_LOCATION_TYPE_CPU_THREAD)
+    {
+        register_icv_slot();
+        register_worker();
+    }
 }
 
 void delete_location(RRL_LocationType location_type, uint32_t location_id)
@@ -236,6 +1256,14 @@ rrl_tuning_action_info *get_tuning_info()
 void fini()
 {
     llog(LOG_INFO, " Finalizing");
+    if (num_affinity_cpus != 0 && current_affinity != AFFINITY_INITIAL)
+    {
+        scorep_set_affinity(AFFINITY_INITIAL);
+    }
+#ifdef HAVE_OMPT
+    ompt_regions_dump();
+    autotune_save();
+#endif
 }
 
 RRL_TUNING_PLUGIN_ENTRY(OpenMPTP)
@@ -0,0 +1,120 @@
+/*
+ * This file is part of the Score-P software (http://www.score-p.org)
+ *
+ * Copyright (c) 2015, Technische Universität München, Germany
+ *
+ * This software may be modified and distributed under the terms of
+ * a BSD-style license.  See the COPYING file in the package base
+ * directory for details.
+ *
+ *
+ * INFO:
+ *
+ * Declarations shared between the translation units of the OpenMP tuning plugin.
+ *
+ */
+
+#ifndef OPENMPTP_H
+#define OPENMPTP_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PLUGIN_NAME "OpenMPTP"
+
+typedef enum { LOG_VERBOSE, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_INVALID } log_level;
+
+void llog(log_level msg_level, const char *message_fmt, ...);
+
+#ifdef HAVE_OMPT
+/**
+ * @return 1 if the runtime accepted the plugin as OMPT tool and region recording is active
+ */
+int ompt_regions_active(void);
+
+/**
+ * Aggregates the per-thread region records and writes them to the output file. Only the first
+ * call writes.
+ */
+void ompt_regions_dump(void);
+
+/**
+ * Enables the online autotuner if SCOREP_TUNING_OPENMPTP_PLUGIN_AUTOTUNE is set to 1 and loads
+ * its cache file.
+ */
+void autotune_init(void);
+
+int autotune_enabled(void);
+
+/**
+ * Applies the tuned configuration of the region at codeptr. Called on the encountering thread
+ * before the team is created.
+ */
+void autotune_parallel_begin(const void *codeptr);
+
+/**
+ * Restores the ICVs changed by autotune_parallel_begin and evaluates the measured time.
+ */
+void autotune_parallel_end(void);
+
+/**
+ * Writes the pinned configurations to the cache file. Only the first call writes.
+ */
+void autotune_save(void);
+
+#ifdef HAVE_FREQGEN
+/**
+ * Sets up lowering the core frequency during barrier waits, if
+ * SCOREP_TUNING_OPENMPTP_PLUGIN_BARRIER_FREQ is set.
+ *
+ * @return 1 if enabled, 0 otherwise
+ */
+int barrier_freq_init(void);
+
+int barrier_freq_enabled(void);
+
+/**
+ * Lowers the frequency of the calling thread's core if the barrier identified by key is
+ * expected to wait longer than the threshold.
+ */
+void barrier_freq_wait_begin(const void *key);
+
+/**
+ * Restores the frequency lowered by barrier_freq_wait_begin and records the wait time.
+ */
+void barrier_freq_wait_end(const void *key, uint64_t wait_ns);
+
+void barrier_freq_fini(void);
+#else
+static inline int barrier_freq_init(void)
+{
+    return 0;
+}
+
+static inline int barrier_freq_enabled(void)
+{
+    return 0;
+}
+
+static inline void barrier_freq_wait_begin(const void *key)
+{
+}
+
+static inline void barrier_freq_wait_end(const void *key, uint64_t wait_ns)
+{
+}
+
+static inline void barrier_freq_fini(void)
+{
+}
+#endif
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OPENMPTP_H */
@@ -0,0 +1,494 @@
+/*
+ * This file is part of the Score-P software (http://www.score-p.org)
+ *
+ * Copyright (c) 2015, Technische Universität München, Germany
+ *
+ * This software may be modified and distributed under the terms of
+ * a BSD-style license.  See the COPYING file in the package base
+ * directory for details.
+ *
+ *
+ * INFO:
+ *
+ * Online autotuner of the OpenMP tuning plugin. For every parallel region (identified by its
+ * codeptr) the number of threads and the chunk size are tuned by a hill climb on the measured
+ * wall time of the region. Converged values are pinned and stored in a cache file, so later runs
+ * start with them.
+ *
+ * The configuration is applied in the OMPT parallel_begin callback of the encountering thread
+ * and restored in parallel_end. LLVM libomp and Intel libiomp evaluate nthreads-var and
+ * run-sched-var after this callback, so the configuration applies to the starting region.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <omp.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "OpenMPTP.h"
+
+/* power of two, distinct parallel regions tuned */
+#define TUNE_TABLE_SIZE 4096
+/* invocations measured per configuration, the minimum is used */
+#define TUNE_SAMPLES 4
+/* invocations after which the best configuration is pinned, even if not converged */
+#define TUNE_MAX_INVOCATIONS 400
+/* relative gain a configuration needs to replace the best one */
+#define TUNE_MIN_GAIN 0.02
+/* nesting depth of parallel regions handled per thread */
+#define MAX_NESTING 16
+#define MAX_CACHED_REGIONS 65536
+
+/* chunk sizes tried, -1 keeps the chunk size of run-sched-var */
+static const int chunk_sizes[] = {1, 4, 16, 64, 256, 1024, -1};
+#define NUM_CHUNK_SIZES ((int) (sizeof(chunk_sizes) / sizeof(chunk_sizes[0])))
+
+typedef enum { TUNE_THREADS = 0, TUNE_CHUNK, TUNE_PINNED } tune_phase;
+
+/**
+ * Tuning state of one parallel region. values and trial hold the number of threads and an index
+ * into chunk_sizes.
+ */
+struct tune_state
+{
+    _Alignas(64) _Atomic(const void *) codeptr;
+    atomic_int ready;
+    atomic_flag lock;
+    tune_phase phase;
+    int values[2]; /**< best configuration so far */
+    int trial[2];  /**< configuration currently measured */
+    int min[2];
+    int max[2];
+    int step;
+    int direction;
+    int tried_other; /**< the other direction was tried at the current step */
+    int samples;
+    uint64_t trial_ns;
+    uint64_t best_ns;
+    int invocations;
+    const char *module;
+    uintptr_t offset; /**< codeptr relative to module, stable across runs */
+};
+
+/**
+ * Configuration of a running region, so it can be restored and measured at its end.
+ */
+struct tune_frame
+{
+    struct tune_state *state;
+    int config[2];
+    int saved_threads;
+    omp_sched_t saved_kind;
+    int saved_chunk;
+    uint64_t begin;
+};
+
+struct cached_region
+{
+    char module[256];
+    uintptr_t offset;
+    int threads;
+    int chunk;
+    int used;
+};
+
+static struct tune_state tune_states[TUNE_TABLE_SIZE];
+static __thread struct tune_frame frames[MAX_NESTING];
+static __thread int depth;
+
+static struct cached_region *cached_regions;
+static int num_cached_regions;
+static char cache_file[4096];
+static int enabled;
+static atomic_flag saved = ATOMIC_FLAG_INIT;
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static const char *basename_of(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+static void load_cache()
+{
+    FILE *in = fopen(cache_file, "r");
+    if (in == NULL)
+    {
+        llog(LOG_INFO, "autotune: no cache file %s, tuning all regions", cache_file);
+        return;
+    }
+    cached_regions = calloc(MAX_CACHED_REGIONS, sizeof(struct cached_region));
+    if (cached_regions == NULL)
+    {
+        fclose(in);
+        return;
+    }
+    struct cached_region *region = &cached_regions[0];
+    while (num_cached_regions < MAX_CACHED_REGIONS &&
+           fscanf(in, "%255s %lx %d %d", region->module, (unsigned long *) &region->offset,
+               &region->threads, &region->chunk) == 4)
+    {
+        if (region->threads > 0 && region->chunk >= -1)
+        {
+            region = &cached_regions[++num_cached_regions];
+        }
+    }
+    fclose(in);
+    llog(LOG_INFO, "autotune: loaded %d regions from %s", num_cached_regions, cache_file);
+}
+
+void autotune_init()
+{
+    const char *enable = getenv("SCOREP_TUNING_OPENMPTP_PLUGIN_AUTOTUNE");
+    if (enable == NULL || strcmp(enable, "1") != 0)
+    {
+        return;
+    }
+    const char *file = getenv("SCOREP_TUNING_OPENMPTP_PLUGIN_AUTOTUNE_CACHE");
+    if (file != NULL && file[0] != '\0')
+    {
+        snprintf(cache_file, sizeof(cache_file), "%s", file);
+    }
+    else
+    {
+        snprintf(cache_file, sizeof(cache_file), "%s.openmptp_cache",
+            program_invocation_short_name);
+    }
+    load_cache();
+    enabled = 1;
+}
+
+int autotune_enabled()
+{
+    return enabled;
+}
+
+static void start_dimension(struct tune_state *state, int dimension)
+{
+    if (dimension > TUNE_CHUNK)
+    {
+        state->phase = TUNE_PINNED;
+        return;
+    }
+    state->phase = dimension;
+    state->step = (state->max[dimension] - state->min[dimension] + 1) / 2;
+    if (state->step < 1)
+    {
+        state->step = 1;
+    }
+    state->direction = -1;
+    state->tried_other = 0;
+}
+
+/**
+ * Chooses the next configuration to measure. If the last one was worse than the best, the
+ * other direction is tried, then the step size is halved. When the step size is one and both
+ * directions failed, the next dimension is tuned, after the last one the region is pinned.
+ */
+static void next_trial(struct tune_state *state, int failed)
+{
+    while (state->phase != TUNE_PINNED)
+    {
+        int dimension = state->phase;
+        if (failed)
+        {
+            if (!state->tried_other)
+            {
+                state->direction = -state->direction;
+                state->tried_other = 1;
+            }
+            else if (state->step > 1)
+            {
+                state->step /= 2;
+                state->direction = -1;
+                state->tried_other = 0;
+            }
+            else
+            {
+                start_dimension(state, dimension + 1);
+                failed = 0;
+                continue;
+            }
+        }
+        int candidate = state->values[dimension] + state->direction * state->step;
+        if (candidate >= state->min[dimension] && candidate <= state->max[dimension])
+        {
+            state->trial[0] = state->values[0];
+            state->trial[1] = state->values[1];
+            state->trial[dimension] = candidate;
+            return;
+        }
+        failed = 1;
+    }
+    state->trial[0] = state->values[0];
+    state->trial[1] = state->values[1];
+}
+
+static int chunk_index(int chunk)
+{
+    for (int i = 0; i < NUM_CHUNK_SIZES; i++)
+    {
+        if (chunk_sizes[i] == chunk)
+        {
+            return i;
+        }
+    }
+    return NUM_CHUNK_SIZES - 1;
+}
+
+static void init_state(struct tune_state *state, const void *codeptr)
+{
+    state->min[TUNE_THREADS] = 1;
+    state->max[TUNE_THREADS] = omp_get_max_threads();
+    state->min[TUNE_CHUNK] = 0;
+    state->max[TUNE_CHUNK] = NUM_CHUNK_SIZES - 1;
+    state->values[TUNE_THREADS] = state->max[TUNE_THREADS];
+    state->values[TUNE_CHUNK] = NUM_CHUNK_SIZES - 1;
+
+    Dl_info info;
+    if (dladdr(codeptr, &info) != 0 && info.dli_fname != NULL)
+    {
+        state->module = basename_of(info.dli_fname);
+        state->offset = (uintptr_t) codeptr - (uintptr_t) info.dli_fbase;
+        for (int i = 0; i < num_cached_regions; i++)
+        {
+            struct cached_region *cached = &cached_regions[i];
+            if (cached->offset == state->offset && strcmp(cached->module, state->module) == 0)
+            {
+                cached->used = 1;
+                state->values[TUNE_THREADS] = cached->threads;
+                state->values[TUNE_CHUNK] = chunk_index(cached->chunk);
+                state->phase = TUNE_PINNED;
+                llog(LOG_DEBUG, "autotune: %s+0x%lx pinned from cache: %d threads, chunk %d",
+                    state->module, (unsigned long) state->offset, cached->threads,
+                    cached->chunk);
+                break;
+            }
+        }
+    }
+    if (state->phase != TUNE_PINNED)
+    {
+        start_dimension(state, TUNE_THREADS);
+    }
+    state->trial[0] = state->values[0];
+    state->trial[1] = state->values[1];
+}
+
+/**
+ * Finds or creates the state of codeptr.
+ *
+ * @return the state, NULL if the table is full or the state is being created by another thread
+ */
+static struct tune_state *lookup_state(const void *codeptr)
+{
+    uintptr_t hash = ((uintptr_t) codeptr * 0x9E3779B97F4A7C15ull) >> 32;
+    for (int i = 0; i < TUNE_TABLE_SIZE; i++)
+    {
+        struct tune_state *state = &tune_states[(hash + i) & (TUNE_TABLE_SIZE - 1)];
+        const void *current = atomic_load_explicit(&state->codeptr, memory_order_relaxed);
+        if (current == NULL)
+        {
+            if (!atomic_compare_exchange_strong(&state->codeptr, &current, codeptr) &&
+                current != codeptr)
+            {
+                continue;
+            }
+            if (current == NULL)
+            {
+                init_state(state, codeptr);
+                atomic_store_explicit(&state->ready, 1, memory_order_release);
+                return state;
+            }
+        }
+        if (current == codeptr)
+        {
+            return atomic_load_explicit(&state->ready, memory_order_acquire) ? state : NULL;
+        }
+    }
+    return NULL;
+}
+
+void autotune_parallel_begin(const void *codeptr)
+{
+    if (depth >= MAX_NESTING)
+    {
+        depth++;
+        return;
+    }
+    struct tune_frame *frame = &frames[depth++];
+    frame->state = lookup_state(codeptr);
+    if (frame->state == NULL || atomic_flag_test_and_set(&frame->state->lock))
+    {
+        /* untracked or measured by another thread, run with the current ICVs */
+        frame->state = NULL;
+        return;
+    }
+    struct tune_state *state = frame->state;
+    if (state->phase == TUNE_PINNED)
+    {
+        frame->config[0] = state->values[0];
+        frame->config[1] = state->values[1];
+    }
+    else
+    {
+        frame->config[0] = state->trial[0];
+        frame->config[1] = state->trial[1];
+    }
+    atomic_flag_clear(&state->lock);
+
+    frame->saved_threads = omp_get_max_threads();
+    omp_get_schedule(&frame->saved_kind, &frame->saved_chunk);
+    if (frame->config[TUNE_THREADS] != frame->saved_threads)
+    {
+        omp_set_num_threads(frame->config[TUNE_THREADS]);
+    }
+    int chunk = chunk_sizes[frame->config[TUNE_CHUNK]];
+    if (chunk != -1 && chunk != frame->saved_chunk)
+    {
+        omp_set_schedule(frame->saved_kind, chunk);
+    }
+    frame->begin = now_ns();
+}
+
+static void evaluate(struct tune_state *state, const int config[2], uint64_t time)
+{
+    state->invocations++;
+    if (state->phase == TUNE_PINNED || config[0] != state->trial[0] ||
+        config[1] != state->trial[1])
+    {
+        return;
+    }
+    if (state->samples == 0 || time < state->trial_ns)
+    {
+        state->trial_ns = time;
+    }
+    if (++state->samples < TUNE_SAMPLES)
+    {
+        return;
+    }
+    state->samples = 0;
+
+    int failed = 0;
+    if (state->best_ns == 0)
+    {
+        state->best_ns = state->trial_ns;
+    }
+    else if (state->trial_ns < state->best_ns * (1.0 - TUNE_MIN_GAIN))
+    {
+        state->best_ns = state->trial_ns;
+        state->values[0] = state->trial[0];
+        state->values[1] = state->trial[1];
+        /* the way back leads to the former best, which is worse */
+        state->tried_other = 1;
+    }
+    else
+    {
+        failed = 1;
+    }
+
+    if (state->invocations >= TUNE_MAX_INVOCATIONS)
+    {
+        state->phase = TUNE_PINNED;
+    }
+    else
+    {
+        next_trial(state, failed);
+    }
+    if (state->phase == TUNE_PINNED)
+    {
+        llog(LOG_DEBUG, "autotune: %p pinned after %d invocations: %d threads, chunk %d, %lu ns",
+            atomic_load(&state->codeptr), state->invocations, state->values[TUNE_THREADS],
+            chunk_sizes[state->values[TUNE_CHUNK]], (unsigned long) state->best_ns);
+    }
+}
+
+void autotune_parallel_end()
+{
+    if (depth-- > MAX_NESTING)
+    {
+        return;
+    }
+    struct tune_frame *frame = &frames[depth];
+    if (frame->state == NULL)
+    {
+        return;
+    }
+    uint64_t time = now_ns() - frame->begin;
+    if (frame->config[TUNE_THREADS] != frame->saved_threads)
+    {
+        omp_set_num_threads(frame->saved_threads);
+    }
+    int chunk = chunk_sizes[frame->config[TUNE_CHUNK]];
+    if (chunk != -1 && chunk != frame->saved_chunk)
+    {
+        omp_set_schedule(frame->saved_kind, frame->saved_chunk);
+    }
+
+    struct tune_state *state = frame->state;
+    while (atomic_flag_test_and_set(&state->lock))
+    {
+    }
+    evaluate(state, frame->config, time);
+    atomic_flag_clear(&state->lock);
+}
+
+/**
+ * Writes the pinned regions of this run and the cached regions not seen in this run to the
+ * cache file. Only the first call writes.
+ */
+void autotune_save()
+{
+    if (!enabled || atomic_flag_test_and_set(&saved))
+    {
+        return;
+    }
+    FILE *out = fopen(cache_file, "w");
+    if (out == NULL)
+    {
+        llog(LOG_WARN, "autotune: could not write %s: %s", cache_file, strerror(errno));
+        return;
+    }
+    int pinned = 0;
+    int tuning = 0;
+    for (int i = 0; i < TUNE_TABLE_SIZE; i++)
+    {
+        struct tune_state *state = &tune_states[i];
+        if (!atomic_load(&state->ready) || state->module == NULL)
+        {
+            continue;
+        }
+        if (state->phase != TUNE_PINNED)
+        {
+            tuning++;
+            continue;
+        }
+        fprintf(out, "%s %lx %d %d\n", state->module, (unsigned long) state->offset,
+            state->values[TUNE_THREADS], chunk_sizes[state->values[TUNE_CHUNK]]);
+        pinned++;
+    }
+    for (int i = 0; i < num_cached_regions; i++)
+    {
+        struct cached_region *cached = &cached_regions[i];
+        if (!cached->used)
+        {
+            fprintf(out, "%s %lx %d %d\n", cached->module, (unsigned long) cached->offset,
+                cached->threads, cached->chunk);
+        }
+    }
+    fclose(out);
+    llog(LOG_INFO, "autotune: %d regions pinned, %d still tuning, written to %s", pinned, tuning,
+        cache_file);
+}
@@ -0,0 +1,343 @@
+/*
+ * This file is part of the Score-P software (http://www.score-p.org)
+ *
+ * Copyright (c) 2015, Technische Universität München, Germany
+ *
+ * This software may be modified and distributed under the terms of
+ * a BSD-style license.  See the COPYING file in the package base
+ * directory for details.
+ *
+ *
+ * INFO:
+ *
+ * Lowers the core frequency of OpenMP threads waiting in barriers. Uses the libfreqgen
+ * interface of the cpu_freq plugin.
+ *
+ * OMPT reports the begin and the end of a barrier wait, but nothing while the thread waits.
+ * Therefore each thread keeps the average wait time of every barrier it passes. If a wait is
+ * expected to take longer than the threshold, the thread lowers the frequency of its core when
+ * the wait begins, and restores the frequency of the core when it ends. The frequency is written
+ * by the thread on the core it runs on, so MSR based interfaces need no IPI.
+ *
+ * The restored frequency is fixed per core: the one set in
+ * SCOREP_TUNING_OPENMPTP_PLUGIN_BARRIER_FREQ_RESTORE, or the one the core had when it was used
+ * first, before any barrier lowered it. Reading the frequency at every wait would restore a
+ * lowered frequency if two threads share the core, and would prepare a setting for every value
+ * a measuring interface reports.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <freqgen.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "OpenMPTP.h"
+
+/* power of two, barriers remembered per thread */
+#define BARRIER_TABLE_SIZE 64
+#define MAX_FREQ_SETTINGS 64
+#define DEFAULT_THRESHOLD_US 100
+
+typedef enum {
+    DEVICE_UNINITIALIZED = 0,
+    DEVICE_INITIALIZING,
+    DEVICE_READY,
+    DEVICE_FAILED
+} device_state;
+
+struct cpu_device
+{
+    _Alignas(64) atomic_int state;
+    int device;
+    atomic_int waiting;                 /**< threads waiting on the lowered core */
+    freq_gen_setting_t restore_setting; /**< setting restored when the last wait ends */
+    int lower;                          /**< restore frequency is above the low frequency */
+};
+
+/**
+ * Prepared settings, appended under settings_mutex and read without lock.
+ */
+struct freq_setting
+{
+    long long int freq;
+    freq_gen_setting_t setting;
+};
+
+struct barrier_history
+{
+    const void *key;
+    uint64_t avg_wait_ns;
+};
+
+static freq_gen_interface_t *interface;
+static struct cpu_device *cpu_devices;
+static int num_cpus;
+static freq_gen_setting_t low_setting;
+static long long int low_freq;
+static freq_gen_setting_t restore_setting;
+static long long int restore_freq;
+static uint64_t threshold_ns;
+static int enabled;
+
+static struct freq_setting freq_settings[MAX_FREQ_SETTINGS];
+static atomic_int num_freq_settings;
+static pthread_mutex_t settings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct barrier_history history[BARRIER_TABLE_SIZE];
+/* cpu whose frequency the calling thread lowered, -1 if none */
+static __thread int lowered_cpu = -1;
+
+static inline struct barrier_history *history_slot(const void *key)
+{
+    return &history[((uintptr_t) key * 0x9E3779B97F4A7C15ull) >> 32 & (BARRIER_TABLE_SIZE - 1)];
+}
+
+/**
+ * Returns the prepared setting for freq, prepares it on first use.
+ */
+static freq_gen_setting_t get_setting(long long int freq)
+{
+    int count = atomic_load_explicit(&num_freq_settings, memory_order_acquire);
+    for (int i = 0; i < count; i++)
+    {
+        if (freq_settings[i].freq == freq)
+        {
+            return freq_settings[i].setting;
+        }
+    }
+    freq_gen_setting_t setting = NULL;
+    pthread_mutex_lock(&settings_mutex);
+    count = atomic_load(&num_freq_settings);
+    for (int i = 0; i < count; i++)
+    {
+        if (freq_settings[i].freq == freq)
+        {
+            setting = freq_settings[i].setting;
+        }
+    }
+    if (setting == NULL && count < MAX_FREQ_SETTINGS)
+    {
+        setting = interface->prepare_set_frequency(freq, 0);
+        if (setting != NULL)
+        {
+            freq_settings[count].freq = freq;
+            freq_settings[count].setting = setting;
+            atomic_store_explicit(&num_freq_settings, count + 1, memory_order_release);
+        }
+        else
+        {
+            llog(LOG_WARN, "barrier_freq: could not prepare frequency %lli: %s", freq,
+                freq_gen_error_string());
+        }
+    }
+    pthread_mutex_unlock(&settings_mutex);
+    return setting;
+}
+
+/**
+ * Returns the freqgen device of cpu, initializes it on first use. The frequency to restore is
+ * chosen here, see the file comment.
+ *
+ * @return the device, -1 if it can not be used
+ */
+static int get_device(int cpu)
+{
+    if (cpu < 0 || cpu >= num_cpus)
+    {
+        return -1;
+    }
+    struct cpu_device *cpu_device = &cpu_devices[cpu];
+    int state = atomic_load_explicit(&cpu_device->state, memory_order_acquire);
+    if (state == DEVICE_READY)
+    {
+        return cpu_device->device;
+    }
+    if (state != DEVICE_UNINITIALIZED ||
+        !atomic_compare_exchange_strong(&cpu_device->state, &state, DEVICE_INITIALIZING))
+    {
+        return -1;
+    }
+    cpu_device->device = interface->init_device(cpu);
+    if (cpu_device->device < 0)
+    {
+        llog(LOG_WARN, "barrier_freq: init cpu %d failed: %s %s", cpu,
+            strerror(abs(cpu_device->device)), freq_gen_error_string());
+        atomic_store_explicit(&cpu_device->state, DEVICE_FAILED, memory_order_release);
+        return -1;
+    }
+    long long int freq = restore_freq;
+    cpu_device->restore_setting = restore_setting;
+    if (restore_setting == NULL)
+    {
+        freq = interface->get_frequency(cpu_device->device);
+        cpu_device->restore_setting = freq > 0 ? get_setting(freq) : NULL;
+    }
+    if (cpu_device->restore_setting == NULL)
+    {
+        llog(LOG_WARN, "barrier_freq: no frequency to restore on cpu %d", cpu);
+        interface->close_device(cpu, cpu_device->device);
+        atomic_store_explicit(&cpu_device->state, DEVICE_FAILED, memory_order_release);
+        return -1;
+    }
+    cpu_device->lower = freq > low_freq;
+    llog(LOG_DEBUG, "barrier_freq: cpu %d restores %lli MHz", cpu, freq / 1000000);
+    atomic_store_explicit(&cpu_device->state, DEVICE_READY, memory_order_release);
+    return cpu_device->device;
+}
+
+int barrier_freq_init()
+{
+    const char *freq = getenv("SCOREP_TUNING_OPENMPTP_PLUGIN_BARRIER_FREQ");
+    if (freq == NULL || freq[0] == '\0')
+    {
+        return 0;
+    }
+    low_freq = atoll(freq) * 1000000ll;
+    if (low_freq <= 0)
+    {
+        llog(LOG_WARN, "barrier_freq: invalid frequency %s MHz", freq);
+        return 0;
+    }
+    const char *threshold = getenv("SCOREP_TUNING_OPENMPTP_PLUGIN_BARRIER_FREQ_THRESHOLD_US");
+    threshold_ns = (threshold != NULL ? strtoull(threshold, NULL, 10) : DEFAULT_THRESHOLD_US) *
+                   1000ull;
+
+    interface = freq_gen_init(FREQ_GEN_DEVICE_CORE_FREQ);
+    if (interface == NULL)
+    {
+        llog(LOG_WARN, "barrier_freq: no interface for CORE FREQ found. Last error: %s",
+            freq_gen_error_string());
+        return 0;
+    }
+    num_cpus = interface->get_num_devices();
+    cpu_devices = calloc(num_cpus > 0 ? num_cpus : 1, sizeof(struct cpu_device));
+    if (cpu_devices == NULL)
+    {
+        llog(LOG_WARN, "barrier_freq: memory failure %s", strerror(errno));
+        interface->finalize();
+        return 0;
+    }
+    low_setting = get_setting(low_freq);
+    const char *restore = getenv("SCOREP_TUNING_OPENMPTP_PLUGIN_BARRIER_FREQ_RESTORE");
+    if (restore != NULL && restore[0] != '\0')
+    {
+        restore_freq = atoll(restore) * 1000000ll;
+        restore_setting = restore_freq > 0 ? get_setting(restore_freq) : NULL;
+        if (restore_setting == NULL)
+        {
+            llog(LOG_WARN, "barrier_freq: invalid restore frequency %s MHz", restore);
+        }
+    }
+    if (low_setting == NULL || (restore != NULL && restore[0] != '\0' && restore_setting == NULL))
+    {
+        int count = atomic_load(&num_freq_settings);
+        for (int i = 0; i < count; i++)
+        {
+            interface->unprepare_set_frequency(freq_settings[i].setting);
+        }
+        atomic_store(&num_freq_settings, 0);
+        free(cpu_devices);
+        interface->finalize();
+        return 0;
+    }
+    enabled = 1;
+    llog(LOG_INFO, "barrier_freq: using %s, %lli MHz for barrier waits longer than %lu us",
+        interface->name, low_freq / 1000000, (unsigned long) (threshold_ns / 1000));
+    return 1;
+}
+
+int barrier_freq_enabled()
+{
+    return enabled;
+}
+
+void barrier_freq_wait_begin(const void *key)
+{
+    struct barrier_history *barrier = history_slot(key);
+    if (barrier->key != key || barrier->avg_wait_ns < threshold_ns)
+    {
+        return;
+    }
+    int cpu = sched_getcpu();
+    int device = get_device(cpu);
+    if (device < 0 || !cpu_devices[cpu].lower)
+    {
+        return;
+    }
+    /* only the first of the threads sharing the core lowers it */
+    if (atomic_fetch_add(&cpu_devices[cpu].waiting, 1) == 0 &&
+        interface->set_frequency(device, low_setting) != 0)
+    {
+        atomic_fetch_sub(&cpu_devices[cpu].waiting, 1);
+        return;
+    }
+    lowered_cpu = cpu;
+}
+
+void barrier_freq_wait_end(const void *key, uint64_t wait_ns)
+{
+    if (lowered_cpu >= 0)
+    {
+        /* the thread may have migrated, the core it lowered is restored in any case */
+        struct cpu_device *cpu_device = &cpu_devices[lowered_cpu];
+        if (sched_getcpu() != lowered_cpu)
+        {
+            llog(LOG_DEBUG, "barrier_freq: thread migrated from cpu %d during a wait", lowered_cpu);
+        }
+        if (atomic_fetch_sub(&cpu_device->waiting, 1) == 1)
+        {
+            interface->set_frequency(cpu_device->device, cpu_device->restore_setting);
+        }
+        lowered_cpu = -1;
+    }
+    struct barrier_history *barrier = history_slot(key);
+    if (barrier->key != key)
+    {
+        barrier->key = key;
+        barrier->avg_wait_ns = wait_ns;
+    }
+    else
+    {
+        barrier->avg_wait_ns = (3 * barrier->avg_wait_ns + wait_ns) / 4;
+    }
+}
+
+void barrier_freq_fini()
+{
+    if (!enabled)
+    {
+        return;
+    }
+    enabled = 0;
+    /* cores lowered by threads still waiting in a barrier, e.g. at exit, are restored before
+     * their settings are freed */
+    for (int cpu = 0; cpu < num_cpus; cpu++)
+    {
+        if (atomic_load(&cpu_devices[cpu].state) == DEVICE_READY &&
+            atomic_load(&cpu_devices[cpu].waiting) > 0)
+        {
+            llog(LOG_DEBUG, "barrier_freq: restoring cpu %d lowered during finalization", cpu);
+            interface->set_frequency(cpu_devices[cpu].device, cpu_devices[cpu].restore_setting);
+        }
+    }
+    int count = atomic_load(&num_freq_settings);
+    for (int i = 0; i < count; i++)
+    {
+        interface->unprepare_set_frequency(freq_settings[i].setting);
+    }
+    for (int cpu = 0; cpu < num_cpus; cpu++)
+    {
+        if (atomic_load(&cpu_devices[cpu].state) == DEVICE_READY)
+        {
+            interface->close_device(cpu, cpu_devices[cpu].device);
+        }
+    }
+    interface->finalize();
+    free(cpu_devices);
+}
@@ -0,0 +1,587 @@
+/*
+ * This file is part of the Score-P software (http://www.score-p.org)
+ *
+ * Copyright (c) 2015, Technische Universität München, Germany
+ *
+ * This software may be modified and distributed under the terms of
+ * a BSD-style license.  See the COPYING file in the package base
+ * directory for details.
+ *
+ *
+ * INFO:
+ *
+ * Optional OMPT tool of the OpenMP tuning plugin. Records per parallel region (identified by
+ * its codeptr) the number of invocations, the team size, the wall time and, per thread, the
+ * work time and the time spent waiting in barriers.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <omp-tools.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "OpenMPTP.h"
+
+/* power of two, distinct parallel regions recorded per thread */
+#define REGION_TABLE_SIZE 512
+
+#define DEFAULT_OUTPUT "openmptp_regions.csv"
+
+/**
+ * Record of one parallel region on one thread. Only the owning thread writes it, so no atomics
+ * are needed. 64 byte, one cache line.
+ */
+struct region_entry
+{
+    const void *codeptr;
+    uint64_t regions;        /**< parallel regions started by this thread */
+    uint64_t tasks;          /**< implicit tasks executed by this thread */
+    uint64_t wall_ns;        /**< wall time of the regions started by this thread */
+    uint64_t work_ns;        /**< time the implicit tasks spent outside of barriers */
+    uint64_t wait_ns;        /**< time waited in barriers during the implicit tasks */
+    uint64_t work_begin;     /**< start of the task or end of the last barrier */
+    uint64_t parallel_begin; /**< start of the running parallel region */
+};
+
+/**
+ * Per-thread buffer. Allocated cache line aligned on the first callback of a thread and never
+ * freed, so it can be aggregated after the thread ended.
+ */
+struct region_table
+{
+    _Alignas(64) struct region_table *next;
+    int thread_num;
+    uint64_t dropped; /**< events lost because the table was full */
+    struct region_entry entries[REGION_TABLE_SIZE];
+};
+
+static _Atomic(struct region_table *) region_tables;
+static atomic_int num_region_tables;
+static __thread struct region_table *own_table;
+static __thread uint64_t wait_begin;
+
+static int active;
+static int recording; /**< region records are written at the end */
+static atomic_flag dumped = ATOMIC_FLAG_INIT;
+static char output_file[PATH_MAX];
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static struct region_table *create_table()
+{
+    struct region_table *table = aligned_alloc(64, sizeof(struct region_table));
+    if (table == NULL)
+    {
+        return NULL;
+    }
+    memset(table, 0, sizeof(struct region_table));
+    table->thread_num = atomic_fetch_add(&num_region_tables, 1);
+    table->next = atomic_load(&region_tables);
+    while (!atomic_compare_exchange_weak(&region_tables, &table->next, table))
+    {
+    }
+    return table;
+}
+
+/**
+ * Finds or creates the entry of codeptr in the table of the calling thread.
+ *
+ * @return the entry, NULL if the table is full
+ */
+static struct region_entry *lookup_entry(const void *codeptr)
+{
+    struct region_table *table = own_table;
+    if (table == NULL)
+    {
+        table = own_table = create_table();
+        if (table == NULL)
+        {
+            return NULL;
+        }
+    }
+    uintptr_t hash = ((uintptr_t) codeptr * 0x9E3779B97F4A7C15ull) >> 32;
+    for (int i = 0; i < REGION_TABLE_SIZE; i++)
+    {
+        struct region_entry *entry = &table->entries[(hash + i) & (REGION_TABLE_SIZE - 1)];
+        if (entry->codeptr == codeptr)
+        {
+            return entry;
+        }
+        if (entry->codeptr == NULL)
+        {
+            entry->codeptr = codeptr;
+            return entry;
+        }
+    }
+    table->dropped++;
+    return NULL;
+}
+
+/*
+ * Without recording, the callbacks neither allocate tables nor read clocks. parallel_data and
+ * task_data then carry the codeptr of the parallel region instead of its entry, which identifies
+ * implicit barriers without codeptr for the barrier frequency lowering.
+ */
+
+static void on_parallel_begin(ompt_data_t *encountering_task_data,
+    const ompt_frame_t *encountering_task_frame, ompt_data_t *parallel_data,
+    unsigned int requested_parallelism, int flags, const void *codeptr_ra)
+{
+    if (autotune_enabled())
+    {
+        autotune_parallel_begin(codeptr_ra);
+    }
+    if (!recording)
+    {
+        parallel_data->ptr = (void *) codeptr_ra;
+        return;
+    }
+    struct region_entry *entry = lookup_entry(codeptr_ra);
+    parallel_data->ptr = entry;
+    if (entry != NULL)
+    {
+        entry->parallel_begin = now_ns();
+    }
+}
+
+static void on_parallel_end(ompt_data_t *parallel_data, ompt_data_t *encountering_task_data,
+    int flags, const void *codeptr_ra)
+{
+    struct region_entry *entry = recording ? parallel_data->ptr : NULL;
+    if (entry != NULL)
+    {
+        entry->wall_ns += now_ns() - entry->parallel_begin;
+        entry->regions++;
+    }
+    if (autotune_enabled())
+    {
+        autotune_parallel_end();
+    }
+}
+
+static void on_implicit_task(ompt_scope_endpoint_t endpoint, ompt_data_t *parallel_data,
+    ompt_data_t *task_data, unsigned int actual_parallelism, unsigned int index, int flags)
+{
+    if (flags & ompt_task_initial)
+    {
+        return;
+    }
+    if (!recording)
+    {
+        if (endpoint == ompt_scope_begin)
+        {
+            task_data->ptr = parallel_data != NULL ? parallel_data->ptr : NULL;
+        }
+        return;
+    }
+    if (endpoint == ompt_scope_begin)
+    {
+        struct region_entry *entry = NULL;
+        struct region_entry *region = parallel_data != NULL ? parallel_data->ptr : NULL;
+        if (region != NULL)
+        {
+            /* the primary thread finds its own entry again, workers their one */
+            entry = lookup_entry(region->codeptr);
+        }
+        task_data->ptr = entry;
+        if (entry != NULL)
+        {
+            entry->work_begin = now_ns();
+            entry->tasks++;
+        }
+    }
+    /*
+     * Nothing is recorded at the end of the implicit task: it follows the implicit barrier
+     * immediately, so the work is complete at the begin of the last barrier wait. This saves
+     * one clock read per thread and region.
+     */
+}
+
+static void on_sync_region_wait(ompt_sync_region_t kind, ompt_scope_endpoint_t endpoint,
+    ompt_data_t *parallel_data, ompt_data_t *task_data, const void *codeptr_ra)
+{
+    switch (kind)
+    {
+        case ompt_sync_region_barrier:
+        case ompt_sync_region_barrier_implicit:
+        case ompt_sync_region_barrier_explicit:
+        case ompt_sync_region_barrier_implementation:
+        case ompt_sync_region_barrier_implicit_workshare:
+        case ompt_sync_region_barrier_implicit_parallel:
+            break;
+        default:
+            return;
+    }
+    void *task_ptr = task_data != NULL ? task_data->ptr : NULL;
+    struct region_entry *entry = recording ? task_ptr : NULL;
+    /* implicit barriers may have no codeptr, the parallel region identifies them as well */
+    const void *barrier = codeptr_ra != NULL ? codeptr_ra : task_ptr;
+    int lower_freq = barrier != NULL && barrier_freq_enabled();
+    if (entry == NULL && !lower_freq)
+    {
+        return;
+    }
+    uint64_t now = now_ns();
+    if (endpoint == ompt_scope_begin)
+    {
+        wait_begin = now;
+        if (entry != NULL)
+        {
+            entry->work_ns += now - entry->work_begin;
+        }
+        if (lower_freq)
+        {
+            barrier_freq_wait_begin(barrier);
+        }
+    }
+    else if (endpoint == ompt_scope_end)
+    {
+        if (lower_freq)
+        {
+            barrier_freq_wait_end(barrier, now - wait_begin);
+        }
+        if (entry != NULL)
+        {
+            entry->wait_ns += now - wait_begin;
+            entry->work_begin = now;
+        }
+    }
+}
+
+static int register_callback(
+    ompt_set_callback_t set_callback, ompt_callbacks_t event, ompt_callback_t callback)
+{
+    ompt_set_result_t result = set_callback(event, callback);
+    if (result == ompt_set_error || result == ompt_set_never)
+    {
+        llog(LOG_WARN, "OMPT callback %d is not supported by the OpenMP runtime", event);
+        return -1;
+    }
+    return 0;
+}
+
+static int ompt_tool_initialize(
+    ompt_function_lookup_t lookup, int initial_device_num, ompt_data_t *tool_data)
+{
+    ompt_set_callback_t set_callback = (ompt_set_callback_t) lookup("ompt_set_callback");
+    if (set_callback == NULL)
+    {
+        llog(LOG_WARN, "OMPT: ompt_set_callback not found, region recording disabled");
+        return 0;
+    }
+    int error = 0;
+    error |= register_callback(
+        set_callback, ompt_callback_parallel_begin, (ompt_callback_t) on_parallel_begin);
+    error |= register_callback(
+        set_callback, ompt_callback_parallel_end, (ompt_callback_t) on_parallel_end);
+    /* the autotuner alone only needs the parallel regions */
+    if (recording || barrier_freq_enabled())
+    {
+        error |= register_callback(
+            set_callback, ompt_callback_implicit_task, (ompt_callback_t) on_implicit_task);
+        error |= register_callback(set_callback, ompt_callback_sync_region_wait,
+            (ompt_callback_t) on_sync_region_wait);
+    }
+    if (error != 0)
+    {
+        llog(LOG_WARN, "OMPT: not all callbacks registered, recorded times may be incomplete");
+    }
+    active = 1;
+    if (recording)
+    {
+        llog(LOG_INFO, "OMPT: recording parallel regions to %s", output_file);
+    }
+    /* returning non-zero keeps the tool active */
+    return 1;
+}
+
+static void ompt_tool_finalize(ompt_data_t *tool_data)
+{
+    ompt_regions_dump();
+    autotune_save();
+    barrier_freq_fini();
+    active = 0;
+}
+
+/**
+ * Inserts the MPI rank, taken from the environment of the common launchers, or the pid before
+ * the extension of the file name, so the processes of a job do not overwrite each other's file.
+ */
+static void set_output_name(const char *name)
+{
+    static const char *rank_vars[] = { "OMPI_COMM_WORLD_RANK", "PMI_RANK", "PMIX_RANK",
+        "SLURM_PROCID", NULL };
+    long id = getpid();
+    for (int i = 0; rank_vars[i] != NULL; i++)
+    {
+        const char *rank = getenv(rank_vars[i]);
+        if (rank != NULL && rank[0] != '\0')
+        {
+            id = strtol(rank, NULL, 10);
+            break;
+        }
+    }
+    const char *slash = strrchr(name, '/');
+    const char *dot = strrchr(name, '.');
+    if (dot == NULL || (slash != NULL && dot < slash))
+    {
+        dot = name + strlen(name);
+    }
+    snprintf(output_file, sizeof(output_file), "%.*s.%ld%s", (int) (dot - name), name, id, dot);
+}
+
+/**
+ * Entry point the OpenMP runtime looks for when it starts. The plugin only registers as tool if
+ * region recording, autotuning or barrier frequency lowering is enabled, otherwise the runtime
+ * continues its tool search.
+ */
+ompt_start_tool_result_t *ompt_start_tool(unsigned int omp_version, const char *runtime_version)
+{
+    static ompt_start_tool_result_t result = {
+        .initialize = &ompt_tool_initialize,
+        .finalize = &ompt_tool_finalize,
+        .tool_data = {.value = 0},
+    };
+    const char *enabled = getenv("SCOREP_TUNING_OPENMPTP_PLUGIN_OMPT");
+    recording = enabled != NULL && strcmp(enabled, "1") == 0;
+    autotune_init();
+    barrier_freq_init();
+    if (!recording && !autotune_enabled() && !barrier_freq_enabled())
+    {
+        return NULL;
+    }
+    const char *output = getenv("SCOREP_TUNING_OPENMPTP_PLUGIN_OMPT_OUTPUT");
+    if (output == NULL || output[0] == '\0')
+    {
+        output = DEFAULT_OUTPUT;
+    }
+    set_output_name(output);
+    llog(LOG_DEBUG, "OMPT: runtime %s, OpenMP version %u", runtime_version, omp_version);
+    return &result;
+}
+
+int ompt_regions_active()
+{
+    return active;
+}
+
+/**
+ * Sum of one parallel region over all threads.
+ */
+struct region_summary
+{
+    const void *codeptr;
+    uint64_t regions;
+    uint64_t tasks;
+    uint64_t wall_ns;
+    uint64_t work_min_ns;
+    uint64_t work_max_ns;
+    uint64_t work_sum_ns;
+    uint64_t wait_ns;
+    int threads;
+};
+
+static int compare_summary(const void *a, const void *b)
+{
+    const struct region_summary *sa = a;
+    const struct region_summary *sb = b;
+    return (sa->wall_ns < sb->wall_ns) - (sa->wall_ns > sb->wall_ns);
+}
+
+/**
+ * Merges the entries of all threads by codeptr.
+ *
+ * @return array sorted by wall time, descending; to be freed by the caller
+ */
+static struct region_summary *summarize(int *num_summaries)
+{
+    int capacity = 64;
+    int count = 0;
+    struct region_summary *summaries = calloc(capacity, sizeof(struct region_summary));
+    for (struct region_table *table = atomic_load(&region_tables);
+         table != NULL && summaries != NULL; table = table->next)
+    {
+        if (table->dropped != 0)
+        {
+            llog(LOG_WARN, "OMPT: thread %d recorded more than %d regions, %lu events lost",
+                table->thread_num, REGION_TABLE_SIZE, (unsigned long) table->dropped);
+        }
+        for (int i = 0; i < REGION_TABLE_SIZE; i++)
+        {
+            const struct region_entry *entry = &table->entries[i];
+            if (entry->codeptr == NULL || (entry->tasks == 0 && entry->regions == 0))
+            {
+                continue;
+            }
+            int s = 0;
+            while (s < count && summaries[s].codeptr != entry->codeptr)
+            {
+                s++;
+            }
+            if (s == count)
+            {
+                if (count == capacity)
+                {
+                    capacity *= 2;
+                    struct region_summary *grown =
+                        realloc(summaries, capacity * sizeof(struct region_summary));
+                    if (grown == NULL)
+                    {
+                        break;
+                    }
+                    summaries = grown;
+                }
+                memset(&summaries[s], 0, sizeof(struct region_summary));
+                summaries[s].codeptr = entry->codeptr;
+                summaries[s].work_min_ns = UINT64_MAX;
+                count++;
+            }
+            struct region_summary *summary = &summaries[s];
+            uint64_t work = entry->work_ns;
+            summary->regions += entry->regions;
+            summary->tasks += entry->tasks;
+            summary->wall_ns += entry->wall_ns;
+            summary->wait_ns += entry->wait_ns;
+            if (entry->tasks != 0)
+            {
+                summary->work_sum_ns += work;
+                summary->work_min_ns = work < summary->work_min_ns ? work : summary->work_min_ns;
+                summary->work_max_ns = work > summary->work_max_ns ? work : summary->work_max_ns;
+                summary->threads++;
+            }
+        }
+    }
+    if (summaries != NULL)
+    {
+        qsort(summaries, count, sizeof(struct region_summary), compare_summary);
+    }
+    *num_summaries = count;
+    return summaries;
+}
+
+/**
+ * Load imbalance of a region: maximum work time of a thread divided by the average.
+ * 1.0 is perfectly balanced.
+ */
+static double imbalance(const struct region_summary *summary)
+{
+    if (summary->threads == 0 || summary->work_sum_ns == 0)
+    {
+        return 1.0;
+    }
+    return (double) summary->work_max_ns * summary->threads / summary->work_sum_ns;
+}
+
+static double avg_team_size(const struct region_summary *summary)
+{
+    return summary->regions != 0 ? (double) summary->tasks / summary->regions : 0.0;
+}
+
+static void write_csv(FILE *out, const struct region_summary *summaries, int count)
+{
+    fprintf(out, "codeptr,thread,invocations,avg_team_size,wall_ns,imbalance,tasks,work_ns,"
+                 "wait_ns\n");
+    for (int s = 0; s < count; s++)
+    {
+        const struct region_summary *summary = &summaries[s];
+        for (struct region_table *table = atomic_load(&region_tables); table != NULL;
+             table = table->next)
+        {
+            for (int i = 0; i < REGION_TABLE_SIZE; i++)
+            {
+                const struct region_entry *entry = &table->entries[i];
+                if (entry->codeptr != summary->codeptr || entry->tasks == 0)
+                {
+                    continue;
+                }
+                fprintf(out, "%p,%d,%lu,%.2f,%lu,%.3f,%lu,%lu,%lu\n", summary->codeptr,
+                    table->thread_num, (unsigned long) summary->regions, avg_team_size(summary),
+                    (unsigned long) summary->wall_ns, imbalance(summary),
+                    (unsigned long) entry->tasks, (unsigned long) entry->work_ns,
+                    (unsigned long) entry->wait_ns);
+            }
+        }
+    }
+}
+
+static void write_json(FILE *out, const struct region_summary *summaries, int count)
+{
+    fprintf(out, "{\n  \"regions\": [");
+    for (int s = 0; s < count; s++)
+    {
+        const struct region_summary *summary = &summaries[s];
+        fprintf(out,
+            "%s\n    {\"codeptr\": \"%p\", \"invocations\": %lu, \"avg_team_size\": %.2f, "
+            "\"wall_ns\": %lu, \"wait_ns\": %lu, \"imbalance\": %.3f, \"threads\": [",
+            s == 0 ? "" : ",", summary->codeptr, (unsigned long) summary->regions,
+            avg_team_size(summary), (unsigned long) summary->wall_ns,
+            (unsigned long) summary->wait_ns, imbalance(summary));
+        int first = 1;
+        for (struct region_table *table = atomic_load(&region_tables); table != NULL;
+             table = table->next)
+        {
+            for (int i = 0; i < REGION_TABLE_SIZE; i++)
+            {
+                const struct region_entry *entry = &table->entries[i];
+                if (entry->codeptr != summary->codeptr || entry->tasks == 0)
+                {
+                    continue;
+                }
+                fprintf(out,
+                    "%s\n      {\"thread\": %d, \"tasks\": %lu, \"work_ns\": %lu, "
+                    "\"wait_ns\": %lu}",
+                    first ? "" : ",", table->thread_num, (unsigned long) entry->tasks,
+                    (unsigned long) entry->work_ns, (unsigned long) entry->wait_ns);
+                first = 0;
+            }
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void ompt_regions_dump()
+{
+    if (!active || !recording || atomic_flag_test_and_set(&dumped))
+    {
+        return;
+    }
+    int count = 0;
+    struct region_summary *summaries = summarize(&count);
+    if (summaries == NULL)
+    {
+        llog(LOG_WARN, "OMPT: out of memory, region records not written");
+        return;
+    }
+    FILE *out = fopen(output_file, "w");
+    if (out == NULL)
+    {
+        llog(LOG_WARN, "OMPT: could not open %s", output_file);
+        free(summaries);
+        return;
+    }
+    size_t len = strlen(output_file);
+    if (len > 5 && strcmp(output_file + len - 5, ".json") == 0)
+    {
+        write_json(out, summaries, count);
+    }
+    else
+    {
+        write_csv(out, summaries, count);
+    }
+    fclose(out);
+    llog(LOG_INFO, "OMPT: wrote %d parallel regions to %s", count, output_file);
+    free(summaries);
+}
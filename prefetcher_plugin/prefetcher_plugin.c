@@ -0,0 +1,462 @@
+/**
+ * @file prefetcher_plugin.c
+ *
+ * @brief Tuning Plugin for the Intel hardware prefetchers (MSR 0x1A4)
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <scorep/rrl_tuning_plugins.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define PLUGIN_NAME "PREFETCHER_TP"
+
+/**
+ * MSR_MISC_FEATURE_CONTROL. A set bit disables the corresponding prefetcher:
+ *
+ *  * bit 0: L2 hardware prefetcher
+ *  * bit 1: L2 adjacent cache line prefetcher
+ *  * bit 2: DCU prefetcher
+ *  * bit 3: DCU IP prefetcher
+ */
+#define MSR_MISC_FEATURE_CONTROL 0x1A4
+#define PREFETCHER_MASK_BITS 0xFULL
+
+static long available_cores;
+static cpu_set_t *responsible_cpus;
+static size_t responsible_cpus_size;
+
+static int *msr_fds;
+static uint64_t *default_msr_values;
+
+typedef enum { LOG_VERBOSE, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_INVALID } log_level;
+
+/**
+ * log function.
+ *
+ * Prints messages depending on the entry in SCOREP_TUNING_PREFETCHER_PLUGIN_VERBOSE.
+ *
+ * Currently implemented log levels are:
+ *
+ *	* LOG_VERBOSE
+ *	* LOG_WARN
+ *	* LOG_INFO
+ *	* LOG_DEBUG
+ *
+ * @param[in] msg_level level of message
+ * @param[in] message_fmt printf like message
+ * @param[in] ... printf like parameters for the message
+ */
+void llog(log_level msg_level, const char *message_fmt, ...)
+{
+    static char *level_str = NULL;
+    static log_level level = LOG_INVALID;
+    if (level == LOG_INVALID)
+    {
+        level_str = getenv("SCOREP_TUNING_PREFETCHER_PLUGIN_VERBOSE");
+        if (level_str == NULL)
+        {
+            level = LOG_WARN;
+        }
+        else if (strcmp(level_str, "DEBUG") == 0)
+        {
+            level = LOG_DEBUG;
+        }
+        else if (strcmp(level_str, "INFO") == 0)
+        {
+            level = LOG_INFO;
+        }
+        else if (strcmp(level_str, "WARN") == 0)
+        {
+            level = LOG_WARN;
+        }
+        else if (strcmp(level_str, "VERBOSE") == 0)
+        {
+            level = LOG_VERBOSE;
+        }
+        else
+        {
+            level = LOG_WARN;
+        }
+    }
+    if (msg_level <= level)
+    {
+        char *output_fmt = (char *) malloc(strlen(message_fmt) + strlen(PLUGIN_NAME) + 5);
+        strcpy(output_fmt, "[");
+        strcpy(output_fmt + 1, PLUGIN_NAME);
+        strcpy(output_fmt + 1 + strlen(PLUGIN_NAME), "]");
+        strcpy(output_fmt + 2 + strlen(PLUGIN_NAME), message_fmt);
+        strcpy(output_fmt + 2 + strlen(PLUGIN_NAME) + strlen(message_fmt), "\n");
+        va_list args;
+        va_start(args, message_fmt);
+        vprintf(output_fmt, args);
+        va_end(args);
+    }
+}
+
+/**
+ * Opens the msr device of a cpu.
+ *
+ * Tries msr-safe first and falls back to the plain msr driver.
+ *
+ * @param cpu cpu to open
+ * @return file descriptor or -errno on failure
+ */
+static int open_msr(int cpu)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/dev/cpu/%d/msr_safe", cpu);
+    int fd = open(path, O_RDWR);
+    if (fd >= 0)
+    {
+        return fd;
+    }
+    snprintf(path, sizeof(path), "/dev/cpu/%d/msr", cpu);
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        return -errno;
+    }
+    return fd;
+}
+
+static int read_msr(int fd, uint64_t *value)
+{
+    if (pread(fd, value, sizeof(uint64_t), MSR_MISC_FEATURE_CONTROL) != sizeof(uint64_t))
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+static int write_msr(int fd, uint64_t value)
+{
+    if (pwrite(fd, &value, sizeof(uint64_t), MSR_MISC_FEATURE_CONTROL) != sizeof(uint64_t))
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Opens the msr devices of all responsible cpus which are not opened yet, and caches the
+ * original content of MSR 0x1A4 so it can be restored at fini().
+ *
+ * If a cpu can not be opened, it is removed from the responsible cpus and will not be tuned.
+ */
+static void init_responsible_cpus()
+{
+    for (int cpu = 0; cpu < available_cores; cpu++)
+    {
+        if (CPU_ISSET_S(cpu, responsible_cpus_size, responsible_cpus) && msr_fds[cpu] < 0)
+        {
+            llog(LOG_DEBUG, "init cpu %d", cpu);
+            int fd = open_msr(cpu);
+            if (fd < 0)
+            {
+                llog(LOG_WARN, "could not open msr for cpu %d: %s", cpu, strerror(-fd));
+                CPU_CLR_S(cpu, responsible_cpus_size, responsible_cpus);
+                continue;
+            }
+            int rt = read_msr(fd, &default_msr_values[cpu]);
+            if (rt < 0)
+            {
+                llog(LOG_WARN, "could not read MSR 0x%x for cpu %d: %s", MSR_MISC_FEATURE_CONTROL,
+                    cpu, strerror(-rt));
+                close(fd);
+                CPU_CLR_S(cpu, responsible_cpus_size, responsible_cpus);
+                continue;
+            }
+            msr_fds[cpu] = fd;
+            llog(LOG_DEBUG, "default prefetcher mask for cpu %d is 0x%llx", cpu,
+                (unsigned long long) (default_msr_values[cpu] & PREFETCHER_MASK_BITS));
+        }
+    }
+}
+
+/**
+ * Adds the affinity of the thread tid to the responsible cpus.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int add_affinity(pid_t tid)
+{
+    cpu_set_t *set = CPU_ALLOC(available_cores);
+    size_t set_size = CPU_ALLOC_SIZE(available_cores);
+
+    if (set == NULL)
+    {
+        llog(LOG_WARN, "error CPU_ALLOC");
+        return -1;
+    }
+    CPU_ZERO_S(set_size, set);
+    if (sched_getaffinity(tid, set_size, set) == -1)
+    {
+        llog(LOG_WARN, "sched_getaffinity failed: %s (%d)", strerror(errno), errno);
+        CPU_FREE(set);
+        return -1;
+    }
+    CPU_OR_S(responsible_cpus_size, responsible_cpus, set, responsible_cpus);
+    CPU_FREE(set);
+    return 0;
+}
+
+/**
+ * Frees the per cpu state, so fini() and the callbacks do nothing after a failed init().
+ */
+static void free_state()
+{
+    free(msr_fds);
+    free(default_msr_values);
+    if (responsible_cpus != NULL)
+    {
+        CPU_FREE(responsible_cpus);
+    }
+    msr_fds = NULL;
+    default_msr_values = NULL;
+    responsible_cpus = NULL;
+    available_cores = 0;
+}
+
+/**
+ * Initialize the plugin
+ *
+ * Gets the cpus this process is bound to and caches their prefetcher settings.
+ *
+ * @return 0 at success, -1 at failure
+ */
+int32_t init()
+{
+    llog(LOG_DEBUG, "GIT revision: %s", GIT_REV);
+    llog(LOG_VERBOSE, "PREFETCHER tuning plugin: initializing");
+
+    available_cores = sysconf(_SC_NPROCESSORS_CONF);
+    llog(LOG_INFO, "got %ld cpus", available_cores);
+    if (available_cores <= 0)
+    {
+        return -1;
+    }
+
+    msr_fds = malloc(available_cores * sizeof(int));
+    default_msr_values = calloc(available_cores, sizeof(uint64_t));
+    if (msr_fds == NULL || default_msr_values == NULL)
+    {
+        int err = errno;
+        llog(LOG_WARN, "memory failure %s", strerror(err));
+        free_state();
+        return -err;
+    }
+    for (int cpu = 0; cpu < available_cores; cpu++)
+    {
+        msr_fds[cpu] = -1;
+    }
+
+    responsible_cpus = CPU_ALLOC(available_cores);
+    responsible_cpus_size = CPU_ALLOC_SIZE(available_cores);
+    if (responsible_cpus == NULL)
+    {
+        llog(LOG_WARN, "error CPU_ALLOC");
+        free_state();
+        return -1;
+    }
+    CPU_ZERO_S(responsible_cpus_size, responsible_cpus);
+
+    if (add_affinity(getpid()) != 0)
+    {
+        free_state();
+        return -1;
+    }
+    init_responsible_cpus();
+
+    return 0;
+}
+
+/**
+ * Gets the cpu affinity of the CPU Thread and adds it to the responsible cpus list
+ */
+void create_location(RRL_LocationType location_type, uint32_t location_id)
+{
+    llog(LOG_DEBUG, "create_location for location %u with typ %u ", location_id, location_type);
+    if (location_type == RRL_LOCATION_TYPE_CPU_THREAD && responsible_cpus != NULL)
+    {
+        pid_t tid = syscall(SYS_gettid);
+        if (add_affinity(tid) == 0)
+        {
+            init_responsible_cpus();
+        }
+    }
+}
+
+void delete_location(RRL_LocationType location_type, uint32_t location_id)
+{
+    llog(LOG_DEBUG, "delete_location for location %u with typ %u ", location_id, location_type);
+}
+
+/**
+ * finalising the plugin
+ *
+ * restores the original prefetcher settings of all responsible cpus.
+ */
+void fini()
+{
+    llog(LOG_INFO, "PREFETCHER tuning plugin: finalising");
+    for (int cpu = 0; cpu < available_cores; cpu++)
+    {
+        if (msr_fds[cpu] >= 0)
+        {
+            int rt = write_msr(msr_fds[cpu], default_msr_values[cpu]);
+            if (rt < 0)
+            {
+                llog(LOG_WARN, "could not restore MSR 0x%x for cpu %d: %s",
+                    MSR_MISC_FEATURE_CONTROL, cpu, strerror(-rt));
+            }
+            close(msr_fds[cpu]);
+            msr_fds[cpu] = -1;
+        }
+    }
+    free_state();
+}
+
+/**
+ * Set the prefetcher mask
+ *
+ * Does a read-modify-write of the lower four bits of MSR 0x1A4 on every responsible cpu. A set
+ * bit disables the corresponding prefetcher. The MSR is only written if the bits change.
+ * A value of -1 restores the settings found at init.
+ *
+ * @param[in] new_settings new prefetcher mask (0 - 15) or -1
+ * @return 0 on success or <0 on failure
+ */
+static int scorep_set_prefetcher_mask(int new_settings)
+{
+    int rt = 0;
+
+    if (new_settings != -1 && (new_settings < 0 || (uint64_t) new_settings > PREFETCHER_MASK_BITS))
+    {
+        llog(LOG_WARN, "Invalid prefetcher mask %d received, has to be between 0 and 15",
+            new_settings);
+        return -1;
+    }
+
+    for (int cpu = 0; cpu < available_cores; cpu++)
+    {
+        if (CPU_ISSET_S(cpu, responsible_cpus_size, responsible_cpus))
+        {
+            uint64_t old_value;
+            uint64_t new_value;
+            int err = read_msr(msr_fds[cpu], &old_value);
+            if (err < 0)
+            {
+                llog(LOG_WARN, "could not read MSR 0x%x for cpu %d: %s", MSR_MISC_FEATURE_CONTROL,
+                    cpu, strerror(-err));
+                rt = err;
+                continue;
+            }
+            if (new_settings == -1)
+            {
+                new_value = (old_value & ~PREFETCHER_MASK_BITS) |
+                            (default_msr_values[cpu] & PREFETCHER_MASK_BITS);
+            }
+            else
+            {
+                new_value = (old_value & ~PREFETCHER_MASK_BITS) | (uint64_t) new_settings;
+            }
+            if (new_value == old_value)
+            {
+                continue;
+            }
+            err = write_msr(msr_fds[cpu], new_value);
+            if (err < 0)
+            {
+                llog(LOG_WARN, "could not write MSR 0x%x for cpu %d: %s",
+                    MSR_MISC_FEATURE_CONTROL, cpu, strerror(-err));
+                rt = err;
+                continue;
+            }
+            llog(LOG_DEBUG, "set prefetcher mask of cpu %d from 0x%llx to 0x%llx", cpu,
+                (unsigned long long) (old_value & PREFETCHER_MASK_BITS),
+                (unsigned long long) (new_value & PREFETCHER_MASK_BITS));
+        }
+    }
+    return rt;
+}
+
+/**
+ * returns the prefetcher mask of the first responsible cpu
+ *
+ * @return prefetcher mask or -1 on failure
+ */
+static int scorep_get_prefetcher_mask()
+{
+    for (int cpu = 0; cpu < available_cores; cpu++)
+    {
+        if (CPU_ISSET_S(cpu, responsible_cpus_size, responsible_cpus))
+        {
+            uint64_t value;
+            int err = read_msr(msr_fds[cpu], &value);
+            if (err < 0)
+            {
+                llog(LOG_WARN, "could not read MSR 0x%x for cpu %d: %s", MSR_MISC_FEATURE_CONTROL,
+                    cpu, strerror(-err));
+                continue;
+            }
+            return (int) (value & PREFETCHER_MASK_BITS);
+        }
+    }
+    return -1;
+}
+
+/**
+ * ScoreP array for plugin definitions
+ */
+static rrl_tuning_action_info return_values[] = {
+    {
+        .name = "PREFETCHER_MASK",
+        .current_config = &scorep_get_prefetcher_mask,
+        .enter_region_set_config = &scorep_set_prefetcher_mask,
+        .exit_region_set_config = &scorep_set_prefetcher_mask,
+    },
+    {
+        .name = NULL,
+        .current_config = NULL,
+        .enter_region_set_config = NULL,
+        .exit_region_set_config = NULL,
+    }};
+
+/**
+ * ScoreP function to get plugin definitions
+ *
+ * @param return return_values.
+ */
+rrl_tuning_action_info *get_tuning_info()
+{
+    return return_values;
+}
+
+/**
+ * Macro to setup the plugin
+ */
+RRL_TUNING_PLUGIN_ENTRY(prefetcher_plugin)
+{
+    /* Initialize info data (with zero) */
+    rrl_tuning_plugin_info info;
+    memset(&info, 0, sizeof(rrl_tuning_plugin_info));
+
+    /* Set up */
+    info.plugin_version = RRL_TUNING_PLUGIN_VERSION;
+    info.initialize = init;
+    info.get_tuning_info = get_tuning_info;
+    info.finalize = fini;
+    info.create_location = create_location;
+    info.delete_location = delete_location;
+    return info;
+}
@@ -0,0 +1,1093 @@
+/**
+ * @file resctrl_plugin.c
+ *
+ * @brief Tuning Plugin for Intel RDT cache allocation and memory bandwidth allocation
+ *
+ * At init a pool of resctrl groups is created, one for each combination of the configured
+ * LLC way counts and memory bandwidth percentages. The hardware configuration (schemata) of
+ * these groups is written once. Switching a setting only moves the registered threads to the
+ * matching group.
+ *
+ * The groups are named after their configuration only, so all processes on a node, e.g. the
+ * MPI ranks, share one pool. Each process holds a shared flock() on a lock file per group it
+ * uses; the last process that leaves a group removes it. Creating and removing groups is
+ * serialized by an exclusive flock() on a pool lock file.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <scorep/rrl_tuning_plugins.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define PLUGIN_NAME "RESCTRL_TP"
+#define DEFAULT_RESCTRL_ROOT "/sys/fs/resctrl"
+#define DEFAULT_LOCK_DIR "/tmp"
+#define MAX_DOMAINS 64
+#define MAX_POOL_VALUES 16
+
+struct resctrl_group
+{
+    int ways;
+    int mba;
+    /** lock file with the shared flock() of this process */
+    int lock_fd;
+    char path[PATH_MAX / 2 + 64];
+};
+
+static char resctrl_root[PATH_MAX / 2];
+static char lock_dir[PATH_MAX / 2];
+
+/* L3 cache allocation */
+static int l3_available;
+static int cbm_bits;
+static int min_cbm_bits = 1;
+static int l3_domains[MAX_DOMAINS];
+static int num_l3_domains;
+
+/* memory bandwidth allocation */
+static int mb_available;
+static int min_bandwidth = 10;
+static int bandwidth_gran = 10;
+static int mb_domains[MAX_DOMAINS];
+static int num_mb_domains;
+
+static int num_closids;
+
+static struct resctrl_group *groups;
+static int num_groups;
+
+/* requested values, -1 means default */
+static int current_ways = -1;
+static int current_mba = -1;
+/* group the threads are in, -1 means the root group */
+static int current_group = -1;
+
+static pid_t *tids;
+static int num_tids;
+static int tids_capacity;
+static pthread_mutex_t resctrl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef enum { LOG_VERBOSE, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_INVALID } log_level;
+
+/**
+ * log function.
+ *
+ * Prints messages depending on the entry in SCOREP_TUNING_RESCTRL_PLUGIN_VERBOSE.
+ *
+ * Currently implemented log levels are:
+ *
+ *	* LOG_VERBOSE
+ *	* LOG_WARN
+ *	* LOG_INFO
+ *	* LOG_DEBUG
+ *
+ * @param[in] msg_level level of message
+ * @param[in] message_fmt printf like message
+ * @param[in] ... printf like parameters for the message
+ */
+void llog(log_level msg_level, const char *message_fmt, ...)
+{
+    static char *level_str = NULL;
+    static log_level level = LOG_INVALID;
+    if (level == LOG_INVALID)
+    {
+        level_str = getenv("SCOREP_TUNING_RESCTRL_PLUGIN_VERBOSE");
+        if (level_str == NULL)
+        {
+            level = LOG_WARN;
+        }
+        else if (strcmp(level_str, "DEBUG") == 0)
+        {
+            level = LOG_DEBUG;
+        }
+        else if (strcmp(level_str, "INFO") == 0)
+        {
+            level = LOG_INFO;
+        }
+        else if (strcmp(level_str, "WARN") == 0)
+        {
+            level = LOG_WARN;
+        }
+        else if (strcmp(level_str, "VERBOSE") == 0)
+        {
+            level = LOG_VERBOSE;
+        }
+        else
+        {
+            level = LOG_WARN;
+        }
+    }
+    if (msg_level <= level)
+    {
+        char *output_fmt = (char *) malloc(strlen(message_fmt) + strlen(PLUGIN_NAME) + 5);
+        strcpy(output_fmt, "[");
+        strcpy(output_fmt + 1, PLUGIN_NAME);
+        strcpy(output_fmt + 1 + strlen(PLUGIN_NAME), "]");
+        strcpy(output_fmt + 2 + strlen(PLUGIN_NAME), message_fmt);
+        strcpy(output_fmt + 2 + strlen(PLUGIN_NAME) + strlen(message_fmt), "\n");
+        va_list args;
+        va_start(args, message_fmt);
+        vprintf(output_fmt, args);
+        va_end(args);
+    }
+}
+
+/**
+ * Reads a single number from a file below the resctrl root.
+ *
+ * @param[in] file path relative to the resctrl root
+ * @param[in] base base of the number, e.g. 16 for cbm_mask
+ * @param[out] value the value read
+ * @return 0 on success, <0 on failure
+ */
+static int read_resctrl_long(const char *file, int base, long *value)
+{
+    char path[PATH_MAX];
+    char buf[64];
+
+    snprintf(path, sizeof(path), "%s/%s", resctrl_root, file);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return -errno;
+    }
+    if (fgets(buf, sizeof(buf), f) == NULL)
+    {
+        fclose(f);
+        return -EIO;
+    }
+    fclose(f);
+
+    char *end;
+    errno = 0;
+    *value = strtol(buf, &end, base);
+    if (errno != 0 || end == buf)
+    {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Collects the domain ids of a schemata line like "L3:0=fffff;1=fffff".
+ *
+ * @param[in] line schemata line without the resource prefix
+ * @param[out] domains found domain ids
+ * @return number of domains found
+ */
+static int parse_schemata_domains(const char *line, int *domains)
+{
+    int count = 0;
+    const char *pos = line;
+
+    while (*pos != '\0' && count < MAX_DOMAINS)
+    {
+        char *end;
+        long id = strtol(pos, &end, 10);
+        if (end == pos || *end != '=')
+        {
+            break;
+        }
+        domains[count++] = (int) id;
+        pos = strchr(end, ';');
+        if (pos == NULL)
+        {
+            break;
+        }
+        pos++;
+    }
+    return count;
+}
+
+/**
+ * Collects the domain ids and values of a schemata line like "L3:0=0000f;1=0000f".
+ *
+ * @param[in] line schemata line without the resource prefix
+ * @param[in] base base of the values, 16 for L3 and 10 for MB
+ * @param[out] domains found domain ids
+ * @param[out] values found values
+ * @return number of domains found
+ */
+static int parse_schemata_values(const char *line, int base, int *domains, long *values)
+{
+    int count = 0;
+    const char *pos = line;
+
+    while (*pos != '\0' && count < MAX_DOMAINS)
+    {
+        char *end;
+        long id = strtol(pos, &end, 10);
+        if (end == pos || *end != '=')
+        {
+            break;
+        }
+        domains[count] = (int) id;
+        values[count++] = strtol(end + 1, &end, base);
+        pos = strchr(end, ';');
+        if (pos == NULL)
+        {
+            break;
+        }
+        pos++;
+    }
+    return count;
+}
+
+/**
+ * Reads the domains of L3 and MB from the schemata of the root group.
+ *
+ * @return 0 on success, <0 on failure
+ */
+static int read_domains()
+{
+    char path[PATH_MAX];
+    char line[1024];
+
+    snprintf(path, sizeof(path), "%s/schemata", resctrl_root);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return -errno;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *pos = line;
+        while (*pos == ' ' || *pos == '\t')
+        {
+            pos++;
+        }
+        if (strncmp(pos, "L3:", 3) == 0)
+        {
+            num_l3_domains = parse_schemata_domains(pos + 3, l3_domains);
+        }
+        else if (strncmp(pos, "MB:", 3) == 0)
+        {
+            num_mb_domains = parse_schemata_domains(pos + 3, mb_domains);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Reads the capabilities of the resctrl file system from the info directory.
+ *
+ * @return 0 on success, <0 if neither L3 nor MB allocation is supported.
+ */
+static int read_resctrl_info()
+{
+    long value;
+    long closids = LONG_MAX;
+
+    if (read_resctrl_long("info/L3/cbm_mask", 16, &value) == 0 && value > 0)
+    {
+        l3_available = 1;
+        cbm_bits = __builtin_popcountl((unsigned long) value);
+        if (read_resctrl_long("info/L3/min_cbm_bits", 10, &value) == 0 && value > 0)
+        {
+            min_cbm_bits = (int) value;
+        }
+        if (read_resctrl_long("info/L3/num_closids", 10, &value) == 0 && value < closids)
+        {
+            closids = value;
+        }
+        llog(LOG_INFO, "L3 allocation: %d ways, at least %d", cbm_bits, min_cbm_bits);
+    }
+    if (read_resctrl_long("info/MB/min_bandwidth", 10, &value) == 0)
+    {
+        mb_available = 1;
+        min_bandwidth = (int) value;
+        if (read_resctrl_long("info/MB/bandwidth_gran", 10, &value) == 0 && value > 0)
+        {
+            bandwidth_gran = (int) value;
+        }
+        if (read_resctrl_long("info/MB/num_closids", 10, &value) == 0 && value < closids)
+        {
+            closids = value;
+        }
+        llog(LOG_INFO, "MB allocation: min %d %%, granularity %d %%", min_bandwidth,
+            bandwidth_gran);
+    }
+    if (!l3_available && !mb_available)
+    {
+        return -ENOTSUP;
+    }
+    num_closids = closids == LONG_MAX ? 0 : (int) closids;
+
+    int rt = read_domains();
+    if (rt < 0)
+    {
+        return rt;
+    }
+    if (num_l3_domains == 0)
+    {
+        l3_available = 0;
+    }
+    if (num_mb_domains == 0)
+    {
+        mb_available = 0;
+    }
+    return 0;
+}
+
+/**
+ * Parses a comma separated list of values from an environment variable.
+ *
+ * If the variable is not set the default values are used. The maximum value is always added,
+ * as it is used whenever the other dimension is tuned alone.
+ *
+ * @return number of values
+ */
+static int parse_pool_values(const char *env,
+    const int *defaults,
+    int num_defaults,
+    int max_value,
+    int *values)
+{
+    int count = 0;
+    const char *env_string = getenv(env);
+
+    if (env_string != NULL)
+    {
+        const char *pos = env_string;
+        while (*pos != '\0' && count < MAX_POOL_VALUES - 1)
+        {
+            char *end;
+            long value = strtol(pos, &end, 10);
+            if (end == pos)
+            {
+                llog(LOG_WARN, "Could not parse %s = \"%s\"", env, env_string);
+                break;
+            }
+            values[count++] = (int) value;
+            pos = *end == ',' ? end + 1 : end;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < num_defaults; i++)
+        {
+            values[count++] = defaults[i];
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (values[i] == max_value)
+        {
+            return count;
+        }
+    }
+    values[count++] = max_value;
+    return count;
+}
+
+/**
+ * Rounds a bandwidth percentage to the granularity supported by the hardware.
+ */
+static int round_bandwidth(int mba)
+{
+    mba = ((mba + bandwidth_gran - 1) / bandwidth_gran) * bandwidth_gran;
+    if (mba < min_bandwidth)
+    {
+        mba = min_bandwidth;
+    }
+    if (mba > 100)
+    {
+        mba = 100;
+    }
+    return mba;
+}
+
+/**
+ * Returns the capacity bit mask of a way count.
+ */
+static unsigned long ways_mask(int ways)
+{
+    return (ways >= (int) (sizeof(unsigned long) * 8)) ? ~0UL : (1UL << ways) - 1;
+}
+
+/**
+ * Writes the schemata of a group.
+ *
+ * @return 0 on success, <0 on failure
+ */
+static int write_schemata(const struct resctrl_group *group)
+{
+    char path[PATH_MAX];
+    char schemata[4096];
+    int len = 0;
+
+    if (l3_available)
+    {
+        unsigned long mask = ways_mask(group->ways);
+        len += snprintf(schemata + len, sizeof(schemata) - len, "L3:");
+        for (int i = 0; i < num_l3_domains; i++)
+        {
+            len += snprintf(schemata + len, sizeof(schemata) - len, "%s%d=%lx",
+                i == 0 ? "" : ";", l3_domains[i], mask);
+        }
+        len += snprintf(schemata + len, sizeof(schemata) - len, "\n");
+    }
+    if (mb_available)
+    {
+        len += snprintf(schemata + len, sizeof(schemata) - len, "MB:");
+        for (int i = 0; i < num_mb_domains; i++)
+        {
+            len += snprintf(schemata + len, sizeof(schemata) - len, "%s%d=%d",
+                i == 0 ? "" : ";", mb_domains[i], group->mba);
+        }
+        len += snprintf(schemata + len, sizeof(schemata) - len, "\n");
+    }
+
+    snprintf(path, sizeof(path), "%s/schemata", group->path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -errno;
+    }
+    if (write(fd, schemata, len) != len)
+    {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Checks whether the schemata of an existing group matches its configuration on all domains, so
+ * it can be shared.
+ *
+ * @return 1 if it matches, 0 otherwise
+ */
+static int schemata_matches(const struct resctrl_group *group)
+{
+    char path[PATH_MAX];
+    char line[1024];
+    int domains[MAX_DOMAINS];
+    long values[MAX_DOMAINS];
+    int l3_found = !l3_available;
+    int mb_found = !mb_available;
+    int matches = 1;
+
+    snprintf(path, sizeof(path), "%s/schemata", group->path);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *pos = line;
+        while (*pos == ' ' || *pos == '\t')
+        {
+            pos++;
+        }
+        int count;
+        long expected;
+        if (l3_available && strncmp(pos, "L3:", 3) == 0)
+        {
+            count = parse_schemata_values(pos + 3, 16, domains, values);
+            expected = (long) ways_mask(group->ways);
+            l3_found = count == num_l3_domains;
+        }
+        else if (mb_available && strncmp(pos, "MB:", 3) == 0)
+        {
+            count = parse_schemata_values(pos + 3, 10, domains, values);
+            expected = group->mba;
+            mb_found = count == num_mb_domains;
+        }
+        else
+        {
+            continue;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (values[i] != expected)
+            {
+                matches = 0;
+            }
+        }
+    }
+    fclose(f);
+    return matches && l3_found && mb_found;
+}
+
+/**
+ * Counts the control groups in the resctrl root, each of which uses a CLOSID.
+ */
+static int count_ctrl_groups()
+{
+    DIR *dir = opendir(resctrl_root);
+    int count = 0;
+    if (dir == NULL)
+    {
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char path[PATH_MAX];
+        struct stat st;
+        if (entry->d_name[0] == '.' || strcmp(entry->d_name, "info") == 0 ||
+            strcmp(entry->d_name, "mon_groups") == 0 || strcmp(entry->d_name, "mon_data") == 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", resctrl_root, entry->d_name);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+/**
+ * Opens a lock file in lock_dir and locks it.
+ *
+ * @param[in] name file name in lock_dir
+ * @param[in] operation LOCK_SH or LOCK_EX
+ * @return the file descriptor holding the lock, <0 on failure
+ */
+static int lock_file(const char *name, int operation)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", lock_dir, name);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        llog(LOG_WARN, "Could not open lock file %s: %s", path, strerror(errno));
+        return -errno;
+    }
+    if (flock(fd, operation) != 0)
+    {
+        int err = -errno;
+        llog(LOG_WARN, "Could not lock %s: %s", path, strerror(errno));
+        close(fd);
+        return err;
+    }
+    return fd;
+}
+
+/**
+ * Creates or shares a single group of the pool. An existing group is shared if its schemata
+ * matches. A new group needs a free CLOSID. Has to be called with the pool lock held.
+ */
+static void create_group(int new_ways, int new_mba)
+{
+    if (l3_available && (new_ways < min_cbm_bits || new_ways > cbm_bits))
+    {
+        llog(LOG_WARN, "Ignoring LLC_WAYS %d, has to be between %d and %d", new_ways,
+            min_cbm_bits, cbm_bits);
+        return;
+    }
+    for (int g = 0; g < num_groups; g++)
+    {
+        if (groups[g].ways == new_ways && groups[g].mba == new_mba)
+        {
+            return;
+        }
+    }
+
+    struct resctrl_group *group = &groups[num_groups];
+    group->ways = new_ways;
+    group->mba = new_mba;
+    group->lock_fd = -1;
+    snprintf(group->path, sizeof(group->path), "%s/scorep_w%d_m%d", resctrl_root, new_ways,
+        new_mba);
+    struct stat st;
+    if (stat(group->path, &st) == 0)
+    {
+        if (!schemata_matches(group))
+        {
+            llog(LOG_WARN, "Group %s exists with a different schemata, not using it",
+                group->path);
+            return;
+        }
+        llog(LOG_DEBUG, "sharing group %s", group->path);
+    }
+    else
+    {
+        /* the root group uses one CLOSID */
+        int rt = (num_closids > 0 && count_ctrl_groups() >= num_closids - 1) ? -ENOSPC : 0;
+        if (rt == 0 && mkdir(group->path, 0755) != 0)
+        {
+            rt = -errno;
+        }
+        if (rt == -ENOSPC)
+        {
+            llog(LOG_WARN, "Out of CLOSIDs, no group for LLC_WAYS %d MBA_PERCENT %d", new_ways,
+                new_mba);
+            return;
+        }
+        if (rt < 0)
+        {
+            llog(LOG_WARN, "Could not create group %s: %s", group->path, strerror(-rt));
+            return;
+        }
+        rt = write_schemata(group);
+        if (rt < 0)
+        {
+            llog(LOG_WARN, "Could not write schemata of %s: %s", group->path, strerror(-rt));
+            rmdir(group->path);
+            return;
+        }
+        llog(LOG_DEBUG, "created group %s", group->path);
+    }
+
+    char lock_name[64];
+    snprintf(lock_name, sizeof(lock_name), "scorep_resctrl_w%d_m%d.lock", new_ways, new_mba);
+    group->lock_fd = lock_file(lock_name, LOCK_SH);
+    if (group->lock_fd < 0)
+    {
+        return;
+    }
+    num_groups++;
+}
+
+/**
+ * Creates the pool of resctrl groups and writes their schemata.
+ *
+ * Creates one group for each combination of the configured way counts and bandwidth
+ * percentages, as long as there are CLOSIDs left. The root group uses one CLOSID.
+ *
+ * @return 0 on success, <0 on failure
+ */
+static int create_groups()
+{
+    int ways[MAX_POOL_VALUES];
+    int mbas[MAX_POOL_VALUES];
+    int num_ways = 1;
+    int num_mbas = 1;
+
+    ways[0] = cbm_bits;
+    mbas[0] = 100;
+    if (l3_available)
+    {
+        int defaults[] = {cbm_bits / 4, cbm_bits / 2};
+        num_ways = parse_pool_values("SCOREP_TUNING_RESCTRL_PLUGIN_LLC_WAYS", defaults, 2,
+            cbm_bits, ways);
+    }
+    if (mb_available)
+    {
+        int defaults[] = {round_bandwidth(min_bandwidth), 50};
+        num_mbas = parse_pool_values("SCOREP_TUNING_RESCTRL_PLUGIN_MBA_PERCENT", defaults, 2, 100,
+            mbas);
+    }
+
+    groups = calloc(num_ways * num_mbas, sizeof(struct resctrl_group));
+    if (groups == NULL)
+    {
+        llog(LOG_WARN, "memory failure %s", strerror(errno));
+        return -errno;
+    }
+    int pool_fd = lock_file("scorep_resctrl.lock", LOCK_EX);
+    if (pool_fd < 0)
+    {
+        free(groups);
+        groups = NULL;
+        return pool_fd;
+    }
+
+    /* first pass creates the groups that tune a single dimension, as they are needed whenever
+     * only one of the actions is set */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int w = 0; w < num_ways; w++)
+        {
+            for (int m = 0; m < num_mbas; m++)
+            {
+                int single = ways[w] == cbm_bits || mbas[m] == 100;
+                if (single == pass)
+                {
+                    continue;
+                }
+                create_group(ways[w], mb_available ? round_bandwidth(mbas[m]) : 100);
+            }
+        }
+    }
+    close(pool_fd);
+    return 0;
+}
+
+/**
+ * Returns the path of a group, -1 is the root group.
+ */
+static const char *group_path(int group)
+{
+    return group < 0 ? resctrl_root : groups[group].path;
+}
+
+/**
+ * Moves a single thread to a group by writing its TID to the tasks file of the group.
+ *
+ * @return 0 on success, <0 on failure
+ */
+static int move_task(int fd, pid_t tid)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%d\n", (int) tid);
+    if (write(fd, buf, len) != len)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Moves all registered threads to a group. Has to be called with resctrl_mutex held.
+ *
+ * @return 0 on success, <0 on failure
+ */
+static int move_tasks(int group)
+{
+    char path[PATH_MAX];
+    int rt = 0;
+
+    snprintf(path, sizeof(path), "%s/tasks", group_path(group));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        llog(LOG_WARN, "Could not open %s: %s", path, strerror(errno));
+        return -errno;
+    }
+    for (int i = 0; i < num_tids; i++)
+    {
+        int err = move_task(fd, tids[i]);
+        if (err < 0)
+        {
+            llog(LOG_WARN, "Could not move thread %d to %s: %s", (int) tids[i], path,
+                strerror(-err));
+            rt = err;
+        }
+    }
+    close(fd);
+    return rt;
+}
+
+/**
+ * Looks up the group for the requested way count and bandwidth. If both are at their default,
+ * the root group is used.
+ *
+ * @return index of the group, -1 for the root group, -2 if the combination is not in the pool
+ */
+static int find_group(int ways, int mba)
+{
+    if (ways == -1 && mba == -1)
+    {
+        return -1;
+    }
+    ways = (ways == -1 || !l3_available) ? cbm_bits : ways;
+    mba = (mba == -1 || !mb_available) ? 100 : round_bandwidth(mba);
+    for (int g = 0; g < num_groups; g++)
+    {
+        if (groups[g].ways == ways && groups[g].mba == mba)
+        {
+            return g;
+        }
+    }
+    return -2;
+}
+
+/**
+ * Switches the registered threads to the group for the requested values.
+ * Only moves threads if the group actually changes.
+ *
+ * @return 0 on success, <0 on failure
+ */
+static int switch_group(int ways, int mba)
+{
+    int rt = 0;
+
+    pthread_mutex_lock(&resctrl_mutex);
+    int group = find_group(ways, mba);
+    if (group == -2)
+    {
+        llog(LOG_WARN, "No group for LLC_WAYS %d MBA_PERCENT %d in the pool", ways, mba);
+        pthread_mutex_unlock(&resctrl_mutex);
+        return -1;
+    }
+    current_ways = ways;
+    current_mba = mba;
+    if (group != current_group)
+    {
+        rt = move_tasks(group);
+        llog(LOG_DEBUG, "moved %d threads to %s", num_tids, group_path(group));
+        current_group = group;
+    }
+    pthread_mutex_unlock(&resctrl_mutex);
+    return rt;
+}
+
+/**
+ * Registers a thread. It is moved to the current group if that is not the root group.
+ */
+static void register_tid(pid_t tid)
+{
+    pthread_mutex_lock(&resctrl_mutex);
+    if (num_tids == tids_capacity)
+    {
+        int new_capacity = tids_capacity == 0 ? 16 : tids_capacity * 2;
+        pid_t *new_tids = realloc(tids, new_capacity * sizeof(pid_t));
+        if (new_tids == NULL)
+        {
+            llog(LOG_WARN, "memory failure %s", strerror(errno));
+            pthread_mutex_unlock(&resctrl_mutex);
+            return;
+        }
+        tids = new_tids;
+        tids_capacity = new_capacity;
+    }
+    tids[num_tids++] = tid;
+    llog(LOG_DEBUG, "registered thread %d", (int) tid);
+
+    if (current_group >= 0)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/tasks", group_path(current_group));
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0 || move_task(fd, tid) < 0)
+        {
+            llog(LOG_WARN, "Could not move thread %d to %s: %s", (int) tid, path,
+                strerror(errno));
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    pthread_mutex_unlock(&resctrl_mutex);
+}
+
+/**
+ * Initialize the plugin
+ *
+ * Reads the resctrl capabilities and creates the pool of groups.
+ *
+ * @return 0 at success, <0 at failure
+ */
+int32_t init()
+{
+    llog(LOG_DEBUG, "GIT revision: %s", GIT_REV);
+    llog(LOG_VERBOSE, "RESCTRL tuning plugin: initializing");
+
+    const char *root = getenv("SCOREP_TUNING_RESCTRL_PLUGIN_ROOT");
+    snprintf(resctrl_root, sizeof(resctrl_root), "%s", root != NULL ? root : DEFAULT_RESCTRL_ROOT);
+    const char *locks = getenv("SCOREP_TUNING_RESCTRL_PLUGIN_LOCK_DIR");
+    snprintf(lock_dir, sizeof(lock_dir), "%s", locks != NULL ? locks : DEFAULT_LOCK_DIR);
+
+    int rt = read_resctrl_info();
+    if (rt < 0)
+    {
+        llog(LOG_WARN, "No usable resctrl file system found at %s: %s", resctrl_root,
+            strerror(-rt));
+        return -1;
+    }
+
+    rt = create_groups();
+    if (rt < 0)
+    {
+        return rt;
+    }
+    llog(LOG_INFO, "created %d resctrl groups", num_groups);
+
+    register_tid(syscall(SYS_gettid));
+    return 0;
+}
+
+/**
+ * Registers the thread ID of a new CPU thread.
+ */
+void create_location(RRL_LocationType location_type, uint32_t location_id)
+{
+    llog(LOG_DEBUG, "create_location for location %u with typ %u ", location_id, location_type);
+    if (location_type == RRL_LOCATION_TYPE_CPU_THREAD)
+    {
+        pid_t tid = syscall(SYS_gettid);
+        pthread_mutex_lock(&resctrl_mutex);
+        for (int i = 0; i < num_tids; i++)
+        {
+            if (tids[i] == tid)
+            {
+                pthread_mutex_unlock(&resctrl_mutex);
+                return;
+            }
+        }
+        pthread_mutex_unlock(&resctrl_mutex);
+        register_tid(tid);
+    }
+}
+
+/**
+ * Unregisters the thread ID of a CPU thread that ends, so later moves skip it.
+ */
+void delete_location(RRL_LocationType location_type, uint32_t location_id)
+{
+    llog(LOG_DEBUG, "delete_location for location %u with typ %u ", location_id, location_type);
+    if (location_type == RRL_LOCATION_TYPE_CPU_THREAD)
+    {
+        pid_t tid = syscall(SYS_gettid);
+        pthread_mutex_lock(&resctrl_mutex);
+        for (int i = 0; i < num_tids; i++)
+        {
+            if (tids[i] == tid)
+            {
+                tids[i] = tids[--num_tids];
+                llog(LOG_DEBUG, "unregistered thread %d", (int) tid);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&resctrl_mutex);
+    }
+}
+
+/**
+ * finalising the plugin
+ *
+ * moves all threads back to the root group and removes the groups no other process uses.
+ */
+void fini()
+{
+    llog(LOG_INFO, "RESCTRL tuning plugin: finalising");
+    pthread_mutex_lock(&resctrl_mutex);
+    if (current_group >= 0)
+    {
+        move_tasks(-1);
+        current_group = -1;
+    }
+    int pool_fd = num_groups > 0 ? lock_file("scorep_resctrl.lock", LOCK_EX) : -1;
+    for (int g = 0; g < num_groups; g++)
+    {
+        /* the shared lock can only become exclusive if no other process holds one */
+        if (pool_fd >= 0 && flock(groups[g].lock_fd, LOCK_EX | LOCK_NB) != 0)
+        {
+            llog(LOG_DEBUG, "group %s is still used by other processes", groups[g].path);
+        }
+        else if (pool_fd >= 0 && rmdir(groups[g].path) != 0)
+        {
+            llog(LOG_DEBUG, "Could not remove group %s: %s", groups[g].path, strerror(errno));
+        }
+        close(groups[g].lock_fd);
+    }
+    if (pool_fd >= 0)
+    {
+        close(pool_fd);
+    }
+    free(groups);
+    groups = NULL;
+    num_groups = 0;
+    free(tids);
+    tids = NULL;
+    num_tids = 0;
+    tids_capacity = 0;
+    pthread_mutex_unlock(&resctrl_mutex);
+}
+
+/**
+ * Set the number of LLC ways
+ *
+ * @param[in] new_settings number of ways or -1 for default
+ * @return 0 on success or <0 on failure
+ */
+static int scorep_set_llc_ways(int new_settings)
+{
+    if (!l3_available)
+    {
+        llog(LOG_DEBUG, "L3 allocation not available, ignoring LLC_WAYS = %d", new_settings);
+        return -1;
+    }
+    return switch_group(new_settings, current_mba);
+}
+
+static int scorep_get_llc_ways()
+{
+    return current_ways == -1 ? cbm_bits : current_ways;
+}
+
+/**
+ * Set the memory bandwidth percentage
+ *
+ * @param[in] new_settings bandwidth in percent or -1 for default
+ * @return 0 on success or <0 on failure
+ */
+static int scorep_set_mba_percent(int new_settings)
+{
+    if (!mb_available)
+    {
+        llog(LOG_DEBUG, "MB allocation not available, ignoring MBA_PERCENT = %d", new_settings);
+        return -1;
+    }
+    return switch_group(current_ways, new_settings);
+}
+
+static int scorep_get_mba_percent()
+{
+    return current_mba == -1 ? 100 : round_bandwidth(current_mba);
+}
+
+/**
+ * ScoreP array for plugin definitions
+ */
+static rrl_tuning_action_info return_values[] = {
+    {
+        .name = "LLC_WAYS",
+        .current_config = &scorep_get_llc_ways,
+        .enter_region_set_config = &scorep_set_llc_ways,
+        .exit_region_set_config = &scorep_set_llc_ways,
+    },
+    {
+        .name = "MBA_PERCENT",
+        .current_config = &scorep_get_mba_percent,
+        .enter_region_set_config = &scorep_set_mba_percent,
+        .exit_region_set_config = &scorep_set_mba_percent,
+    },
+    {
+        .name = NULL,
+        .current_config = NULL,
+        .enter_region_set_config = NULL,
+        .exit_region_set_config = NULL,
+    }};
+
+/**
+ * ScoreP function to get plugin definitions
+ *
+ * @param return return_values.
+ */
+rrl_tuning_action_info *get_tuning_info()
+{
+    return return_values;
+}
+
+/**
+ * Macro to setup the plugin
+ */
+RRL_TUNING_PLUGIN_ENTRY(resctrl_plugin)
+{
+    /* Initialize info data (with zero) */
+    rrl_tuning_plugin_info info;
+    memset(&info, 0, sizeof(rrl_tuning_plugin_info));
+
+    /* Set up */
+    info.plugin_version = RRL_TUNING_PLUGIN_VERSION;
+    info.initialize = init;
+    info.get_tuning_info = get_tuning_info;
+    info.finalize = fini;
+    info.create_location = create_location;
+    info.delete_location = delete_location;
+    return info;
+}
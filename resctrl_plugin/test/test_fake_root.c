@@ -0,0 +1,269 @@
+/**
+ * @file test_fake_root.c
+ *
+ * @brief Tests the resctrl plugin against a fake resctrl file system
+ *
+ * Builds a directory with the info/, schemata and tasks files of a system with 20 L3 ways and
+ * two domains, switches the tuning actions and checks the schemata and tasks files the plugin
+ * writes. Existing groups of other processes are shared if their schemata matches, and only
+ * removed by their last user.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <scorep/rrl_tuning_plugins.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+rrl_tuning_plugin_info RRL_TUNING_PLUGIN_resctrl_plugin(void);
+
+static char root[64];
+static int failures;
+
+#define CHECK(cond)                                                                                \
+    do                                                                                             \
+    {                                                                                              \
+        if (!(cond))                                                                               \
+        {                                                                                          \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);               \
+            failures++;                                                                            \
+        }                                                                                          \
+    } while (0)
+
+static void write_file(const char *name, const char *content)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    fputs(content, file);
+    fclose(file);
+}
+
+/**
+ * Reads a file of the fake root into buf, an empty string if it does not exist.
+ */
+static const char *read_file(const char *name, char *buf, size_t size)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    buf[0] = '\0';
+    FILE *file = fopen(path, "r");
+    if (file != NULL)
+    {
+        size_t len = fread(buf, 1, size - 1, file);
+        buf[len] = '\0';
+        fclose(file);
+    }
+    return buf;
+}
+
+/**
+ * Checks that the tasks file of a group contains exactly the given TIDs, and truncates it, so
+ * the next check only sees new moves.
+ */
+static void check_tasks(const char *group, const char *expected)
+{
+    char name[128];
+    char buf[256];
+    if (group == NULL)
+    {
+        snprintf(name, sizeof(name), "tasks");
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "scorep_%s/tasks", group);
+    }
+    read_file(name, buf, sizeof(buf));
+    if (strcmp(buf, expected) != 0)
+    {
+        fprintf(stderr, "%s: expected \"%s\", got \"%s\"\n", name, expected, buf);
+        failures++;
+    }
+    write_file(name, "");
+}
+
+static void check_schemata(const char *group, const char *expected)
+{
+    char name[128];
+    char buf[256];
+    snprintf(name, sizeof(name), "scorep_%s/schemata", group);
+    read_file(name, buf, sizeof(buf));
+    if (strcmp(buf, expected) != 0)
+    {
+        fprintf(stderr, "%s: expected \"%s\", got \"%s\"\n", name, expected, buf);
+        failures++;
+    }
+}
+
+static int exists(const char *name)
+{
+    char path[256];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    return stat(path, &st) == 0;
+}
+
+/**
+ * Removes the files the plugin created in a group, so rmdir works on the fake root like on
+ * resctrl.
+ */
+static void empty_group(const char *group)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/scorep_%s/schemata", root, group);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/scorep_%s/tasks", root, group);
+    unlink(path);
+}
+
+static rrl_tuning_action_info *find_action(rrl_tuning_action_info *actions, const char *name)
+{
+    for (int i = 0; actions[i].name != NULL; i++)
+    {
+        if (strcmp(actions[i].name, name) == 0)
+        {
+            return &actions[i];
+        }
+    }
+    return NULL;
+}
+
+static rrl_tuning_plugin_info plugin;
+static pid_t thread_tid;
+
+static void *thread_main(void *arg)
+{
+    (void) arg;
+    thread_tid = syscall(SYS_gettid);
+    plugin.create_location(RRL_LOCATION_TYPE_CPU_THREAD, 1);
+    plugin.delete_location(RRL_LOCATION_TYPE_CPU_THREAD, 1);
+    return NULL;
+}
+
+int main()
+{
+    char tid_line[32];
+    char thread_line[64];
+    char cmd[256];
+
+    snprintf(root, sizeof(root), "/tmp/resctrl_test_XXXXXX");
+    if (mkdtemp(root) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(cmd, sizeof(cmd),
+        "mkdir -p %s/info/L3 %s/info/MB %s/scorep_w4_m100 %s/scorep_w20_m100", root, root, root,
+        root);
+    if (system(cmd) != 0)
+    {
+        return 1;
+    }
+    write_file("info/L3/cbm_mask", "fffff\n");
+    write_file("info/L3/min_cbm_bits", "1\n");
+    write_file("info/L3/num_closids", "16\n");
+    write_file("info/MB/min_bandwidth", "10\n");
+    write_file("info/MB/bandwidth_gran", "10\n");
+    write_file("info/MB/num_closids", "8\n");
+    write_file("schemata", "    L3:0=fffff;1=fffff\n    MB:0=100;1=100\n");
+    write_file("tasks", "");
+    /* groups of another process, one matching its configuration, one not */
+    write_file("scorep_w4_m100/schemata", "    L3:0=0000f;1=0000f\n    MB:0=100;1=100\n");
+    write_file("scorep_w20_m100/schemata", "    L3:0=000ff;1=000ff\n    MB:0=100;1=100\n");
+
+    setenv("SCOREP_TUNING_RESCTRL_PLUGIN_ROOT", root, 1);
+    setenv("SCOREP_TUNING_RESCTRL_PLUGIN_LOCK_DIR", root, 1);
+    setenv("SCOREP_TUNING_RESCTRL_PLUGIN_LLC_WAYS", "4", 1);
+    setenv("SCOREP_TUNING_RESCTRL_PLUGIN_MBA_PERCENT", "50", 1);
+
+    plugin = RRL_TUNING_PLUGIN_resctrl_plugin();
+    if (plugin.initialize() != 0)
+    {
+        fprintf(stderr, "initialize failed\n");
+        return 1;
+    }
+    rrl_tuning_action_info *actions = plugin.get_tuning_info();
+    rrl_tuning_action_info *llc_ways = find_action(actions, "LLC_WAYS");
+    rrl_tuning_action_info *mba_percent = find_action(actions, "MBA_PERCENT");
+    CHECK(llc_ways != NULL && mba_percent != NULL);
+    if (llc_ways == NULL || mba_percent == NULL)
+    {
+        return 1;
+    }
+
+    /* pool of 4 and 20 ways times 50 and 100 percent, the existing groups are not rewritten */
+    check_schemata("w4_m100", "    L3:0=0000f;1=0000f\n    MB:0=100;1=100\n");
+    check_schemata("w20_m50", "L3:0=fffff;1=fffff\nMB:0=50;1=50\n");
+    check_schemata("w4_m50", "L3:0=f;1=f\nMB:0=50;1=50\n");
+    check_schemata("w20_m100", "    L3:0=000ff;1=000ff\n    MB:0=100;1=100\n");
+
+    snprintf(tid_line, sizeof(tid_line), "%d\n", (int) syscall(SYS_gettid));
+
+    CHECK(llc_ways->enter_region_set_config(4) == 0);
+    CHECK(llc_ways->current_config() == 4);
+    check_tasks("w4_m100", tid_line);
+
+    CHECK(mba_percent->enter_region_set_config(50) == 0);
+    CHECK(mba_percent->current_config() == 50);
+    check_tasks("w4_m50", tid_line);
+
+    /* a new thread is moved to the current group when it is created, and not moved anymore
+     * after it is deleted */
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_main, NULL);
+    pthread_join(thread, NULL);
+    snprintf(thread_line, sizeof(thread_line), "%d\n", (int) thread_tid);
+    check_tasks("w4_m50", thread_line);
+
+    CHECK(llc_ways->enter_region_set_config(-1) == 0);
+    check_tasks("w20_m50", tid_line);
+
+    /* not in the pool, the threads stay where they are */
+    CHECK(mba_percent->enter_region_set_config(30) < 0);
+    check_tasks("w20_m50", "");
+
+    CHECK(mba_percent->enter_region_set_config(-1) == 0);
+    check_tasks(NULL, tid_line);
+
+    /* the group with the different schemata is not used */
+    CHECK(mba_percent->enter_region_set_config(100) < 0);
+
+    /* another process still uses w4_m50 */
+    char lock_path[256];
+    snprintf(lock_path, sizeof(lock_path), "%s/scorep_resctrl_w4_m50.lock", root);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0600);
+    CHECK(lock_fd >= 0 && flock(lock_fd, LOCK_SH) == 0);
+    empty_group("w4_m100");
+    empty_group("w4_m50");
+    empty_group("w20_m50");
+
+    plugin.finalize();
+
+    CHECK(!exists("scorep_w4_m100"));
+    CHECK(!exists("scorep_w20_m50"));
+    CHECK(exists("scorep_w4_m50"));
+    CHECK(exists("scorep_w20_m100/schemata"));
+    close(lock_fd);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    if (system(cmd) != 0)
+    {
+        fprintf(stderr, "could not remove %s\n", root);
+    }
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,593 @@
+/**
+ * @file sched_plugin.c
+ *
+ * @brief Tuning Plugin for the scheduling class and the timer slack of threads
+ *
+ * Every thread registered through create_location keeps its own state. Values are cached per
+ * thread, so a region that requests the setting a thread already has costs no system call.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <scorep/rrl_tuning_plugins.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define PLUGIN_NAME "SCHED_TP"
+
+/**
+ * SCHED_POLICY is encoded as policy * SCHED_POLICY_FACTOR + priority, with the policy being one
+ * of SCHED_OTHER (0), SCHED_FIFO (1), SCHED_RR (2) or SCHED_BATCH (3). The priority is the
+ * real time priority for SCHED_FIFO and SCHED_RR, and has to be 0 for the other policies.
+ * E.g. 1050 is SCHED_FIFO with priority 50.
+ */
+#define SCHED_POLICY_FACTOR 1000
+
+/**
+ * struct sched_attr, as expected by the sched_setattr system call (SCHED_ATTR_SIZE_VER0)
+ */
+struct thread_sched_attr
+{
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+struct thread_state
+{
+    pid_t tid;             /**< 0 for the slot of a thread that ended */
+    struct thread_sched_attr default_attr;
+    int sched_policy;      /**< encoded policy applied to the thread, -1 for default */
+    long default_slack;    /**< timer slack found at registration */
+    long timer_slack;      /**< timer slack applied to the thread, -1 for default */
+    long requested_slack;  /**< timer slack requested for the thread */
+};
+
+static struct thread_state *threads;
+static int num_threads;
+static int threads_capacity;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int current_sched_policy = -1;
+static long current_timer_slack = -1;
+
+/* set once writing the timer slack of another thread was denied, see apply_timer_slacks */
+static int proc_slack_denied;
+
+/* index of the calling thread in threads, -1 if not registered */
+static __thread int thread_index = -1;
+
+typedef enum { LOG_VERBOSE, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_INVALID } log_level;
+
+/**
+ * log function.
+ *
+ * Prints messages depending on the entry in SCOREP_TUNING_SCHED_PLUGIN_VERBOSE.
+ *
+ * Currently implemented log levels are:
+ *
+ *	* LOG_VERBOSE
+ *	* LOG_WARN
+ *	* LOG_INFO
+ *	* LOG_DEBUG
+ *
+ * @param[in] msg_level level of message
+ * @param[in] message_fmt printf like message
+ * @param[in] ... printf like parameters for the message
+ */
+void llog(log_level msg_level, const char *message_fmt, ...)
+{
+    static char *level_str = NULL;
+    static log_level level = LOG_INVALID;
+    if (level == LOG_INVALID)
+    {
+        level_str = getenv("SCOREP_TUNING_SCHED_PLUGIN_VERBOSE");
+        if (level_str == NULL)
+        {
+            level = LOG_WARN;
+        }
+        else if (strcmp(level_str, "DEBUG") == 0)
+        {
+            level = LOG_DEBUG;
+        }
+        else if (strcmp(level_str, "INFO") == 0)
+        {
+            level = LOG_INFO;
+        }
+        else if (strcmp(level_str, "WARN") == 0)
+        {
+            level = LOG_WARN;
+        }
+        else if (strcmp(level_str, "VERBOSE") == 0)
+        {
+            level = LOG_VERBOSE;
+        }
+        else
+        {
+            level = LOG_WARN;
+        }
+    }
+    if (msg_level <= level)
+    {
+        char *output_fmt = (char *) malloc(strlen(message_fmt) + strlen(PLUGIN_NAME) + 5);
+        strcpy(output_fmt, "[");
+        strcpy(output_fmt + 1, PLUGIN_NAME);
+        strcpy(output_fmt + 1 + strlen(PLUGIN_NAME), "]");
+        strcpy(output_fmt + 2 + strlen(PLUGIN_NAME), message_fmt);
+        strcpy(output_fmt + 2 + strlen(PLUGIN_NAME) + strlen(message_fmt), "\n");
+        va_list args;
+        va_start(args, message_fmt);
+        vprintf(output_fmt, args);
+        va_end(args);
+    }
+}
+
+static int sys_sched_setattr(pid_t tid, struct thread_sched_attr *attr)
+{
+    return syscall(SYS_sched_setattr, tid, attr, 0);
+}
+
+static int sys_sched_getattr(pid_t tid, struct thread_sched_attr *attr)
+{
+    return syscall(SYS_sched_getattr, tid, attr, sizeof(struct thread_sched_attr), 0);
+}
+
+/**
+ * Checks an encoded scheduling policy and converts it to a sched_attr.
+ *
+ * @return 0 if the policy is valid, -1 otherwise
+ */
+static int decode_sched_policy(int encoded, struct thread_sched_attr *attr)
+{
+    int policy = encoded / SCHED_POLICY_FACTOR;
+    int priority = encoded % SCHED_POLICY_FACTOR;
+
+    if (encoded < 0)
+    {
+        return -1;
+    }
+    memset(attr, 0, sizeof(struct thread_sched_attr));
+    attr->size = sizeof(struct thread_sched_attr);
+    attr->sched_policy = policy;
+    switch (policy)
+    {
+        case SCHED_OTHER:
+        case SCHED_BATCH:
+            if (priority != 0)
+            {
+                return -1;
+            }
+            break;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            if (priority < sched_get_priority_min(policy) ||
+                priority > sched_get_priority_max(policy))
+            {
+                return -1;
+            }
+            attr->sched_priority = priority;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Applies an encoded scheduling policy to a registered thread, unless the thread has it
+ * already. Has to be called with threads_mutex held.
+ *
+ * @return 0 on success, <0 on failure
+ */
+static int apply_sched_policy(struct thread_state *thread, int encoded)
+{
+    struct thread_sched_attr attr;
+
+    if (thread->tid == 0 || thread->sched_policy == encoded)
+    {
+        return 0;
+    }
+    if (encoded == -1)
+    {
+        attr = thread->default_attr;
+    }
+    else
+    {
+        decode_sched_policy(encoded, &attr);
+    }
+    if (sys_sched_setattr(thread->tid, &attr) != 0)
+    {
+        int err = errno;
+        if (err == ESRCH)
+        {
+            llog(LOG_DEBUG, "thread %d is gone", (int) thread->tid);
+        }
+        else
+        {
+            llog(LOG_WARN, "Could not set scheduling policy %d for thread %d: %s", encoded,
+                (int) thread->tid, strerror(err));
+        }
+        return -err;
+    }
+    llog(LOG_DEBUG, "set scheduling policy of thread %d from %d to %d", (int) thread->tid,
+        thread->sched_policy, encoded);
+    thread->sched_policy = encoded;
+    return 0;
+}
+
+/**
+ * Writes the timer slack of a thread to /proc/<tid>/timerslack_ns.
+ *
+ * @return 0 on success, <0 on failure
+ */
+static int write_timer_slack(pid_t tid, long slack)
+{
+    char path[64];
+    char buf[32];
+
+    snprintf(path, sizeof(path), "/proc/%d/timerslack_ns", (int) tid);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+    {
+        return -errno;
+    }
+    int len = snprintf(buf, sizeof(buf), "%ld", slack);
+    int rt = write(fd, buf, len) == len ? 0 : -errno;
+    close(fd);
+    return rt;
+}
+
+/**
+ * Applies the requested timer slack to all registered threads but the calling one through
+ * /proc/<tid>/timerslack_ns. Writing the file of another thread needs CAP_SYS_NICE. Without it,
+ * the threads apply the slack themselves in sync_timer_slack the next time they call into the
+ * plugin. Has to be called with threads_mutex held.
+ */
+static void apply_timer_slacks()
+{
+    if (proc_slack_denied)
+    {
+        return;
+    }
+    for (int i = 0; i < num_threads; i++)
+    {
+        struct thread_state *thread = &threads[i];
+        if (i == thread_index || thread->tid == 0 ||
+            thread->timer_slack == thread->requested_slack)
+        {
+            continue;
+        }
+        long slack =
+            thread->requested_slack == -1 ? thread->default_slack : thread->requested_slack;
+        int err = write_timer_slack(thread->tid, slack);
+        if (err == -EPERM || err == -EACCES)
+        {
+            llog(LOG_INFO, "Can not set the timer slack of other threads: %s, threads apply "
+                           "it when they call into the plugin",
+                strerror(-err));
+            proc_slack_denied = 1;
+            return;
+        }
+        if (err == -ENOENT || err == -ESRCH)
+        {
+            llog(LOG_DEBUG, "thread %d is gone", (int) thread->tid);
+        }
+        else if (err < 0)
+        {
+            llog(LOG_WARN, "Could not set timer slack %ld for thread %d: %s", slack,
+                (int) thread->tid, strerror(-err));
+        }
+        else
+        {
+            llog(LOG_DEBUG, "set timer slack of thread %d from %ld to %ld", (int) thread->tid,
+                thread->timer_slack, thread->requested_slack);
+            thread->timer_slack = thread->requested_slack;
+        }
+    }
+}
+
+/**
+ * Applies the requested timer slack to the calling thread with PR_SET_TIMERSLACK, which needs
+ * no privileges. Also catches up on the slack apply_timer_slacks could not set.
+ */
+static void sync_timer_slack()
+{
+    if (thread_index < 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&threads_mutex);
+    struct thread_state *thread = &threads[thread_index];
+    if (thread->timer_slack != thread->requested_slack)
+    {
+        long slack =
+            thread->requested_slack == -1 ? thread->default_slack : thread->requested_slack;
+        if (prctl(PR_SET_TIMERSLACK, (unsigned long) slack, 0, 0, 0) != 0)
+        {
+            llog(LOG_WARN, "Could not set timer slack %ld for thread %d: %s", slack,
+                (int) thread->tid, strerror(errno));
+        }
+        else
+        {
+            llog(LOG_DEBUG, "set timer slack of thread %d from %ld to %ld", (int) thread->tid,
+                thread->timer_slack, thread->requested_slack);
+            thread->timer_slack = thread->requested_slack;
+        }
+    }
+    pthread_mutex_unlock(&threads_mutex);
+}
+
+/**
+ * Registers the calling thread. Saves its scheduling attributes and timer slack, and applies
+ * the current settings to it. Reuses the slot of a thread that ended.
+ */
+static void register_thread()
+{
+    pid_t tid = syscall(SYS_gettid);
+    int index = -1;
+
+    pthread_mutex_lock(&threads_mutex);
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (threads[i].tid == tid)
+        {
+            thread_index = i;
+            pthread_mutex_unlock(&threads_mutex);
+            return;
+        }
+        if (threads[i].tid == 0 && index < 0)
+        {
+            index = i;
+        }
+    }
+    if (index < 0 && num_threads == threads_capacity)
+    {
+        int new_capacity = threads_capacity == 0 ? 16 : threads_capacity * 2;
+        struct thread_state *new_threads =
+            realloc(threads, new_capacity * sizeof(struct thread_state));
+        if (new_threads == NULL)
+        {
+            llog(LOG_WARN, "memory failure %s", strerror(errno));
+            pthread_mutex_unlock(&threads_mutex);
+            return;
+        }
+        threads = new_threads;
+        threads_capacity = new_capacity;
+    }
+
+    if (index < 0)
+    {
+        index = num_threads;
+    }
+    struct thread_state *thread = &threads[index];
+    memset(thread, 0, sizeof(struct thread_state));
+    if (sys_sched_getattr(tid, &thread->default_attr) != 0)
+    {
+        llog(LOG_WARN, "sched_getattr failed for thread %d: %s", (int) tid, strerror(errno));
+        pthread_mutex_unlock(&threads_mutex);
+        return;
+    }
+    thread->tid = tid;
+    thread->default_attr.size = sizeof(struct thread_sched_attr);
+    thread->sched_policy = -1;
+    thread->default_slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+    thread->timer_slack = -1;
+    thread->requested_slack = current_timer_slack;
+    thread_index = index;
+    if (index == num_threads)
+    {
+        num_threads++;
+    }
+    llog(LOG_DEBUG, "registered thread %d, timer slack %ld", (int) tid, thread->default_slack);
+
+    apply_sched_policy(thread, current_sched_policy);
+    pthread_mutex_unlock(&threads_mutex);
+
+    sync_timer_slack();
+}
+
+/**
+ * Initialize the plugin
+ *
+ * Registers the calling thread.
+ *
+ * @return 0 at success
+ */
+int32_t init()
+{
+    llog(LOG_DEBUG, "GIT revision: %s", GIT_REV);
+    llog(LOG_VERBOSE, "SCHED tuning plugin: initializing");
+    register_thread();
+    return 0;
+}
+
+/**
+ * Registers the thread ID of a new CPU thread.
+ */
+void create_location(RRL_LocationType location_type, uint32_t location_id)
+{
+    llog(LOG_DEBUG, "create_location for location %u with typ %u ", location_id, location_type);
+    if (location_type == RRL_LOCATION_TYPE_CPU_THREAD)
+    {
+        register_thread();
+    }
+}
+
+/**
+ * Unregisters a CPU thread that ends, so its thread ID is no longer tuned or restored once the
+ * kernel reuses it for another task.
+ */
+void delete_location(RRL_LocationType location_type, uint32_t location_id)
+{
+    llog(LOG_DEBUG, "delete_location for location %u with typ %u ", location_id, location_type);
+    if (location_type != RRL_LOCATION_TYPE_CPU_THREAD || thread_index < 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&threads_mutex);
+    llog(LOG_DEBUG, "unregistered thread %d", (int) threads[thread_index].tid);
+    threads[thread_index].tid = 0;
+    thread_index = -1;
+    pthread_mutex_unlock(&threads_mutex);
+}
+
+/**
+ * finalising the plugin
+ *
+ * restores the scheduling attributes and the timer slack of all registered threads.
+ */
+void fini()
+{
+    llog(LOG_INFO, "SCHED tuning plugin: finalising");
+    pthread_mutex_lock(&threads_mutex);
+    current_sched_policy = -1;
+    current_timer_slack = -1;
+    for (int i = 0; i < num_threads; i++)
+    {
+        apply_sched_policy(&threads[i], -1);
+        threads[i].requested_slack = -1;
+    }
+    apply_timer_slacks();
+    pthread_mutex_unlock(&threads_mutex);
+    sync_timer_slack();
+}
+
+/**
+ * Set the scheduling policy of all registered threads
+ *
+ * @param[in] new_settings encoded policy, see SCHED_POLICY_FACTOR, or -1 for default
+ * @return 0 on success or <0 on failure
+ */
+static int scorep_set_sched_policy(int new_settings)
+{
+    struct thread_sched_attr attr;
+    int rt = 0;
+
+    sync_timer_slack();
+    if (new_settings != -1 && decode_sched_policy(new_settings, &attr) != 0)
+    {
+        llog(LOG_WARN, "Invalid scheduling policy %d received", new_settings);
+        return -1;
+    }
+
+    pthread_mutex_lock(&threads_mutex);
+    current_sched_policy = new_settings;
+    for (int i = 0; i < num_threads; i++)
+    {
+        int err = apply_sched_policy(&threads[i], new_settings);
+        if (err < 0 && err != -ESRCH)
+        {
+            rt = err;
+        }
+    }
+    pthread_mutex_unlock(&threads_mutex);
+    return rt;
+}
+
+static int scorep_get_sched_policy()
+{
+    sync_timer_slack();
+    return current_sched_policy;
+}
+
+/**
+ * Set the timer slack of all registered threads
+ *
+ * The kernel treats a slack of 0 as a request for the default slack of the thread, so 0 is
+ * rejected; 1 is the smallest slack.
+ *
+ * @param[in] new_settings timer slack in ns, or -1 for default
+ * @return 0 on success or <0 on failure
+ */
+static int scorep_set_timer_slack(int new_settings)
+{
+    if (new_settings < -1 || new_settings == 0)
+    {
+        llog(LOG_WARN, "Invalid timer slack %d received", new_settings);
+        return -1;
+    }
+
+    pthread_mutex_lock(&threads_mutex);
+    current_timer_slack = new_settings;
+    for (int i = 0; i < num_threads; i++)
+    {
+        threads[i].requested_slack = new_settings;
+    }
+    apply_timer_slacks();
+    pthread_mutex_unlock(&threads_mutex);
+
+    sync_timer_slack();
+    return 0;
+}
+
+static int scorep_get_timer_slack()
+{
+    sync_timer_slack();
+    return (int) current_timer_slack;
+}
+
+/**
+ * ScoreP array for plugin definitions
+ */
+static rrl_tuning_action_info return_values[] = {
+    {
+        .name = "SCHED_POLICY",
+        .current_config = &scorep_get_sched_policy,
+        .enter_region_set_config = &scorep_set_sched_policy,
+        .exit_region_set_config = &scorep_set_sched_policy,
+    },
+    {
+        .name = "TIMER_SLACK_NS",
+        .current_config = &scorep_get_timer_slack,
+        .enter_region_set_config = &scorep_set_timer_slack,
+        .exit_region_set_config = &scorep_set_timer_slack,
+    },
+    {
+        .name = NULL,
+        .current_config = NULL,
+        .enter_region_set_config = NULL,
+        .exit_region_set_config = NULL,
+    }};
+
+/**
+ * ScoreP function to get plugin definitions
+ *
+ * @param return return_values.
+ */
+rrl_tuning_action_info *get_tuning_info()
+{
+    return return_values;
+}
+
+/**
+ * Macro to setup the plugin
+ */
+RRL_TUNING_PLUGIN_ENTRY(sched_plugin)
+{
+    /* Initialize info data (with zero) */
+    rrl_tuning_plugin_info info;
+    memset(&info, 0, sizeof(rrl_tuning_plugin_info));
+
+    /* Set up */
+    info.plugin_version = RRL_TUNING_PLUGIN_VERSION;
+    info.initialize = init;
+    info.get_tuning_info = get_tuning_info;
+    info.finalize = fini;
+    info.create_location = create_location;
+    info.delete_location = delete_location;
+    return info;
+}